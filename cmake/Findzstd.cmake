@@ -0,0 +1,23 @@
+# ZSTD_FOUND - system has the zstd library
+# ZSTD_INCLUDE_DIR - the zstd include directory
+# ZSTD_LIBRARIES - The libraries needed to use zstd
+
+if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+  set(ZSTD_FOUND TRUE)
+else(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+
+  find_path(ZSTD_INCLUDE_DIR NAMES zstd.h)
+  find_library(ZSTD_LIBRARIES NAMES zstd zstd_static libzstd)
+
+  include(FindPackageHandleStandardArgs)
+  find_package_handle_standard_args(zstd DEFAULT_MSG ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
+
+  mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARIES)
+endif(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARIES)
+if (ZSTD_FOUND AND NOT TARGET zstd::zstd)
+  add_library(zstd::zstd UNKNOWN IMPORTED)
+  set_target_properties(zstd::zstd PROPERTIES
+          INTERFACE_INCLUDE_DIRECTORIES  ${ZSTD_INCLUDE_DIR})
+  set_property(TARGET zstd::zstd APPEND PROPERTY
+          IMPORTED_LOCATION "${ZSTD_LIBRARIES}")
+endif()
@@ -5,6 +5,7 @@
 #include <mutex>
 #include <deque>
 #include <map>
+#include <unordered_map>
 #include <iostream>
 #include <atomic>
 #include <boost/functional/hash.hpp>
@@ -12,7 +13,7 @@
 #include <vector>
 #include <protozero/data_view.hpp>
 #include "pooled_string.h"
-#include "deque_map.h"
+#include "concurrent_index_map.h"
 
 /* AttributeStore - global dictionary for attributes */
 
@@ -126,32 +127,6 @@ struct AttributePair {
 
 	void ensureStringIsOwned();
 
-	static bool isHot(const std::string& keyName, const protozero::data_view value) {
-		// Is this pair a candidate for the hot pool?
-
-		// Hot pairs are pairs that we think are likely to be re-used, like
-		// tunnel=0, highway=yes, and so on.
-		//
-		// The trick is that we commit to putting them in the hot pool
-		// before we know if we were right.
-
-		// The rules for floats/booleans are managed in their addAttribute call.
-
-		// Only strings that are IDish are eligible: only lowercase letters.
-		bool ok = true;
-		for (size_t i = 0; i < value.size(); i++) {
-			const auto c = value.data()[i];
-			if (c != '-' && c != '_' && (c < 'a' || c > 'z'))
-				return false;
-		}
-
-		// Keys that sound like name, name:en, etc, aren't eligible.
-		if (keyName.size() >= 4 && keyName[0] == 'n' && keyName[1] == 'a' && keyName[2] == 'm' && keyName[3])
-			return false;
-
-		return true;
-	}
-
 	size_t hash() const {
 		std::size_t rv = minzoom;
 		boost::hash_combine(rv, keyIndex);
@@ -176,53 +151,82 @@ struct AttributePair {
 #pragma pack(pop)
 
 
-// We shard the cold pools to reduce the odds of lock contention on
-// inserting/retrieving the "cold" pairs.
-//
-// It should be at least 2x the number of your cores -- 256 shards is probably
-// reasonable for most people.
+// We shard the cold pools, which gives each shard its own range of indexes
+// (the shard number is the top bits of the index). Lookups don't lock, but
+// inserting a new pair locks its shard, so sharding also reduces contention.
 //
 // We also reserve the bottom shard for the hot pool.
 #define SHARD_BITS 14
 #define ATTRIBUTE_SHARDS (1 << SHARD_BITS)
 
+// Pairs are counted while the first HOT_PAIR_SAMPLE_BLOCKS blocks of each
+// phase (nodes, ways, relations) are read. At the end of the phase, those seen
+// at least HOT_PAIR_MIN_COUNT times are promoted to the hot shard, most
+// frequent first.
+#define HOT_PAIR_SAMPLE_BLOCKS 256
+#define HOT_PAIR_MIN_COUNT 16
+
 class AttributeStore;
 class AttributePairStore {
 public:
-	AttributePairStore():
+	AttributePairStore(uint32_t sampleBlocks = HOT_PAIR_SAMPLE_BLOCKS):
 		finalized(false),
-		pairsMutex(ATTRIBUTE_SHARDS),
+		sampleBlocks(sampleBlocks),
+		sampledBlocks(0),
+		sampling(true),
+		lookupsUncached(0),
 		lookups(0),
-		lookupsUncached(0)
+		hotLookups(0)
 	{
 		// The "hot" shard has a capacity of 64K, the others are unbounded.
-		pairs.push_back(DequeMap<AttributePair>(1 << 16));
+		pairs.emplace_back(1 << 16);
 		// Reserve offset 0 as a sentinel
 		pairs[0].add(AttributePair(0, false, 0));
 		for (size_t i = 1; i < ATTRIBUTE_SHARDS; i++)
-			pairs.push_back(DequeMap<AttributePair>());
+			pairs.emplace_back();
 	}
 
-	void finalize() { finalized = true; }
+	void finalize();
 	const AttributePair& getPair(uint32_t i) const;
 	const AttributePair& getPairUnsafe(uint32_t i) const;
-	uint32_t addPair(AttributePair& pair, bool isHot);
+	uint32_t addPair(AttributePair& pair);
 
+	// Called after reading each block that may have added attributes
+	void blockDone();
+	// Promotes the pairs sampled in this phase, then samples the next one.
+	// Must be called when no other thread is adding pairs. Returns whether
+	// any pair was promoted.
+	bool endPhase();
 
 private:
 	friend class AttributeStore;
-	std::vector<DequeMap<AttributePair>> pairs;
-	bool finalized;
 	// We refer to all attribute pairs by index.
 	//
 	// Each shard is responsible for a portion of the key space.
 	// 
 	// The 0th shard is special: it's the hot shard, for pairs
-	// we suspect will be popular. It only ever has 64KB items,
+	// we expect to be popular. It only ever has 64KB items,
 	// so that we can reference it with a short.
-	mutable std::vector<std::mutex> pairsMutex;
+	//
+	// Every pair is looked for in it, but pairs only join it at the end of
+	// a phase whose sample has shown that they're popular.
+	std::deque<ConcurrentIndexMap<AttributePair>> pairs;
+	bool finalized;
+
+	// The cold index of each promoted pair, and the hot index it has now
+	std::unordered_map<uint32_t, uint32_t> promotedPairs;
+
+	void mergeSample();
+	bool promoteHotPairs();
+	const uint32_t sampleBlocks;
+	std::mutex sampleMutex;
+	std::unordered_map<uint32_t, uint32_t> sampleCounts;	// cold pair index -> times seen
+	uint32_t sampledBlocks;
+	std::atomic<bool> sampling;
+
 	std::atomic<uint64_t> lookupsUncached;
 	std::atomic<uint64_t> lookups;
+	std::atomic<uint64_t> hotLookups;
 };
 
 // AttributeSet is a set of AttributePairs
@@ -407,6 +411,11 @@ struct AttributeStore {
 	void reportSize() const;
 	void finalize();
 
+	// Promotes the pairs that were common in this phase (see
+	// AttributePairStore::endPhase). Must be called between phases, when no
+	// sets are being added.
+	void endPhase();
+
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, const protozero::data_view v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, double v, char minzoom);
 	void addAttribute(AttributeSet& attributeSet, std::string const &key, int v, char minzoom);
@@ -415,9 +424,8 @@ struct AttributeStore {
 	AttributeStore():
 		finalized(false),
 		sets(ATTRIBUTE_SHARDS),
-		setsMutex(ATTRIBUTE_SHARDS),
-		lookups(0),
-		lookupsUncached(0) {
+		lookupsUncached(0),
+		lookups(0) {
 	}
 
 	AttributeKeyStore keyStore;
@@ -425,8 +433,14 @@ struct AttributeStore {
 
 private:
 	bool finalized;
-	std::vector<DequeMap<AttributeSet>> sets;
-	mutable std::vector<std::mutex> setsMutex;
+	std::vector<ConcurrentIndexMap<AttributeSet>> sets;
+
+	// Sets stored before one of their pairs was promoted hold its cold
+	// index, while an identical set made since holds its hot index. This
+	// finds the stored set from the second form, so that both have the
+	// same AttributeIndex. It's only changed between phases.
+	std::unordered_map<AttributeSet, AttributeIndex, HashMember<AttributeSet>> promotedSets;
+	void findPromotedSets();
 
 	mutable std::mutex mutex;
 	std::atomic<uint64_t> lookupsUncached;
@@ -0,0 +1,31 @@
+#ifndef BIT_SCAN_H
+#define BIT_SCAN_H
+
+#include <cstdint>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// The position of the highest set bit of x, which must not be 0
+inline unsigned int highestBit(uint64_t x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, x);
+	return index;
+#else
+	return 63 - __builtin_clzll(x);
+#endif
+}
+
+// The position of the lowest set bit of x, which must not be 0
+inline unsigned int lowestBit(uint64_t x) {
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, x);
+	return index;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef _CELL_GEOMETRY_CACHE_H
+#define _CELL_GEOMETRY_CACHE_H
+
+#include "coordinates.h"
+#include "geom.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+
+// A thread-safe cache of multipolygons for grid cells, keyed by an ID (an
+// object or a layer), zoom and cell.
+//
+// Like ClipCache, each shard is simply emptied when it gets too big - here,
+// when the geometries in it add up to more than maxPointsPerShard points -
+// which bounds the memory used without LRU bookkeeping.
+
+class CellGeometryCache {
+public:
+	using Key = std::tuple<uint64_t, uint8_t, TileCoordinates>;
+
+	CellGeometryCache(size_t shardCount, size_t maxPointsPerShard):
+		shards(shardCount),
+		maxPointsPerShard(maxPointsPerShard) {
+	}
+
+	std::shared_ptr<const MultiPolygon> get(const Key& key) const {
+		const Shard& shard = shardFor(key);
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		const auto& it = shard.geometries.find(key);
+		if (it == shard.geometries.end())
+			return nullptr;
+		return it->second;
+	}
+
+	void add(const Key& key, const std::shared_ptr<const MultiPolygon>& geometry) {
+		const size_t points = boost::geometry::num_points(*geometry);
+		Shard& shard = shardFor(key);
+
+		// Declared before the lock, so that evicted geometries are destroyed
+		// after it's released
+		std::map<Key, std::shared_ptr<const MultiPolygon>> evicted;
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		shard.points += points;
+		if (shard.points > maxPointsPerShard) {
+			evicted.swap(shard.geometries);
+			shard.points = points;
+		}
+		shard.geometries[key] = geometry;
+	}
+
+private:
+	struct Shard {
+		mutable std::mutex mutex;
+		std::map<Key, std::shared_ptr<const MultiPolygon>> geometries;
+		size_t points = 0;
+	};
+
+	Shard& shardFor(const Key& key) {
+		return shards[hash(key) % shards.size()];
+	}
+	const Shard& shardFor(const Key& key) const {
+		return shards[hash(key) % shards.size()];
+	}
+	static size_t hash(const Key& key) {
+		const TileCoordinates& index = std::get<2>(key);
+		return std::get<0>(key) * 31 + std::get<1>(key) * 17 + index.x * 7 + index.y;
+	}
+
+	std::vector<Shard> shards;
+	size_t maxPointsPerShard;
+};
+
+#endif
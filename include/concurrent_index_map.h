@@ -0,0 +1,227 @@
+#ifndef CONCURRENT_INDEX_MAP_H
+#define CONCURRENT_INDEX_MAP_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <vector>
+#include "bit_scan.h"
+
+template <class T>
+struct HashMember {
+	size_t operator()(const T& entry) const { return entry.hash(); }
+};
+
+// Like DequeMap, assigns each distinct instance of T a number based on the
+// order in which it joined - but can be used from many threads at once.
+//
+// Objects are stored in segments that never move, so indexes and references
+// stay valid as the map grows. They're found through an open-addressing hash
+// table, which lookups probe without taking a lock. If an object isn't found,
+// add() takes the mutex, checks again and inserts it.
+//
+// When the table gets half full, it's rebuilt at twice the size. The old table
+// is kept until the map is cleared, as other threads may still be probing it;
+// this at most doubles the table's memory use.
+template <class T, class Hash = HashMember<T>>
+class ConcurrentIndexMap {
+public:
+	ConcurrentIndexMap(): maxSize(0) {}
+	ConcurrentIndexMap(uint32_t maxSize): maxSize(maxSize) {}
+	ConcurrentIndexMap(const ConcurrentIndexMap&) = delete;
+	ConcurrentIndexMap& operator=(const ConcurrentIndexMap&) = delete;
+	~ConcurrentIndexMap() { clear(); }
+
+	bool full() const {
+		return maxSize != 0 && size() >= maxSize;
+	}
+
+	size_t size() const { return count.load(std::memory_order_acquire); }
+
+	// Returns the index of `entry` if present, -1 otherwise.
+	int32_t find(const T& entry) const { return find(entry, Hash()(entry)); }
+
+	// As above, when the caller has already hashed `entry`.
+	int32_t find(const T& entry, size_t hash) const {
+		const Table* t = table.load(std::memory_order_acquire);
+		if (t == nullptr)
+			return -1;
+
+		const uint32_t tag = hashTag(hash);
+		for (uint32_t slot = t->slotFor(hash); ; slot = (slot + 1) & (t->capacity - 1)) {
+			const uint64_t value = t->slots()[slot].load(std::memory_order_acquire);
+			if (value == 0)
+				return -1;
+			if ((value >> 32) == tag) {
+				const uint32_t index = static_cast<uint32_t>(value) - 1;
+				if ((*this)[index] == entry)
+					return index;
+			}
+		}
+	}
+
+	// If `entry` is already in the map, return its index.
+	// Otherwise, if maxSize is `0`, or greater than the number of entries in the map,
+	// add the item and return its index.
+	// Otherwise, return -1.
+	int32_t add(const T& entry) { return add(entry, Hash()(entry)); }
+
+	// `prepare` is called on the map's own copy of `entry`, if one is made,
+	// before other threads can see it.
+	struct NoPrepare { void operator()(T&) const {} };
+	template <class Prepare = NoPrepare>
+	int32_t add(const T& entry, size_t hash, Prepare prepare = Prepare()) {
+		int32_t index = find(entry, hash);
+		if (index != -1)
+			return index;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		index = find(entry, hash);
+		if (index != -1)
+			return index;
+
+		const uint32_t n = count.load(std::memory_order_relaxed);
+		if (maxSize > 0 && n >= maxSize)
+			return -1;
+		if (n >= MAX_ENTRIES)
+			throw std::out_of_range("ConcurrentIndexMap is full");
+
+		Table* t = table.load(std::memory_order_relaxed);
+		if (t == nullptr || (n + 1) * 2 > t->capacity)
+			t = grow(t);
+
+		// Store the object before it can be found in the table
+		const uint32_t s = segmentIndex(n);
+		T* segment = segments[s].load(std::memory_order_relaxed);
+		if (segment == nullptr) {
+			segment = static_cast<T*>(::operator new(sizeof(T) * segmentSize(s)));
+			segments[s].store(segment, std::memory_order_release);
+		}
+		T* stored = new (&segment[n - segmentStart(s)]) T(entry);
+		prepare(*stored);
+		count.store(n + 1, std::memory_order_release);
+		insert(*t, hash, n);
+		return n;
+	}
+
+	inline const T& operator[](uint32_t index) const {
+		const uint32_t s = segmentIndex(index);
+		return segments[s].load(std::memory_order_acquire)[index - segmentStart(s)];
+	}
+
+	inline const T& at(uint32_t index) const {
+		if (index >= size())
+			throw std::out_of_range("ConcurrentIndexMap::at");
+		return (*this)[index];
+	}
+
+	// Not thread-safe
+	void clear() {
+		const uint32_t n = count.load();
+		for (uint32_t i = 0; i < n; i++)
+			(*this)[i].~T();
+		for (auto& segment : segments) {
+			::operator delete(segment.load());
+			segment.store(nullptr);
+		}
+		count.store(0);
+		Table::destroy(table.load());
+		table.store(nullptr);
+		retired.clear();
+	}
+
+	struct iterator {
+		const ConcurrentIndexMap<T, Hash>& map;
+		size_t offset;
+		iterator(const ConcurrentIndexMap<T, Hash>& map, size_t offset): map(map), offset(offset) {}
+		void operator++() { offset++; }
+		bool operator!=(iterator& other) { return offset != other.offset; }
+		const T& operator*() const { return map[offset]; }
+	};
+
+	iterator begin() const { return iterator{*this, 0}; }
+	iterator end() const { return iterator{*this, size()}; }
+
+private:
+	// Segment s holds (1 << FIRST_SEGMENT_BITS) << s objects
+	static const uint32_t FIRST_SEGMENT_BITS = 4;
+	static const uint32_t MAX_SEGMENTS = 28;
+	static const uint32_t MAX_ENTRIES = (1u << 31) - 1;
+
+	static uint32_t segmentIndex(uint32_t index) {
+		const uint64_t x = (static_cast<uint64_t>(index) >> FIRST_SEGMENT_BITS) + 1;
+		return highestBit(x);
+	}
+	static uint32_t segmentStart(uint32_t s) { return ((1u << s) - 1) << FIRST_SEGMENT_BITS; }
+	static uint32_t segmentSize(uint32_t s) { return 1u << (s + FIRST_SEGMENT_BITS); }
+
+	// Each slot holds 32 bits of the hash, to skip most comparisons, and the
+	// index + 1, so that 0 is an empty slot.
+	static uint32_t hashTag(size_t hash) { return static_cast<uint32_t>((static_cast<uint64_t>(hash) >> 32) ^ hash); }
+
+	// The slots follow the table in the same allocation, saving a pointer
+	// chase on every lookup
+	struct Table {
+		static Table* create(uint32_t bits) {
+			void* memory = ::operator new(sizeof(Table) + sizeof(std::atomic<uint64_t>) * (1u << bits));
+			return new (memory) Table(bits);
+		}
+		static void destroy(Table* t) {
+			if (t == nullptr) return;
+			t->~Table();
+			::operator delete(t);
+		}
+
+		std::atomic<uint64_t>* slots() { return reinterpret_cast<std::atomic<uint64_t>*>(this + 1); }
+		const std::atomic<uint64_t>* slots() const { return reinterpret_cast<const std::atomic<uint64_t>*>(this + 1); }
+
+		// Callers tend to choose shards from the low bits of the hash, so
+		// mix them before choosing a slot
+		uint32_t slotFor(size_t hash) const {
+			return static_cast<uint32_t>((static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ull) >> (64 - bits));
+		}
+
+		const uint32_t bits;
+		const uint32_t capacity;
+
+	private:
+		Table(uint32_t bits): bits(bits), capacity(1u << bits) {
+			for (uint32_t i = 0; i < capacity; i++)
+				new (&slots()[i]) std::atomic<uint64_t>(0);
+		}
+	};
+	struct TableDeleter {
+		void operator()(Table* t) const { Table::destroy(t); }
+	};
+
+	static void insert(Table& t, size_t hash, uint32_t index) {
+		uint32_t slot = t.slotFor(hash);
+		while (t.slots()[slot].load(std::memory_order_relaxed) != 0)
+			slot = (slot + 1) & (t.capacity - 1);
+		t.slots()[slot].store((static_cast<uint64_t>(hashTag(hash)) << 32) | (index + 1), std::memory_order_release);
+	}
+
+	// Called with the mutex held
+	Table* grow(Table* old) {
+		Table* t = Table::create(old == nullptr ? 4 : old->bits + 1);
+		const uint32_t n = count.load(std::memory_order_relaxed);
+		for (uint32_t i = 0; i < n; i++)
+			insert(*t, Hash()((*this)[i]), i);
+		table.store(t, std::memory_order_release);
+		if (old != nullptr)
+			retired.emplace_back(old);
+		return t;
+	}
+
+	uint32_t maxSize;
+	std::atomic<uint32_t> count { 0 };
+	std::atomic<T*> segments[MAX_SEGMENTS] {};
+	std::atomic<Table*> table { nullptr };
+	std::vector<std::unique_ptr<Table, TableDeleter>> retired;
+	std::mutex mutex;
+};
+
+#endif
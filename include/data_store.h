@@ -0,0 +1,71 @@
+/*! \file */
+#ifndef _DATA_STORE_H
+#define _DATA_STORE_H
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DataTable;
+
+// A value in the Lua key/value store: a string, number, boolean, or a table
+// of these.
+struct DataValue {
+	enum class Type : char { String, Number, Integer, Boolean, Table };
+
+	DataValue() {}
+	DataValue(const std::string& string) : type(Type::String), string(string) {}
+
+	Type type = Type::String;
+	bool boolean = false;
+	double number = 0;
+	long long integer = 0;
+	std::string string;
+	std::shared_ptr<const DataTable> table;
+};
+
+struct DataTable {
+	std::vector<DataValue> keys;
+	std::vector<DataValue> values;
+};
+
+// DataStore backs SetData/GetData.
+//
+// It's split into shards, each with its own lock, so threads setting
+// different keys don't contend. Values written during a reading phase are
+// kept apart from those committed in earlier phases; endPhase() merges them.
+// Reads of committed values take no locks, and a shard that hasn't been
+// written to in this phase is read without locking at all.
+class DataStore {
+public:
+	DataStore();
+
+	void set(const std::string& key, DataValue value);
+	// Returns false if the key isn't present
+	bool get(const std::string& key, DataValue& value) const;
+
+	// Commit this phase's writes. Must not be called while other threads
+	// are using the store.
+	void endPhase();
+
+	void clear();
+	size_t size() const;
+
+private:
+	struct Shard {
+		std::unordered_map<std::string, DataValue> committed;	// changed only by endPhase
+		mutable std::mutex mutex;								// guards pending
+		std::unordered_map<std::string, DataValue> pending;
+		std::atomic<bool> hasPending { false };
+	};
+
+	Shard& shardFor(const std::string& key);
+	const Shard& shardFor(const std::string& key) const;
+
+	std::vector<Shard> shards;
+};
+
+#endif //_DATA_STORE_H
@@ -0,0 +1,67 @@
+/*! \file */
+#ifndef _DIRECTORY_WRITER_H
+#define _DIRECTORY_WRITER_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "coordinates.h"
+
+// Most tiles an I/O thread takes off the queue at once
+#define DIRECTORY_WRITER_BATCH 64
+
+/**
+ * \brief Writes tiles as files in a directory tree (zoom/x/y.pbf)
+ *
+ * Tiles are queued, then written by a pool of I/O threads, so that the
+ * open/write/close of one file doesn't hold up the next. Each zoom/x
+ * directory is created the first time it's needed, rather than checked for
+ * with every tile. At most `capacity` tiles are queued; write() blocks
+ * until there's room.
+ */
+class DirectoryWriter {
+public:
+	DirectoryWriter(const std::string& root, size_t ioThreads, size_t capacity);
+	virtual ~DirectoryWriter();
+
+	void write(unsigned int zoom, TileCoordinates index, std::string&& data);
+
+	// Waits for every tile to be written, then stops the threads. Rethrows
+	// the first error, if any.
+	void finish();
+
+private:
+	struct QueuedTile {
+		unsigned int zoom;
+		TileCoordinates index;
+		std::string data;
+	};
+
+	void writeLoop();
+	void writeFile(const QueuedTile& tile);
+	void ensureDirectory(unsigned int zoom, TileCoordinate x);
+
+	const std::string root;
+	const size_t capacity;
+
+	// Guards everything below, up to the threads
+	std::mutex mutex;
+	std::condition_variable spaceAvailable;
+	std::condition_variable tileQueued;
+	std::deque<QueuedTile> queue;
+	bool finishing;
+	std::exception_ptr error;
+
+	std::mutex directoriesMutex;
+	std::unordered_set<uint64_t> directories;	// zoom/x directories already created
+
+	std::vector<std::thread> threads;
+	bool finished;
+};
+
+#endif //_DIRECTORY_WRITER_H
@@ -3,7 +3,9 @@
 #define _HELPERS_H
 
 #include <cstdint>
+#include <functional>
 #include <sstream>
+#include <string>
 #include <vector>
 
 #define Z_DEFAULT_COMPRESSION -1
@@ -53,6 +55,35 @@ std::string compress_string(const std::string& str,
                             int compressionlevel = Z_DEFAULT_COMPRESSION,
                             bool asGzip = false);
 
+// zstd versions of the above; they throw if tilemaker was built without zstd
+std::string compress_zstd(const std::string& str, int compressionlevel = Z_DEFAULT_COMPRESSION);
+void decompress_zstd(std::string& output, const char* input, uint32_t inputSize);
+
 std::string boost_validity_error(unsigned failure);
 
+// A hash of some content (e.g. a tile), so that identical content can be
+// stored once without comparing the bytes. It's MurmurHash3 (x64, 128-bit)
+// plus the CRC-32 of the content: neither is cryptographic, so they're used
+// together, and content only matches if both independent hashes do.
+struct ContentHash {
+	uint64_t low;
+	uint64_t high;
+	uint32_t crc;
+
+	bool operator==(const ContentHash& other) const { return low == other.low && high == other.high && crc == other.crc; }
+	bool operator!=(const ContentHash& other) const { return !(*this == other); }
+
+	// 40 hex digits
+	std::string hex() const;
+};
+
+namespace std {
+	template<>
+	struct hash<ContentHash> {
+		size_t operator()(const ContentHash& hash) const { return hash.low; }
+	};
+}
+
+ContentHash contentHash(const std::string& data);
+
 #endif //_HELPERS_H
@@ -0,0 +1,80 @@
+/*! \file */
+#ifndef _LUA_PROFILE_H
+#define _LUA_PROFILE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct lua_State;
+
+// LuaProfile is shared by all the Lua states that run a profile.
+//
+// Each thread that reads OSM data needs its own Lua state. Rather than have
+// every state parse the profile from disk, the first one compiles it to
+// bytecode, which later states load directly.
+//
+// init_function is often used to build lookup tables (from a CSV file, say).
+// When a non-first call of init_function only creates or changes globals that
+// hold plain data - nil, booleans, numbers, strings and tables of those - the
+// changed globals are snapshotted, and later states are given a copy of them
+// instead of calling init_function again.
+//
+// Only globals are compared, so other side effects (printing, writing files,
+// random numbers) happen once rather than once per state. SetData/GetData
+// are the exception: OsmLuaProcessing notices them and disables the snapshot.
+
+class LuaProfile {
+public:
+	// Global name -> a description of everything reachable from it
+	using Fingerprint = std::map<std::string, std::string>;
+
+	LuaProfile();
+
+	// Bytecode for luaFile, compiled (using L) the first time it's asked for.
+	// Returns an empty string if the file can't be compiled; the caller
+	// should then load it in the normal way so that errors are reported.
+	const std::string& bytecode(lua_State* L, const std::string& luaFile);
+
+	// Copy a snapshot of init_function's results into L. Returns false if
+	// there is no snapshot, in which case init_function should be called.
+	bool restoreInit(lua_State* L);
+
+	// Should this state's call to init_function be snapshotted? Only true
+	// for the first caller.
+	bool beginCapture();
+
+	// Describe L's globals, to be compared before and after init_function.
+	Fingerprint fingerprint(lua_State* L) const;
+
+	// Store the snapshot of everything init_function changed. `eligible` is
+	// false if init_function had side effects that can't be replayed.
+	void endCapture(lua_State* L, const Fingerprint& before, bool eligible);
+
+private:
+	struct Value {
+		int type = 0;
+		bool boolean = false;
+		bool isInteger = false;
+		double number = 0;
+		long long integer = 0;
+		std::string string;
+		size_t table = 0;
+	};
+
+	enum class CaptureState { Untried, Capturing, Ready, Unavailable };
+
+	bool snapshotValue(lua_State* L, int index, std::map<const void*, size_t>& tableIndexes, Value& out, unsigned int depth);
+	void pushValue(lua_State* L, const Value& value, int tablesIndex) const;
+
+	std::mutex mutex;
+	std::map<std::string, std::string> bytecodes;
+	mutable unsigned int truncatedFingerprints;
+
+	CaptureState captureState;
+	std::vector<std::vector<std::pair<Value, Value>>> tables;
+	std::vector<std::pair<std::string, Value>> globals;
+};
+
+#endif //_LUA_PROFILE_H
@@ -4,8 +4,15 @@
 
 #include <string>
 #include <mutex>
+#include <unordered_set>
 #include <vector>
 #include "external/sqlite_modern_cpp.h"
+#include "helpers.h"
+
+// Tiles are inserted this many at a time, by one multi-row statement
+#define MBTILES_BATCH_SIZE 128
+// How many recent distinct tiles to remember, to avoid sending them to SQLite again
+#define MBTILES_RECENT_IMAGES 1000000
 
 struct PendingStatement {
 	int zoom;
@@ -21,29 +28,48 @@ struct PendingStatement {
 */
 class MBTiles { 
 	sqlite::database db;
+	// Single-row INSERT and REPLACE, then MBTILES_BATCH_SIZE-row INSERT and
+	// REPLACE, then (if deduplicating) single-row and batch image inserts
 	std::vector<sqlite::database_binder> preparedStatements;
 	std::mutex m;
 	bool inTransaction;
+	bool deferIndex;
+	bool deduplicate;
+	uint64_t tilesSaved;
 
-	std::shared_ptr<std::vector<PendingStatement>> pendingStatements1, pendingStatements2;
-	std::mutex pendingStatementsMutex;
+	// Tiles waiting to be inserted, and if deduplicating, their images by
+	// tile_id. Only the thread that saves tiles uses them.
+	std::vector<PendingStatement> pendingStatements;
+	std::vector<std::pair<std::string, std::string>> pendingImages;
+	std::unordered_set<ContentHash> recentImages;
 
+	bool tableExists(const std::string& name);
+	void bindTile(sqlite::database_binder& statement, int zoom, int x, int y, const std::string& data);
 	void insertOrReplace(int zoom, int x, int y, const std::string& data, bool isMerge);
 	void flushPendingStatements();
 
 public:
 	MBTiles();
 	virtual ~MBTiles();
-	void openForWriting(std::string &filename);
+	// If deferIndex is set, the tiles table is indexed by closeForWriting
+	// rather than as tiles are inserted. Each tile must only be saved once.
+	//
+	// If deduplicate is set, identical tiles are stored once, using the
+	// map/images schema with a tiles view. When writing to an existing file,
+	// its schema decides.
+	void openForWriting(std::string &filename, bool deferIndex, bool deduplicate);
+	bool isDeduplicated() const { return deduplicate; }
 	void writeMetadata(std::string key, std::string value);
-	void saveTile(int zoom, int x, int y, std::string *data, bool isMerge);
+	// Must only be called from one thread at a time. `hash` is of `data`,
+	// and only needed if deduplicating.
+	void saveTile(int zoom, int x, int y, std::string&& data, bool isMerge, const ContentHash& hash);
 	void closeForWriting();
 
 	void openForReading(std::string &filename);
 	void readBoundingBox(double &minLon, double &maxLon, double &minLat, double &maxLat);
 	void readTileList(std::vector<std::tuple<int,int,int>> &tileList);
 	std::vector<char> readTile(int zoom, int col, int row);
-	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, bool isCompressed, bool asGzip);
+	bool readTileAndUncompress(std::string &data, int zoom, int col, int row, bool isCompressed, bool asGzip, bool asZstd = false);
 };
 
 #endif //_MBTILES_H
@@ -45,6 +45,8 @@ namespace OptionsParser {
 		bool quiet = false;
 		bool verbose = false;
 		bool mergeSqlite = false;
+		bool deduplicate = false;
+		bool clustered = false;
 		OutputMode outputMode = OutputMode::File;
 		bool logTileTimings = false;
 	};
@@ -2,6 +2,8 @@
 #ifndef _OSM_LUA_PROCESSING_H
 #define _OSM_LUA_PROCESSING_H
 
+#include <algorithm>
+#include <iterator>
 #include <vector>
 #include <string>
 #include <sstream>
@@ -15,6 +17,7 @@
 #include "osm_mem_tiles.h"
 #include "helpers.h"
 #include "pbf_reader.h"
+#include "data_store.h"
 #include <protozero/data_view.hpp>
 
 #include <boost/container/flat_map.hpp>
@@ -62,6 +65,10 @@ public:
 	);
 	~OsmLuaProcessing();
 
+	// Make this the state used by Lua callbacks on the current thread
+	// (needed when a state is handed from one thread to another)
+	void attachToThread();
+
 	// ----	Helpers provided for main routine
 	void handleUserSignal(int signum);
 
@@ -164,6 +171,7 @@ public:
 	CentroidAlgorithm defaultCentroidAlgorithm() const { return CentroidAlgorithm::Polylabel; }
 	CentroidAlgorithm parseCentroidAlgorithm(const std::string& algorithm) const;
 	Point calculateCentroid(CentroidAlgorithm algorithm);
+	const Point &centroidCached(CentroidAlgorithm algorithm);
 
 	enum class CorrectGeometryResult: char { Invalid = 0, Valid = 1, Corrected = 2 };
 	// ----	Requests from Lua to write this way/node to a vector tile's Layer
@@ -246,8 +254,8 @@ public:
 	const TagMap* currentTags;
 	bool isPostScanRelation;				// processing a relation in postScanRelation
 
-	static std::unordered_map<std::string, std::string> dataStore;
-	static std::mutex dataStoreMutex;
+	static DataStore dataStore;
+	bool initHadSideEffects = false;				// init_function used SetData/GetData, so can't be snapshotted
 
 private:
 	/// Internal: clear current cached state
@@ -265,7 +273,9 @@ private:
 		relationAccepted = false;
 		relationList.clear();
 		relationSubscript = -1;
-		lastStoredGeometryId = 0;
+		std::fill(std::begin(storedGeometryIds), std::end(storedGeometryIds), 0);
+		std::fill(std::begin(storedCentroidIds), std::end(storedCentroidIds), 0);
+		std::fill(std::begin(centroidInited), std::end(centroidInited), false);
 		isWay = false;
 		isRelation = false;
 		isPostScanRelation = false;
@@ -314,8 +324,14 @@ private:
 	bool multiPolygonInited;
 	geom::model::polygon<DegPoint> areaPolygonCache;
 
-	NodeID lastStoredGeometryId;
-	OutputGeometryType lastStoredGeometryType;
+	// Geometries already written for this object, by OutputGeometryType, so that
+	// writing it to several layers only corrects and stores each form once.
+	// INVALID_GEOMETRY_ID means correction failed and it shouldn't be retried.
+	static constexpr NodeID INVALID_GEOMETRY_ID = ~static_cast<NodeID>(0);
+	NodeID storedGeometryIds[POLYGON_ + 1];
+	Point centroidCache[2];						// by CentroidAlgorithm
+	bool centroidInited[2];
+	NodeID storedCentroidIds[2];
 
 	const class Config &config;
 	class LayerDefinition &layers;
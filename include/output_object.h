@@ -6,6 +6,7 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <unordered_map>
 #include "coordinates.h"
 #include "attribute_store.h"
 #include <vtzero/builder.hpp>
@@ -15,6 +16,11 @@ enum OutputGeometryType : unsigned int { POINT_, LINESTRING_, MULTILINESTRING_,
 //\brief Display the geometry type
 std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType);
 
+// Key/value indexes already added to a vtzero layer, by attribute set. Kept
+// for one layer of one tile (so always at one zoom level), so that features
+// sharing an attribute set add their properties by index only.
+typedef std::unordered_map<AttributeIndex, std::vector<vtzero::index_value_pair>> EncodedAttributes;
+
 /**
  * \brief OutputObject - any object (node, linestring, polygon) to be outputted to tiles
 */
@@ -71,8 +77,10 @@ public:
 
 	void writeAttributes(
 		const AttributeStore& attributeStore,
+		vtzero::layer_builder& vtLayer,
 		vtzero::feature_builder& fbuilder,
-		char zoom
+		char zoom,
+		EncodedAttributes& encodedAttributes
 	) const;
 		
 	bool compatible(const OutputObject &other);
@@ -3,7 +3,12 @@
 #define _PMTILES_H
 
 #include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include "external/pmtiles.hpp"
+#include "helpers.h"
 
 struct TileOffset {
 	uint64_t offset : 40;
@@ -13,7 +18,7 @@ struct TileOffset {
 	TileOffset();
 };
 
-// Maximum number of tiles in a leaf directory
+// Number of tile IDs each leaf directory covers
 #define LEAF_DIRECTORY_SIZE 10000000
 // Combined size of header and root directory (= start of tile data)
 #define HEADER_ROOT 16384
@@ -21,10 +26,12 @@ struct TileOffset {
 #define FIRST_LEAF_TILE 1365
 // Threshold for using the root directory only
 #define ROOT_ONLY 2200
-// Maximum size in bytes of tiles considered "tiny" (i.e. potentially repeatable)
-#define TINY_LENGTH 100
-// Expire the tiny cache when it reaches this size
-#define TINY_MAX_SIZE 10000
+// Number of tiles seen once that we remember, in case they turn up again
+#define DEDUP_CANDIDATES 1000000
+// Number of tiles seen more than once that we remember
+#define DEDUP_REPEATED 1000000
+// Largest run of spilled tiles that's read in one go when clustering
+#define SPILL_READ_SIZE 268435456
 
 class PMTiles { 
 
@@ -34,26 +41,62 @@ public:
 
 	pmtiles::headerv3 header;
 	bool isSparse = true;
+	int compressionLevel = Z_DEFAULT_COMPRESSION;	// for leaf directories and metadata
+	bool zstd = false;				// tiles and directories are zstd, not gzip
+	unsigned int threadNum = 1;		// for building directories in close()
+	uint64_t leafTileIds = LEAF_DIRECTORY_SIZE;	// covered by each leaf directory
 
-	void open(std::string &filename);
-	void saveTile(int zoom, int x, int y, std::string &data);
+	// If clustered is set, tiles are written to a spill file per zoom as
+	// they come, then copied into the .pmtiles in tile ID order when it's
+	// closed. The spill files are deleted if it's never closed.
+	void open(std::string &filename, bool clustered);
+	void saveTile(int zoom, int x, int y, const std::string &compressed, const ContentHash &hash);
 	void close(std::string &metadata);
 
 private:
 	std::ofstream outputStream;
-	std::mutex fileMutex;	// guards file writes, numTilesWritten
-	std::mutex indexMutex;	// guards access to sparseIndex, denseIndex, tinyCache, numTilesAddressed
+	std::string compress(const std::string &data, int level) const;
+	bool isClustered = false;
+	std::string outputFilename;
+
+	// A run of tiles in a zoom's spill file from the same z6 tile, or below
+	// z6, from the same zoom. When clustered, the index gives each distinct
+	// tile's position in spillOffsets/spillZooms rather than in the file.
+	struct SpillSegment {
+		uint64_t cluster;
+		uint64_t begin;
+		uint64_t end;
+	};
+	std::vector<std::unique_ptr<std::ofstream>> spillStreams;	// by zoom
+	std::vector<std::vector<SpillSegment>> spillSegments;		// by zoom, in the order written
+	std::vector<uint64_t> spillOffsets;		// of each distinct tile in its zoom's spill file
+	std::vector<uint8_t> spillZooms;		// which spill file each distinct tile is in
+	std::mutex fileMutex;	// guards file writes, numTilesWritten and the spill state
+	std::mutex indexMutex;	// guards access to sparseIndex, denseIndex, the dedup maps and counters
 	uint64_t leafStart = 0;
 	uint64_t numTilesWritten = 0;
 	uint64_t numTilesAddressed = 0;
 	uint64_t numTileEntries = 0;
 	std::map<uint64_t, TileOffset> sparseIndex;
 	std::vector<TileOffset> denseIndex;
-	std::unordered_map<std::string, TileOffset> tinyCache;
+	uint64_t numTilesDeduplicated = 0;
+	uint64_t bytesDeduplicated = 0;
+
+	// Tiles already written, by content hash. Most tiles are unique, so a
+	// tile only moves into repeatedTiles once it's been seen twice; that
+	// keeps the ones worth remembering (sea, landcover) when candidateTiles
+	// fills up and is cleared.
+	std::unordered_map<ContentHash, TileOffset> candidateTiles;
+	std::unordered_map<ContentHash, TileOffset> repeatedTiles;
+
+	bool findWrittenTile(const ContentHash &hash, size_t length, TileOffset &offset);
 
-	void appendWithRLE(std::vector<pmtiles::entryv3> &entries, pmtiles::entryv3 &entry);
-	void appendTileEntry(uint64_t tileId, TileOffset offset, std::vector<pmtiles::entryv3> &rootEntries, std::vector<pmtiles::entryv3> &entries);
-	void flushEntries(std::vector<pmtiles::entryv3> &rootEntries, std::vector<pmtiles::entryv3> &entries);
+	std::string spillFilename(unsigned int zoom) const;
+	void clusterTiles();
+	void removeSpillFiles();
+	std::vector<pmtiles::entryv3> rangeEntries(uint64_t begin, uint64_t end) const;
+	void writeDirectories(std::vector<pmtiles::entryv3> &rootEntries);
+	void writeLeafDirectories(std::vector<pmtiles::entryv3> &rootEntries, const std::vector<std::vector<pmtiles::entryv3>> &leaves);
 };
 
 #endif //_PMTILES_H
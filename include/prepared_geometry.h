@@ -0,0 +1,96 @@
+/*! \file */
+#ifndef _PREPARED_GEOMETRY_H
+#define _PREPARED_GEOMETRY_H
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+#include "geom.h"
+
+// PreparedMultiPolygon answers Intersects/CoveredBy queries against a large
+// multipolygon (a country, say) without walking every vertex.
+//
+// Each edge goes into an R-tree, so only the edges near a query geometry are
+// examined: point-in-polygon is a ray cast against the few edges that cross
+// the ray, and a line or polygon intersects the multipolygon if one of its
+// segments crosses an edge, or (failing that) if one vertex is inside.
+//
+// On top of that, the cells of a grid (the spatial index tiles of ShpMemTiles)
+// are lazily classified as inside, outside or on the boundary. A geometry that
+// falls within a single inside or outside cell is answered straight from the
+// cache.
+
+class PreparedMultiPolygon {
+public:
+	// Polygons with fewer points than this are quicker to test directly
+	static const size_t MIN_POINTS = 256;
+
+	template<class MultiPolygonT>
+	PreparedMultiPolygon(const MultiPolygonT& mp, unsigned int cellZoom) :
+		cellZoom(cellZoom) {
+		uint32_t ring = 0;
+		for (const auto& polygon : mp) {
+			addRing(polygon.outer(), ring++);
+			for (const auto& inner : polygon.inners())
+				addRing(inner, ring++);
+		}
+		buildIndex();
+	}
+
+	// boost::geometry::intersects(g, multipolygon)
+	bool intersects(const Point& p) const;
+	bool intersects(const Linestring& ls) const;
+	bool intersects(const MultiLinestring& mls) const;
+	bool intersects(const Polygon& polygon) const;
+	bool intersects(const MultiPolygon& mp) const;
+	bool intersects(const Box& box) const;
+
+	// boost::geometry::covered_by(g, multipolygon). Where g touches the
+	// boundary, `certain` is set to false and the caller should fall back
+	// to an exact test.
+	bool coveredBy(const Point& p, bool& certain) const;
+	bool coveredBy(const Linestring& ls, bool& certain) const;
+	bool coveredBy(const MultiLinestring& mls, bool& certain) const;
+	bool coveredBy(const Polygon& polygon, bool& certain) const;
+	bool coveredBy(const MultiPolygon& mp, bool& certain) const;
+
+private:
+	enum class CellState : uint8_t { Outside, Inside, Boundary };
+	enum class Location : uint8_t { Exterior, Interior, Boundary };
+
+	using EdgeValue = std::pair<Box, uint32_t>;
+	using EdgeTree = boost::geometry::index::rtree<EdgeValue, boost::geometry::index::quadratic<16>>;
+
+	template<class RingT>
+	void addRing(const RingT& ring, uint32_t ringId) {
+		for (size_t i = 1; i < ring.size(); i++) {
+			edges.emplace_back(Point(ring[i-1].x(), ring[i-1].y()), Point(ring[i].x(), ring[i].y()));
+			edgeRings.push_back(ringId);
+		}
+	}
+	void buildIndex();
+
+	Location locate(const Point& p) const;
+	CellState cellState(const Box& box) const;
+	bool crossesBoundary(const Segment& segment) const;
+	template<class RangeT> bool crossesBoundary(const RangeT& points) const;
+	bool containsRingOf(const Polygon& polygon) const;
+
+	std::vector<Segment> edges;
+	std::vector<uint32_t> edgeRings;		// which ring each edge belongs to
+	EdgeTree edgeTree;
+	Box envelope;
+
+	// Cached state of each grid cell, sharded to reduce lock contention. A
+	// shard is cleared when it fills up, to bound the memory used.
+	unsigned int cellZoom;
+	struct CellCache {
+		std::mutex mutex;
+		std::unordered_map<uint64_t, CellState> states;
+	};
+	static const size_t CELL_CACHE_SHARDS = 16;
+	static const size_t CELL_CACHE_SHARD_SIZE = 4096;
+	mutable std::array<CellCache, CELL_CACHE_SHARDS> cellCaches;
+};
+
+#endif //_PREPARED_GEOMETRY_H
@@ -13,6 +13,8 @@
 #include "mbtiles.h"
 #include "pmtiles.h"
 #include "tile_data.h"
+#include "tile_writer.h"
+#include "directory_writer.h"
 
 ///\brief Defines map single layer appearance
 struct LayerDef {
@@ -80,8 +82,9 @@ public:
 	class LayerDefinition layers;
 	uint baseZoom, startZoom, endZoom;
 	uint mvtVersion, combineBelow;
-	bool includeID, compress, gzip, highResolution;
+	bool includeID, compress, gzip, zstd, highResolution;
 	std::string compressOpt;
+	std::vector<int> compressLevels;	// by zoom; the last one carries on to higher zooms
 	bool clippingBoxFromJSON;
 	double minLon, minLat, maxLon, maxLat;
 	std::string projectName, projectVersion, projectDesc;
@@ -92,6 +95,7 @@ public:
 
 	void readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox);
 	void enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double cMaxLat);
+	int compressLevel(uint zoom) const;
 };
 
 ///\brief Data used by worker threads ::outputProc to write output
@@ -105,6 +109,18 @@ public:
 	PMTiles pmtiles;
 	std::string outputFile;
 
+	// Expensive tiles spread their layer groups over this pool's threads. It's
+	// kept apart from the pool that tiles are written on, whose queue is full
+	// of batches, so that the groups start straight away. Null if there's
+	// only one thread.
+	boost::asio::thread_pool* layerPool;
+	unsigned int threadNum;
+
+	// Compresses and writes the tiles that workers render
+	std::unique_ptr<TileWriter> writer;
+	// Writes the files when outputting to a directory
+	std::unique_ptr<DirectoryWriter> directoryWriter;
+
 	Config &config;
 
 	SharedData(Config &configIn, const class LayerDefinition &layers);
@@ -115,6 +131,11 @@ public:
 	void writeFileMetadata(rapidjson::Document const &jsonConfig);	
 	std::string pmTilesMetadata(rapidjson::Document const &jsonConfig);
 	void writePMTilesBounds();
+
+	// The stages of `writer`: compressTile runs on its compressor threads,
+	// writeTile on its writer thread
+	void compressTile(RenderedTile& tile) const;
+	void writeTile(RenderedTile& tile);
 };
 
 #endif //_SHARED_DATA_H
@@ -3,6 +3,12 @@
 #define _SHP_MEM_TILES
 
 #include "tile_data.h"
+#include "prepared_geometry.h"
+#include "cell_geometry_cache.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 
 extern bool verbose;
 
@@ -10,6 +16,7 @@ class ShpMemTiles : public TileDataSource
 {
 public:
 	ShpMemTiles(size_t threadNum, uint indexZoom);
+	~ShpMemTiles();
 
 	std::string name() const override { return "shp"; }
 
@@ -33,32 +40,45 @@ public:
 		bool once,
 		Box& box, 
 		std::function<std::vector<IndexValue>(const RTree& rtree)> indexQuery, 
-		std::function<bool(const OutputObject& oo)> checkQuery
+		std::function<bool(uint id, const OutputObject& oo)> checkQuery
 	) const;
 	bool mayIntersect(const std::string& layerName, const Box& box) const;
 	std::vector<std::string> namesOfGeometries(const std::vector<uint>& ids) const;
 
+	// geom::intersects(g, indexed geometry id)
 	template <typename GeometryT>
-	double AreaIntersecting(const std::string& layerName, GeometryT& g) const {
-		auto f = indices.find(layerName);
-		if (f==indices.end()) { 
-			if (verbose)
-				std::cerr << "Couldn't find indexed layer " << layerName << std::endl; 
-			return false;
+	bool indexedIntersects(uint id, const GeometryT& g) const {
+		const PreparedMultiPolygon* prepared = preparedGeometry(id);
+		if (prepared) return prepared->intersects(g);
+		return geom::intersects(g, retrieveMultiPolygon(indexedGeometries[id].objectID));
+	}
+
+	// geom::covered_by(g, indexed geometry id)
+	template <typename GeometryT>
+	bool indexedCovers(uint id, const GeometryT& g) const {
+		const PreparedMultiPolygon* prepared = preparedGeometry(id);
+		if (prepared) {
+			bool certain;
+			bool covered = prepared->coveredBy(g, certain);
+			if (certain) return covered;
 		}
+		return geom::covered_by(g, retrieveMultiPolygon(indexedGeometries[id].objectID));
+	}
+
+	// Area of g's intersection with an indexed layer's polygons, as measured
+	// by `area`. Where polygons in the layer overlap, the area is only
+	// counted once.
+	template <typename GeometryT>
+	double AreaIntersecting(const std::string& layerName, const GeometryT& g, const std::function<double(const MultiPolygon&)>& area) const {
 		Box box;
 		geom::envelope(g, box);
-		std::vector<IndexValue> results;
-		f->second.query(geom::index::intersects(box), back_inserter(results));
-		MultiPolygon mp, tmp;
-		for (const auto &it : results) {
-			OutputObject oo = indexedGeometries.at(it.second);
-			if (oo.geomType!=POLYGON_) continue;
-			geom::union_(mp, retrieveMultiPolygon(oo.objectID), tmp);
-			geom::assign(mp, tmp);
+		double total = 0.0;
+		for (const auto& cellUnion : cellUnionsIntersecting(layerName, box)) {
+			MultiPolygon tmp;
+			geom::intersection(g, *cellUnion, tmp);
+			total += area(tmp);
 		}
-		geom::correct(mp);
-		return geom::covered_by(g, mp);
+		return total;
 	}
 
 private:
@@ -67,6 +87,21 @@ private:
 	std::map<std::string, RTree> indices;			// Spatial indices, boost::geometry::index objects for shapefile indices
 	std::mutex indexMutex;
 
+	// Large indexed polygons get a PreparedMultiPolygon, built on first use
+	std::vector<bool> isLargePolygon;
+	mutable std::deque<std::atomic<PreparedMultiPolygon*>> preparedGeometries;
+	const PreparedMultiPolygon* preparedGeometry(uint id) const;
+
+	// For AreaIntersecting, the union of each layer's polygons in grid cells
+	// (at spatialIndexZoom, or coarser for big queries) is built on first use
+	// and cached. Large polygons are clipped to a cell from their cached clip
+	// to the parent cell, rather than from scratch.
+	mutable CellGeometryCache cellUnions;			// keyed by layer
+	mutable CellGeometryCache largePolygonClips;	// keyed by objectID
+	std::vector<std::shared_ptr<const MultiPolygon>> cellUnionsIntersecting(const std::string& layerName, const Box& box) const;
+	std::shared_ptr<const MultiPolygon> cellUnion(const RTree& rtree, uint zoom, TileCoordinates index) const;
+	std::shared_ptr<const MultiPolygon> clippedPolygon(NodeID objectID, uint zoom, TileCoordinates index, bool large) const;
+
 
 	// This differs from indexZoom. indexZoom is clamped to z14, as there is a noticeable
 	// step function increase in memory use to go to higher zooms. For the
@@ -75,14 +110,19 @@ private:
 
 	// The map is from layer name to a sparse vector of tiles that might have shapes.
 	//
-	// The outer vector has an entry for each z6 tile. The inner vector is a bitset,
+	// The outer vector has an entry for each z6 tile. The inner array is a bitset,
 	// indexed at spatialIndexZoom, where a bit is set if the z15 tiles at
 	// 2 * (x*width + y) might contain at least one shape.
 	// This is approximated by using the bounding boxes of the shapes. For large, irregular shapes, or
 	// shapes with holes, the bounding box may result in many false positives. The first time the index
 	// is consulted for a given tile, we'll do a more expensive intersects query to refine the index.
 	// This lets us quickly reject negative Intersects queryes
-	mutable std::map<std::string, std::vector<std::vector<bool>>> bitIndices;
+	//
+	// The bitset is stored as atomic words, so that worker threads can check
+	// and refine it concurrently without a lock.
+	typedef std::unique_ptr<std::atomic<uint64_t>[]> BitIndex;
+	std::map<std::string, std::vector<BitIndex>> bitIndices;
+	size_t bitIndexWords() const;
 };
 
 #endif //_OSM_MEM_TILES
@@ -2,6 +2,9 @@
 #define TILE_COORDINATES_SET_H
 
 #include <cstddef>
+#include <functional>
+#include <memory>
+#include <vector>
 #include "coordinates.h"
 
 // Interface representing a bitmap of tiles of interest at a given zoom.
@@ -11,10 +14,19 @@ public:
 	virtual void set(TileCoordinate x, TileCoordinate y) = 0;
 	virtual size_t size() const = 0;
 	virtual size_t zoom() const = 0;
+
+	// Calls fn for each tile in the set. At z6 and above, the tiles in
+	// each z6 tile are visited together.
+	virtual void forEach(const std::function<void(TileCoordinate x, TileCoordinate y)>& fn) const = 0;
 };
 
-// Read-write implementation for precise sets; maximum zoom is
-// generally expected to be z14.
+// Read-write implementation for precise sets; maximum zoom is z14.
+//
+// Like a roaring bitmap, tiles are split into containers: one per z6 tile
+// at z6 and above, or a single one below z6, so each holds at most 65,536
+// tiles. An empty container takes no memory, a sparse one is a sorted array
+// of offsets, and a dense one is a bitmap. Memory and iteration time are
+// proportional to the tiles that are set, not to 4^zoom.
 class PreciseTileCoordinatesSet : public TileCoordinatesSet {
 public:
 	PreciseTileCoordinatesSet(unsigned int zoom);
@@ -22,10 +34,25 @@ public:
 	size_t size() const override;
 	size_t zoom() const override;
 	void set(TileCoordinate x, TileCoordinate y) override;
+	void forEach(const std::function<void(TileCoordinate x, TileCoordinate y)>& fn) const override;
 
 private:
+	struct Container {
+		// Sorted, until the container becomes a bitmap
+		std::vector<uint16_t> offsets;
+		std::vector<uint64_t> bits;
+
+		bool test(uint16_t offset) const;
+		// Returns true if the offset wasn't already set
+		bool set(uint16_t offset);
+		void forEach(const std::function<void(uint16_t offset)>& fn) const;
+	};
+
 	unsigned int zoom_;
-	std::vector<bool> tiles;
+	// Each container is (1 << containerZoom) tiles wide
+	unsigned int containerZoom;
+	size_t count;
+	std::vector<std::unique_ptr<Container>> containers;
 };
 
 // Read-only implementation for a lossy set. Used when zoom is
@@ -37,6 +64,7 @@ public:
 	size_t size() const override;
 	size_t zoom() const override;
 	void set(TileCoordinate x, TileCoordinate y) override;
+	void forEach(const std::function<void(TileCoordinate x, TileCoordinate y)>& fn) const override;
 
 private:
 	unsigned int zoom_;
@@ -2,10 +2,14 @@
 #ifndef _TILE_DATA_H
 #define _TILE_DATA_H
 
+#include <limits>
 #include <map>
 #include <set>
 #include <vector>
 #include <memory>
+#include <future>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
 #include "append_vector.h"
 #include "clip_cache.h"
 #include "mmap_allocator.h"
@@ -14,60 +18,75 @@
 
 typedef std::vector<class TileDataSource *> SourceList;
 
+// How many small objects one large object counts as, when estimating the
+// cost of a tile
+#define LARGE_OBJECT_COST 8
+
 class TileBbox;
 
+// Sorts objects by key, on up to threadNum threads: the caller's, and
+// helpers from `pool` (which may be null)
 template<typename OO> void sortOutputObjects(
-    const unsigned int indexZoom,
     const size_t threadNum,
-	typename AppendVectorNS::AppendVector<OO>::Iterator begin,
-	typename AppendVectorNS::AppendVector<OO>::Iterator end
+    boost::asio::thread_pool* pool,
+	Z6Objects<OO>& objects
 );
 
+inline OutputObjectID outputObjectWithId(const OutputObject& input) {
+	return OutputObjectID({ input, 0 });
+}
+
+inline OutputObjectID outputObjectWithId(const OutputObjectID& input) {
+	return input;
+}
+
+// Copies out each z6 tile's low zoom objects and sorts its objects, as one
+// task per z6 tile on `pool`. Adds a future for each task to `tasks`.
 template<typename OO> void finalizeObjects(
-	const std::string& name,
-	const size_t& threadNum,
-	const unsigned int& indexZoom,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator begin,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator end,
-	typename std::vector<std::vector<OO>>& lowZoom
+	const size_t threadNum,
+	boost::asio::thread_pool& pool,
+	std::vector<Z6Objects<OO>>& objects,
+	std::vector<LowZoomObjects<OO>>& lowZoom,
+	std::vector<std::future<void>>& tasks
 	) {
-	size_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
-#ifdef CLOCK_MONOTONIC
-	timespec startTs, endTs;
-	clock_gettime(CLOCK_MONOTONIC, &startTs);
-#endif
-
-	int i = -1;
-	for (auto it = begin; it != end; it++) {
-		i++;
-		if (it->size() > 0 || i % 50 == 0 || i == 4095) {
-			std::cout << "\r" << name << ": finalizing z6 tile " << (i + 1) << "/" << CLUSTER_ZOOM_AREA;
-
-#ifdef CLOCK_MONOTONIC
-			clock_gettime(CLOCK_MONOTONIC, &endTs);
-			uint64_t elapsedNs = 1e9 * (endTs.tv_sec - startTs.tv_sec) + endTs.tv_nsec - startTs.tv_nsec;
-			std::cout << " (" << std::to_string((uint32_t)(elapsedNs / 1e6)) << " ms)";
-#endif
-			std::cout << std::flush;
-		}
-		if (it->size() == 0)
+	size_t total = 0;
+	std::vector<size_t> order;
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (objects[i].size() == 0)
 			continue;
+		total += objects[i].size();
+		order.push_back(i);
+	}
 
-		// We track a separate copy of low zoom objects to avoid scanning large
-		// lists of objects that may be on slow disk storage.
-		for (auto objectIt = it->begin(); objectIt != it->end(); objectIt++)
-			if (objectIt->oo.minZoom < CLUSTER_ZOOM)
-				lowZoom[i].push_back(*objectIt);
+	// Start the biggest z6 tiles first, so that they don't hold up the end
+	std::sort(order.begin(), order.end(), [&objects](size_t a, size_t b) {
+		return objects[a].size() > objects[b].size();
+	});
+
+	for (const size_t i : order) {
+		// A z6 tile with more than its share of the objects - like the one
+		// that holds most of a small extract - is sorted on several threads.
+		const size_t sortThreads = objects[i].size() * threadNum > total ? threadNum : 1;
+
+		auto task = std::make_shared<std::packaged_task<void()>>([&objects, &lowZoom, &pool, i, sortThreads]() {
+			// We track a separate copy of low zoom objects to avoid scanning large
+			// lists of objects that may be on slow disk storage.
+			for (auto objectIt = objects[i].objects.begin(); objectIt != objects[i].objects.end(); objectIt++) {
+				const unsigned int minZoom = outputObjectWithId(*objectIt).oo.minZoom;
+				if (minZoom < CLUSTER_ZOOM)
+					lowZoom[i][minZoom].push_back(*objectIt);
+			}
 
-		sortOutputObjects<OO>(indexZoom, threadNum, it->begin(), it->end());
+			sortOutputObjects<OO>(sortThreads, &pool, objects[i]);
+		});
+		tasks.push_back(task->get_future());
+		boost::asio::post(pool, [task]() { (*task)(); });
 	}
-
-	std::cout << std::endl;
 }
 
 template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	const unsigned int& indexZoom,
-	const typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
+	const typename std::vector<Z6Objects<OO>>::iterator objects,
 	const size_t size,
 	std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms
 ) {
@@ -79,10 +98,11 @@ template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
 		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
 
-		for (size_t j = 0; j < objects[i].size(); j++) {
+		// Only the keys are needed here
+		for (const Z6Key key : objects[i].keys) {
 			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
+			TileCoordinate baseX = z6x * z6OffsetDivisor + z6KeyX(key);
+			TileCoordinate baseY = z6y * z6OffsetDivisor + z6KeyY(key);
 
 			// Translate the x, y at the requested zoom level
 			TileCoordinate x = baseX / (1 << (indexZoom - maxZoom));
@@ -102,62 +122,82 @@ template<typename OO> void collectTilesWithObjectsAtZoomTemplate(
 	}
 }
 
-template<typename OO>
-OutputObjectID outputObjectWithId(const OO& input) {
-	return OutputObjectID({ input.oo, 0 });
-}
+// Finds the square of clusters that make up a tile below z6. Objects are
+// clustered by z6 tile, or by index zoom tile if that's below z6.
+inline void lowZoomClustersForTile(
+	const unsigned int& indexZoom,
+	unsigned int zoom,
+	const TileCoordinates& dstIndex,
+	TileCoordinate& minX,
+	TileCoordinate& minY,
+	TileCoordinate& width
+) {
+	if (zoom >= CLUSTER_ZOOM)
+		throw std::runtime_error("collectLowZoomObjectsForTile should not be called for high zooms");
 
-template<>
-inline OutputObjectID outputObjectWithId<OutputObjectXYID>(const OutputObjectXYID& input) {
-	return OutputObjectID({ input.oo, input.id });
+	const unsigned int clusterZoom = std::min(indexZoom, (unsigned int)CLUSTER_ZOOM);
+	if (zoom <= clusterZoom) {
+		width = 1 << (clusterZoom - zoom);
+		minX = dstIndex.x * width;
+		minY = dstIndex.y * width;
+	} else {
+		width = 1;
+		minX = dstIndex.x >> (zoom - clusterZoom);
+		minY = dstIndex.y >> (zoom - clusterZoom);
+	}
 }
 
 template<typename OO> void collectLowZoomObjectsForTile(
 	const unsigned int& indexZoom,
-	const typename std::vector<std::vector<OO>>& objects,
+	const typename std::vector<LowZoomObjects<OO>>& objects,
 	unsigned int zoom,
 	const TileCoordinates& dstIndex,
 	std::vector<OutputObjectID>& output
 ) {
-	if (zoom >= CLUSTER_ZOOM)
-		throw std::runtime_error("collectLowZoomObjectsForTile should not be called for high zooms");
-
-	uint16_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
-
-	for (size_t i = 0; i < objects.size(); i++) {
-		const size_t z6x = i / CLUSTER_ZOOM_WIDTH;
-		const size_t z6y = i % CLUSTER_ZOOM_WIDTH;
-
-		for (size_t j = 0; j < objects[i].size(); j++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + objects[i][j].x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + objects[i][j].y;
-
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (indexZoom - zoom));
-			TileCoordinate y = baseY / (1 << (indexZoom - zoom));
+	TileCoordinate minX, minY, width;
+	lowZoomClustersForTile(indexZoom, zoom, dstIndex, minX, minY, width);
+
+	for (TileCoordinate x = minX; x < minX + width && x < CLUSTER_ZOOM_WIDTH; x++) {
+		for (TileCoordinate y = minY; y < minY + width && y < CLUSTER_ZOOM_WIDTH; y++) {
+			const LowZoomObjects<OO>& cluster = objects[x * CLUSTER_ZOOM_WIDTH + y];
+			for (unsigned int minZoom = 0; minZoom <= zoom; minZoom++)
+				for (const OO& object : cluster[minZoom])
+					output.push_back(outputObjectWithId(object));
+		}
+	}
+}
 
-			if (dstIndex.x == x && dstIndex.y == y) {
-				if (objects[i][j].oo.minZoom <= zoom) {
-					output.push_back(outputObjectWithId(objects[i][j]));
-				}
-			}
+// The number of objects collectLowZoomObjectsForTile would copy out
+template<typename OO> size_t countLowZoomObjectsForTile(
+	const unsigned int& indexZoom,
+	const typename std::vector<LowZoomObjects<OO>>& objects,
+	unsigned int zoom,
+	const TileCoordinates& dstIndex
+) {
+	TileCoordinate minX, minY, width;
+	lowZoomClustersForTile(indexZoom, zoom, dstIndex, minX, minY, width);
+
+	size_t count = 0;
+	for (TileCoordinate x = minX; x < minX + width && x < CLUSTER_ZOOM_WIDTH; x++) {
+		for (TileCoordinate y = minY; y < minY + width && y < CLUSTER_ZOOM_WIDTH; y++) {
+			const LowZoomObjects<OO>& cluster = objects[x * CLUSTER_ZOOM_WIDTH + y];
+			for (unsigned int minZoom = 0; minZoom <= zoom; minZoom++)
+				count += cluster[minZoom].size();
 		}
 	}
+	return count;
 }
 
-template<typename OO> void collectObjectsForTileTemplate(
+// Finds the keys that hold a tile's objects, for a tile at z6 or above. They
+// are the run of keys starting at its top-left corner's key, covering every
+// key of its descendants at the index zoom.
+inline void keyRangeForTile(
 	const unsigned int& indexZoom,
-	typename std::vector<AppendVectorNS::AppendVector<OO>>::iterator objects,
-	size_t iStart,
-	size_t iEnd,
 	unsigned int zoom,
 	TileCoordinates dstIndex,
-	std::vector<OutputObjectID>& output
+	Z6Key& needle,
+	size_t& keySpan
 ) {
-	if (zoom < CLUSTER_ZOOM)
-		throw std::runtime_error("collectObjectsForTileTemplate should not be called for low zooms");
-
 	// When base zoom is z15 or higher, we need to scale down to z14.
 	unsigned int clampedZoom = zoom;
 	while(clampedZoom > indexZoom) {
@@ -168,80 +208,72 @@ template<typename OO> void collectObjectsForTileTemplate(
 
 	uint16_t z6OffsetDivisor = indexZoom >= CLUSTER_ZOOM ? (1 << (indexZoom - CLUSTER_ZOOM)) : 1;
 
-	for (size_t i = iStart; i < iEnd; i++) {
-		// If z >= 6, we can compute the exact bounds within the objects array.
-		// Translate to the base zoom, then do a binary search to find
-		// the starting point.
-		TileCoordinate z6x = dstIndex.x / (1 << (clampedZoom - CLUSTER_ZOOM));
-		TileCoordinate z6y = dstIndex.y / (1 << (clampedZoom - CLUSTER_ZOOM));
-
-		TileCoordinate baseX = dstIndex.x * (1 << (indexZoom - clampedZoom));
-		TileCoordinate baseY = dstIndex.y * (1 << (indexZoom - clampedZoom));
-
-		Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
-		Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
-
-		// Kind of gross that we have to do this. Might be better if we split
-		// into two arrays, one of x/y and one of OOs. Would have better locality for
-		// searching, too.
-		OutputObject dummyOo(POINT_, 0, 0, 0, 0);
-		const size_t bz = indexZoom;
-
-		const OO targetXY = {dummyOo, needleX, needleY };
-		auto iter = std::lower_bound(
-			objects[i].begin(),
-			objects[i].end(),
-			targetXY,
-			[bz](const OO& a, const OO& b) {
-				// Cluster by parent zoom, so that a subsequent search
-				// can find a contiguous range of entries for any tile
-				// at zoom 6 or higher.
-				const size_t aX = a.x;
-				const size_t aY = a.y;
-				const size_t bX = b.x;
-				const size_t bY = b.y;
-				for (size_t z = CLUSTER_ZOOM; z <= bz; z++) {
-					const auto aXz = aX / (1 << (bz - z));
-					const auto aYz = aY / (1 << (bz - z));
-					const auto bXz = bX / (1 << (bz - z));
-					const auto bYz = bY / (1 << (bz - z));
-
-					if (aXz != bXz)
-						return aXz < bXz;
-
-					if (aYz != bYz)
-						return aYz < bYz;
-				}
-				return false;
-			}
-		);
+	// Translate to the base zoom, relative to the z6 tile
+	TileCoordinate z6x = dstIndex.x / (1 << (clampedZoom - CLUSTER_ZOOM));
+	TileCoordinate z6y = dstIndex.y / (1 << (clampedZoom - CLUSTER_ZOOM));
 
-		for (; iter != objects[i].end(); iter++) {
-			// Compute the x, y at the base zoom level
-			TileCoordinate baseX = z6x * z6OffsetDivisor + iter->x;
-			TileCoordinate baseY = z6y * z6OffsetDivisor + iter->y;
+	TileCoordinate baseX = dstIndex.x * (1 << (indexZoom - clampedZoom));
+	TileCoordinate baseY = dstIndex.y * (1 << (indexZoom - clampedZoom));
 
-			// Translate the x, y at the requested zoom level
-			TileCoordinate x = baseX / (1 << (indexZoom - clampedZoom));
-			TileCoordinate y = baseY / (1 << (indexZoom - clampedZoom));
+	Z6Offset needleX = baseX - z6x * z6OffsetDivisor;
+	Z6Offset needleY = baseY - z6y * z6OffsetDivisor;
 
-			if (dstIndex.x == x && dstIndex.y == y) {
-				if (iter->oo.minZoom <= zoom) {
-					output.push_back(outputObjectWithId(*iter));
-				}
-			} else {
-				// Short-circuit when we're confident we'd no longer see relevant matches.
-				// We've ordered the entries in `objects` such that all objects that
-				// share the same tile at any zoom are in contiguous runs.
-				//
-				// Thus, as soon as we fail to find a match, we can stop looking.
-				break;
-			}
+	needle = z6Key(needleX, needleY);
+	keySpan = size_t(1) << (2 * (indexZoom - clampedZoom));
+}
 
+template<typename OO> void collectObjectsForTileTemplate(
+	const unsigned int& indexZoom,
+	typename std::vector<Z6Objects<OO>>::iterator objects,
+	size_t iStart,
+	size_t iEnd,
+	unsigned int zoom,
+	TileCoordinates dstIndex,
+	std::vector<OutputObjectID>& output
+) {
+	if (zoom < CLUSTER_ZOOM)
+		throw std::runtime_error("collectObjectsForTileTemplate should not be called for low zooms");
+
+	// If z >= 6, we can compute the exact bounds within the objects array,
+	// then do a binary search to find the starting point.
+	Z6Key needle;
+	size_t keySpan;
+	keyRangeForTile(indexZoom, zoom, dstIndex, needle, keySpan);
+
+	for (size_t i = iStart; i < iEnd; i++) {
+		const size_t start = objects[i].lowerBound(needle);
+		const auto& keys = objects[i].keys;
+
+		auto iter = objects[i].objects.begin() + start;
+		for (size_t j = start; j < keys.size() && size_t(keys[j] - needle) < keySpan; j++, iter++) {
+			const OutputObjectID object = outputObjectWithId(*iter);
+			if (object.oo.minZoom <= zoom)
+				output.push_back(object);
 		}
 	}
 }
 
+// The number of objects in a z6 tile's array that fall in a tile at z6 or
+// above, whatever their minZoom. Two binary searches, so it's cheap.
+template<typename OO> size_t countObjectsForTileTemplate(
+	const unsigned int& indexZoom,
+	const Z6Objects<OO>& objects,
+	unsigned int zoom,
+	TileCoordinates dstIndex
+) {
+	if (zoom < CLUSTER_ZOOM)
+		throw std::runtime_error("countObjectsForTileTemplate should not be called for low zooms");
+
+	Z6Key needle;
+	size_t keySpan;
+	keyRangeForTile(indexZoom, zoom, dstIndex, needle, keySpan);
+
+	const size_t start = objects.lowerBound(needle);
+	if (needle + keySpan > std::numeric_limits<Z6Key>::max())
+		return objects.size() - start;
+	return objects.lowerBound(needle + keySpan) - start;
+}
+
 class TileDataSource {
 public:
 	// Store for generated geometries
@@ -282,16 +314,21 @@ protected:
 	//
 	// If config.include_ids is true, objectsWithIds will be populated.
 	// Otherwise, objects.
-	std::vector<AppendVectorNS::AppendVector<OutputObjectXY>> objects;
-	std::vector<std::vector<OutputObjectXY>> lowZoomObjects;
-	std::vector<AppendVectorNS::AppendVector<OutputObjectXYID>> objectsWithIds;
-	std::vector<std::vector<OutputObjectXYID>> lowZoomObjectsWithIds;
+	std::vector<Z6Objects<OutputObject>> objects;
+	std::vector<LowZoomObjects<OutputObject>> lowZoomObjects;
+	std::vector<Z6Objects<OutputObjectID>> objectsWithIds;
+	std::vector<LowZoomObjects<OutputObjectID>> lowZoomObjectsWithIds;
 	
-	// rtree index of large objects
+	// rtree index of large objects, bulk loaded by finalize()
 	using oo_rtree_param_type = boost::geometry::index::quadratic<128>;
 	boost::geometry::index::rtree< std::pair<Box,OutputObject>, oo_rtree_param_type> boxRtree;
 	boost::geometry::index::rtree< std::pair<Box,OutputObjectID>, oo_rtree_param_type> boxRtreeWithIds;
 
+	// Until then, each thread adds large objects to its own buffer. The id is
+	// 0 if the object belongs in boxRtree. Guarded by mutex.
+	using large_object_buffer_t = std::vector<std::pair<Box,OutputObjectID>>;
+	std::deque<large_object_buffer_t> largeObjectBuffers;
+
 	unsigned int indexZoom;
 
 	std::vector<point_store_t> pointStores;
@@ -301,6 +338,7 @@ protected:
 	
 	ClipCache<MultiPolygon> multiPolygonClipCache;
 	ClipCache<MultiLinestring> multiLinestringClipCache;
+	const uint64_t instanceId;
 
 	std::deque<std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>> pendingSmallIndexObjects;
 
@@ -312,7 +350,9 @@ public:
 	void collectTilesWithLargeObjectsAtZoom(std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms);
 
 	void collectObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
-	void finalize(size_t threadNum);
+	// Queues the sorting of the index on `pool`. The index can't be read
+	// until every future added to `tasks` is ready.
+	void finalize(size_t threadNum, boost::asio::thread_pool& pool, std::vector<std::future<void>>& tasks);
 
 	void addGeometryToIndex(
 		const Linestring& geom,
@@ -334,13 +374,7 @@ public:
 	void addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id, bool needsLock);
 	void addObjectToSmallIndexUnsafe(const TileCoordinates& index, const OutputObject& oo, uint64_t id);
 
-	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
-		std::lock_guard<std::mutex> lock(mutex);
-		if (id == 0 || !includeID)
-			boxRtree.insert(std::make_pair(envelope, oo));
-		else
-			boxRtreeWithIds.insert(std::make_pair(envelope, OutputObjectID({oo, id})));
-	}
+	void addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id);
 
 	void collectLargeObjectsForTile(uint zoom, TileCoordinates dstIndex, std::vector<OutputObjectID>& output);
 
@@ -350,6 +384,11 @@ public:
 		TileCoordinates coordinates
 	);
 
+	// Roughly how much work it is to write a tile from this source, in
+	// objects. Only reads the index, so it can be called before writing
+	// to decide what order to write tiles in.
+	size_t estimateTileCost(unsigned int zoom, TileCoordinates coordinates);
+
 	virtual Geometry buildWayGeometry(OutputGeometryType const geomType, NodeID const objectID, const TileBbox &bbox);
 	virtual LatpLon buildNodeGeometry(NodeID const objectID, const TileBbox &bbox) const;
 
@@ -1,7 +1,11 @@
 #ifndef _TILE_DATA_BASE_H
 #define _TILE_DATA_BASE_H
 
+#include <array>
 #include <cstdint>
+#include <vector>
+#include "append_vector.h"
+#include "mmap_allocator.h"
 #include "output_object.h"
 
 #define TILE_DATA_ID_SIZE 34
@@ -26,17 +30,84 @@
 // out the false positives.
 typedef uint8_t Z6Offset;
 
-struct OutputObjectXY {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
-};
+// The offsets of an object within its z6 tile, as one 16-bit key.
+//
+// The bits of x and y are interleaved, most significant first, with x's
+// bit ahead of y's. Sorting by key orders objects by their parent tile at
+// each zoom from z6 to the index zoom, so every tile's objects are a
+// contiguous run of keys.
+typedef uint16_t Z6Key;
+
+inline Z6Key z6Key(Z6Offset x, Z6Offset y) {
+	Z6Key key = 0;
+	for (unsigned int bit = 0; bit < 8; bit++) {
+		key |= ((x >> bit) & 1) << (2 * bit + 1);
+		key |= ((y >> bit) & 1) << (2 * bit);
+	}
+	return key;
+}
+
+inline Z6Offset z6KeyX(Z6Key key) {
+	Z6Offset x = 0;
+	for (unsigned int bit = 0; bit < 8; bit++)
+		x |= ((key >> (2 * bit + 1)) & 1) << bit;
+	return x;
+}
+
+inline Z6Offset z6KeyY(Z6Key key) {
+	Z6Offset y = 0;
+	for (unsigned int bit = 0; bit < 8; bit++)
+		y |= ((key >> (2 * bit)) & 1) << bit;
+	return y;
+}
+
+// The objects in one z6 tile, as two parallel arrays: their keys, and the
+// objects themselves. Finding a tile's objects only reads the keys.
+//
+// OO is OutputObject, or OutputObjectID if the source includes IDs.
+template<typename OO>
+struct Z6Objects {
+	std::vector<Z6Key, mmap_allocator<Z6Key>> keys;
+	AppendVectorNS::AppendVector<OO> objects;
 
-struct OutputObjectXYID {
-	OutputObject oo;
-	Z6Offset x;
-	Z6Offset y;
-	uint64_t id;
+	size_t size() const { return keys.size(); }
+
+	void push_back(Z6Key key, const OO& object) {
+		keys.push_back(key);
+		objects.push_back(object);
+	}
+
+	void clear() {
+		std::vector<Z6Key, mmap_allocator<Z6Key>>().swap(keys);
+		objects.clear();
+	}
+
+	// The position of the first object whose key is not less than `key`.
+	// Only meaningful once the objects are sorted.
+	size_t lowerBound(Z6Key key) const {
+		if (keys.empty())
+			return 0;
+
+		// Branchless binary search: the loop always runs log2(size) times,
+		// and the comparison becomes a conditional move.
+		const Z6Key* first = keys.data();
+		const Z6Key* base = first;
+		size_t len = keys.size();
+		while (len > 1) {
+			const size_t half = len / 2;
+			base = base[half] < key ? base + half : base;
+			len -= half;
+		}
+		return (base - first) + (*base < key);
+	}
 };
 
+// A z6 tile's objects that are shown below z6, by their minimum zoom.
+//
+// Every z0-z5 tile is made up of whole z6 tiles, so a low zoom tile's
+// objects can be read straight from the z6 tiles it covers, without
+// looking at where each object is.
+template<typename OO>
+using LowZoomObjects = std::array<std::vector<OO>, CLUSTER_ZOOM>;
+
 #endif //_TILE_DATA_BASE_H 
\ No newline at end of file
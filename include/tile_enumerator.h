@@ -0,0 +1,94 @@
+#ifndef TILE_ENUMERATOR_H
+#define TILE_ENUMERATOR_H
+
+#include <deque>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "coordinates.h"
+#include "tile_coordinates_set.h"
+
+typedef std::pair<unsigned int, TileCoordinates> ZoomedTileCoordinates;
+
+// Produces the tiles to write, in the order they should be written: the
+// z0..z5 tiles, then each z6 tile followed by its descendants, depth-first.
+// Without a cost estimate, z0..z5 are breadth-first and z6 tiles are in
+// x, y order.
+//
+// Tiles are read straight from the tile sets, one z6 tile at a time, so
+// only one z6 tile's worth of coordinates is held in memory.
+class TileEnumerator {
+public:
+	// Returns false if the tile shouldn't be written, e.g. because it's
+	// outside the clipping box. If a tile is rejected, so must be all of
+	// its descendants.
+	typedef std::function<bool(unsigned int zoom, TileCoordinate x, TileCoordinate y)> Filter;
+
+	// Returns roughly how much work a tile is to write, e.g. the number of
+	// objects in it.
+	typedef std::function<size_t(unsigned int zoom, TileCoordinate x, TileCoordinate y)> CostEstimate;
+
+	// `zooms` must have a set for each zoom from 0 to endZoom, and a tile
+	// in a set must have its parent in the set for the zoom below.
+	//
+	// Without `cost`, tiles are weighted by zoom alone. With it, the most
+	// expensive z0..z5 tiles and z6 tiles are produced first, so that a big
+	// tile doesn't start just as the others finish, and batches are made
+	// up to the same estimated cost rather than the same number of tiles.
+	//
+	// `cost` is only asked about z0..z6 tiles. A z6 tile's cost is shared
+	// between its descendants at each zoom, as they hold the same objects.
+	TileEnumerator(
+		const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+		unsigned int startZoom,
+		unsigned int endZoom,
+		Filter filter,
+		CostEstimate cost = CostEstimate()
+	);
+
+	// Replaces `batch` with the next few tiles, which together are about
+	// as much work as one z13 tile (or BATCH_COST, with a cost estimate).
+	// Returns false when there are none left.
+	bool next(std::vector<ZoomedTileCoordinates>& batch);
+
+	// As above, and replaces `weights` with each tile's weight: its
+	// estimated cost plus TILE_COST, or tileWeight without an estimate
+	bool next(std::vector<ZoomedTileCoordinates>& batch, std::vector<size_t>& weights);
+
+	// The number of tiles that will be produced at each zoom
+	std::vector<size_t> count() const;
+
+	// Roughly how expensive a tile is to write, relative to a z13 tile
+	static size_t tileWeight(unsigned int zoom);
+
+	// With a cost estimate, each tile also counts as this many objects for
+	// encoding and writing it
+	static const size_t TILE_COST = 10;
+
+private:
+	// The weight of a z0..z6 tile, by the cost estimate if there is one
+	size_t weight(unsigned int zoom, TileCoordinate x, TileCoordinate y) const;
+
+	void addLowZooms();
+	void orderZ6Tiles();
+	void addZ6Tile(TileCoordinate x, TileCoordinate y);
+
+	template<typename Fn> void walk(unsigned int zoom, TileCoordinate x, TileCoordinate y, Fn fn) const;
+
+	const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms;
+	const unsigned int startZoom;
+	const unsigned int endZoom;
+	const Filter filter;
+	const CostEstimate cost;
+
+	bool lowZoomsDone;
+	// The z6 tiles to visit, as x*64 + y, in the order to visit them
+	std::vector<size_t> z6Order;
+	// The estimated cost of each z6 tile, by x*64 + y, if there's an estimate
+	std::vector<size_t> z6Costs;
+	size_t nextZ6Tile;
+	// Tiles waiting to be put in a batch, with their weights
+	std::deque<std::pair<ZoomedTileCoordinates, size_t>> pending;
+};
+
+#endif
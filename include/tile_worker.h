@@ -5,14 +5,16 @@
 #include "tile_data.h"
 #include "shared_data.h"
 
-/// Start function for worker threads
+/// Start function for worker threads. `cost` is the tile's estimated cost,
+/// as weighed by the TileEnumerator.
 void outputProc(
 	SharedData& sharedData,
 	const SourceList& sources,
 	const AttributeStore& attributeStore,
 	const std::vector<std::vector<OutputObjectID>>& data,
 	TileCoordinates coordinates,
-	uint zoom
+	uint zoom,
+	size_t cost
 );
 
 #endif //_TILE_WORKER_H
@@ -0,0 +1,88 @@
+/*! \file */
+#ifndef _TILE_WRITER_H
+#define _TILE_WRITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "coordinates.h"
+#include "helpers.h"
+
+// A serialized tile on its way to the output
+struct RenderedTile {
+	unsigned int zoom;
+	TileCoordinates index;
+	std::string data;		// serialized by the renderer
+	std::string output;		// what to write, filled in by the compress stage
+	ContentHash hash;		// of output, if the compress stage needs to dedupe tiles
+	uint64_t sequence;
+	bool failed;			// the compress stage threw or was skipped, so don't write it
+};
+
+/**
+ * \brief Compresses and writes tiles, away from the threads that render them
+ *
+ * Renderers push serialized tiles onto a queue. Compressor threads take them
+ * off it, then a single writer thread writes them out in the order they were
+ * pushed. At most `capacity` tiles are queued, compressing or waiting to be
+ * written at once; push() blocks until there's room.
+ *
+ * Once a stage has thrown, the output can't be complete: tiles still queued
+ * are dropped, and later pushes are ignored until finish() rethrows.
+ */
+class TileWriter {
+public:
+	typedef std::function<void(RenderedTile&)> Stage;
+
+	TileWriter(size_t compressorThreads, size_t capacity, Stage compress, Stage write);
+	virtual ~TileWriter();
+
+	void push(unsigned int zoom, TileCoordinates index, std::string&& data);
+
+	// Waits for every tile to be written, then stops the threads. Rethrows
+	// the first exception a stage threw, if any.
+	void finish();
+
+	void reportTimings() const;
+
+private:
+	void compressLoop();
+	void writeLoop();
+
+	const size_t capacity;
+	const Stage compress;
+	const Stage write;
+
+	// Guards everything below, up to the threads
+	std::mutex mutex;
+	std::condition_variable spaceAvailable;
+	std::condition_variable tileRendered;
+	std::condition_variable tileCompressed;
+	std::deque<RenderedTile> rendered;
+	std::map<uint64_t, RenderedTile> compressed;
+	uint64_t nextSequence;
+	uint64_t nextToWrite;
+	size_t inFlight;
+	bool finishing;
+	std::exception_ptr error;
+
+	std::vector<std::thread> compressors;
+	std::thread writer;
+	bool finished;
+
+	// Nanoseconds spent in each stage, and waiting for room in the queue
+	std::atomic<uint64_t> pushWaitNs;
+	std::atomic<uint64_t> compressNs;
+	uint64_t writeNs;
+	uint64_t writerIdleNs;
+	uint64_t tilesWritten;
+};
+
+#endif //_TILE_WRITER_H
@@ -64,24 +64,19 @@ void AttributePair::ensureStringIsOwned() {
 }
 
 // AttributePairStore
-thread_local DequeMap<AttributePair> tlsHotShard(1 << 16);
+
+// Called on the stored copy of a pair, not the pair being looked up: a heap
+// PooledString only equals itself, so converting the pair being looked up
+// would stop it matching a copy another thread has just added.
+static void ensureStringIsOwned(AttributePair& pair) {
+	pair.ensureStringIsOwned();
+}
+
 const AttributePair& AttributePairStore::getPair(uint32_t i) const {
+	// Pairs never move once added, so this doesn't need a lock
 	uint32_t shard = i >> (32 - SHARD_BITS);
 	uint32_t offset = i & (~(~0u << (32 - SHARD_BITS)));
 
-	if (shard == 0) {
-		if (offset < tlsHotShard.size())
-			return tlsHotShard[offset];
-
-		{
-			std::lock_guard<std::mutex> lock(pairsMutex[0]);
-			tlsHotShard = pairs[0];
-		}
-
-		return tlsHotShard[offset];
-	}
-
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
 	return pairs[shard][offset];
 };
 
@@ -99,44 +94,31 @@ const AttributePair& AttributePairStore::getPairUnsafe(uint32_t i) const {
 // future without taking a lock.
 thread_local uint64_t tlsPairLookups = 0;
 thread_local uint64_t tlsPairLookupsUncached = 0;
+thread_local uint64_t tlsHotPairLookups = 0;
+
+// Cold pairs seen by this thread in the current block, while sampling
+thread_local std::unordered_map<uint32_t, uint32_t> tlsPairCounts;
 
 thread_local std::vector<const AttributePair*> cachedAttributePairPointers(256);
 thread_local std::vector<uint32_t> cachedAttributePairIndexes(256);
-uint32_t AttributePairStore::addPair(AttributePair& pair, bool isHot) {
-	if (isHot) {
-		{
-			// First, check our thread-local map.
-			const auto& index = tlsHotShard.find(pair);
-			if (index != -1)
-				return index;
-		}
-
-		// Not found, ensure our local map is up-to-date for future calls,
-		// and fall through to the main map.
-		if (!tlsHotShard.full()) {
-			std::lock_guard<std::mutex> lock(pairsMutex[0]);
-			tlsHotShard = pairs[0];
-		}
+uint32_t AttributePairStore::addPair(AttributePair& pair) {
+	const size_t hash = pair.hash();
+	const bool isSampling = sampling.load(std::memory_order_acquire);
 
-		// This might be a popular pair, worth re-using.
-		// Have we already assigned it a hot ID?
-		std::lock_guard<std::mutex> lock(pairsMutex[0]);
-		const auto& index = pairs[0].find(pair);
-		if (index != -1)
-			return index;
-
-		if (!pairs[0].full()) {
-			pair.ensureStringIsOwned();
-			uint32_t offset = pairs[0].add(pair);
-			uint32_t rv = (0 << (32 - SHARD_BITS)) + offset;
-			return rv;
+	{
+		// Has an earlier phase's sample found this pair to be popular, and
+		// assigned it a hot ID?
+		const int32_t index = pairs[0].find(pair, hash);
+		if (index != -1) {
+			tlsHotPairLookups++;
+			if (tlsHotPairLookups % 1024 == 0)
+				hotLookups += 1024;
+			return (0 << (32 - SHARD_BITS)) + index;
 		}
 	}
 
-	// This is either not a hot key, or there's no room for in the hot shard.
-	// Throw it on the pile with the rest of the pairs.
-	size_t hash = pair.hash();
-
+	// This isn't a hot pair, at least not yet. Throw it on the pile with the
+	// rest of the pairs.
 	const size_t candidateIndex = hash % cachedAttributePairPointers.size();
 	// Before taking a lock, see if we've seen this attribute pair recently.
 
@@ -149,8 +131,10 @@ uint32_t AttributePairStore::addPair(AttributePair& pair, bool isHot) {
 	{
 		const AttributePair* candidate = cachedAttributePairPointers[candidateIndex];
 
-		if (candidate != nullptr && *candidate == pair)
+		if (candidate != nullptr && *candidate == pair) {
+			if (isSampling) tlsPairCounts[cachedAttributePairIndexes[candidateIndex]]++;
 			return cachedAttributePairIndexes[candidateIndex];
+		}
 	}
 
 
@@ -161,31 +145,89 @@ uint32_t AttributePairStore::addPair(AttributePair& pair, bool isHot) {
 	if (shard == 0) shard = (hash >> 24) % ATTRIBUTE_SHARDS;
 	if (shard == 0) shard = 1;
 
-	std::lock_guard<std::mutex> lock(pairsMutex[shard]);
-
 	tlsPairLookupsUncached++;
 	if (tlsPairLookupsUncached % 1024 == 0)
 		lookupsUncached += 1024;
 
-	const auto& index = pairs[shard].find(pair);
-	if (index != -1) {
-		const uint32_t rv = (shard << (32 - SHARD_BITS)) + index;
-		cachedAttributePairPointers[candidateIndex] = &pairs[shard][index];
-		cachedAttributePairIndexes[candidateIndex] = rv;
-
-		return rv;
-	}
-
-	pair.ensureStringIsOwned();
-	uint32_t offset = pairs[shard].add(pair);
+	// Lock-free if the pair is already there; add() locks the shard if not
+	const int32_t offset = pairs[shard].add(pair, hash, ensureStringIsOwned);
 
 	if (offset >= (1 << (32 - SHARD_BITS)))
 		throw std::out_of_range("pair shard overflow");
 
-	uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
+	const uint32_t rv = (shard << (32 - SHARD_BITS)) + offset;
+	cachedAttributePairPointers[candidateIndex] = &pairs[shard][offset];
+	cachedAttributePairIndexes[candidateIndex] = rv;
+	if (isSampling) tlsPairCounts[rv]++;
 	return rv;
 };
 
+void AttributePairStore::blockDone() {
+	if (!sampling.load(std::memory_order_acquire)) {
+		tlsPairCounts.clear();
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sampleMutex);
+	mergeSample();
+	sampledBlocks++;
+	// Promotion waits for the end of the phase, when no sets are being made
+	if (sampledBlocks >= sampleBlocks)
+		sampling.store(false, std::memory_order_release);
+}
+
+bool AttributePairStore::endPhase() {
+	std::lock_guard<std::mutex> lock(sampleMutex);
+	// If the phase had fewer blocks than the sample, use what there was
+	mergeSample();
+	const bool promoted = promoteHotPairs();
+	sampledBlocks = 0;
+	sampling.store(!finalized, std::memory_order_release);
+	return promoted;
+}
+
+void AttributePairStore::finalize() {
+	// No more sets are made after this, so there's no point promoting
+	std::lock_guard<std::mutex> lock(sampleMutex);
+	sampling.store(false, std::memory_order_release);
+	tlsPairCounts.clear();
+	std::unordered_map<uint32_t, uint32_t>().swap(sampleCounts);
+	finalized = true;
+}
+
+// Adds this thread's counts to the sample; called with sampleMutex held
+void AttributePairStore::mergeSample() {
+	for (const auto& entry : tlsPairCounts)
+		sampleCounts[entry.first] += entry.second;
+	tlsPairCounts.clear();
+}
+
+// Called with sampleMutex held; returns whether any pair was promoted
+bool AttributePairStore::promoteHotPairs() {
+	std::vector<std::pair<uint32_t, uint32_t>> candidates; // count, index
+	for (const auto& entry : sampleCounts)
+		if (entry.second >= HOT_PAIR_MIN_COUNT)
+			candidates.push_back(std::make_pair(entry.second, entry.first));
+	std::unordered_map<uint32_t, uint32_t>().swap(sampleCounts);
+
+	// Most frequent first; break ties by index, so that the result doesn't
+	// depend on hash map order
+	std::sort(candidates.begin(), candidates.end(), [](const auto& a, const auto& b) {
+		return a.first != b.first ? a.first > b.first : a.second < b.second;
+	});
+	bool promoted = false;
+	for (const auto& candidate : candidates) {
+		// The cold copy already owns its string, so the hot copy can share it
+		const AttributePair& pair = getPair(candidate.second);
+		const int32_t index = pairs[0].add(pair, pair.hash());
+		if (index == -1)
+			break;
+		promotedPairs[candidate.second] = index;
+		promoted = true;
+	}
+	return promoted;
+}
+
 
 // AttributeSet
 void AttributeSet::addPair(uint32_t pairIndex) {
@@ -241,23 +283,19 @@ void AttributeSet::removePairWithKey(const AttributePairStore& pairStore, uint32
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, const protozero::data_view v, char minzoom) {
 	PooledString ps(&v);
 	AttributePair kv(keyStore.key2index(key), ps, minzoom);
-	bool isHot = AttributePair::isHot(key, v);
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	attributeSet.addPair(pairStore.addPair(kv));
 }
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, bool v, char minzoom) {
 	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = true; // All bools are eligible to be hot pairs
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	attributeSet.addPair(pairStore.addPair(kv));
 }
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, double v, char minzoom) {
 	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = v >= 0 && v <= 25 && ceil(v) == v; // Whole numbers in 0..25 are eligible to be hot pairs
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	attributeSet.addPair(pairStore.addPair(kv));
 }
 void AttributeStore::addAttribute(AttributeSet& attributeSet, std::string const &key, int v, char minzoom) {
 	AttributePair kv(keyStore.key2index(key),v,minzoom);
-	bool isHot = v >= 0 && v <= 25;
-	attributeSet.addPair(pairStore.addPair(kv, isHot));
+	attributeSet.addPair(pairStore.addPair(kv));
 }
 
 void AttributeSet::finalize() {
@@ -332,12 +370,20 @@ AttributeIndex AttributeStore::add(AttributeSet &attributes) {
 	// We can't use the top 2 bits (see OutputObject's bitfields)
 	shard = shard >> 2;
 
-	std::lock_guard<std::mutex> lock(setsMutex[shard]);
 	tlsSetLookupsUncached++;
 	if (tlsSetLookupsUncached % 1024 == 0)
 		lookupsUncached += 1024;
 
-	const uint32_t offset = sets[shard].add(attributes);
+	// Rather than store a set again, use the stored one that only differs
+	// by holding the cold index of a pair that's since been promoted. It's
+	// not cached, as the map is rebuilt at the end of each phase.
+	if (!promotedSets.empty() && sets[shard].find(attributes, hash) == -1) {
+		const auto it = promotedSets.find(attributes);
+		if (it != promotedSets.end())
+			return it->second;
+	}
+
+	const uint32_t offset = sets[shard].add(attributes, hash);
 	if (offset >= (1 << (32 - SHARD_BITS)))
 		throw std::out_of_range("set shard overflow");
 
@@ -382,6 +428,10 @@ size_t AttributeStore::size() const {
 void AttributeStore::reportSize() const {
 	std::cout << "Attributes: " << size() << " sets from " << lookups.load() << " objects (" << lookupsUncached.load() << " uncached), " << pairStore.lookups.load() << " pairs (" << pairStore.lookupsUncached.load() << " uncached)" << std::endl;
 
+	const uint64_t hotLookups = pairStore.hotLookups.load();
+	const uint64_t pairLookups = hotLookups + pairStore.lookups.load();
+	std::cout << "Hot attribute pairs: " << pairStore.pairs[0].size() << ", used for " << (pairLookups == 0 ? 0 : (100 * hotLookups / pairLookups)) << "% of " << pairLookups << " pair lookups" << std::endl;
+
 	// Print detailed histogram of frequencies of attributes.
 	if (false) {
 		for (int i = 0; i < ATTRIBUTE_SHARDS; i++) {
@@ -442,17 +492,49 @@ void AttributeStore::reset() {
 	tlsKeys2Index.clear();
 	tlsKeys2IndexSize = 0;
 
-	tlsHotShard.clear();
-
 	for (int i = 0; i < cachedAttributeSetPointers.size(); i++)
 		cachedAttributeSetPointers[i] = nullptr;
 
 	for (int i = 0; i < cachedAttributePairPointers.size(); i++)
 		cachedAttributePairPointers[i] = nullptr;
+
+	tlsPairCounts.clear();
 }
 
 void AttributeStore::finalize() {
 	finalized = true;
 	keyStore.finalize();
 	pairStore.finalize();
+	std::unordered_map<AttributeSet, AttributeIndex, HashMember<AttributeSet>>().swap(promotedSets);
+}
+
+void AttributeStore::endPhase() {
+	if (pairStore.endPhase())
+		findPromotedSets();
+}
+
+// Index every stored set that holds the cold index of a promoted pair by
+// the form it would have if it were made now
+void AttributeStore::findPromotedSets() {
+	promotedSets.clear();
+	for (size_t shard = 0; shard < sets.size(); shard++) {
+		const uint32_t n = sets[shard].size();
+		for (uint32_t offset = 0; offset < n; offset++) {
+			const AttributeSet& set = sets[shard][offset];
+			AttributeSet promoted;
+			bool changed = false;
+			for (size_t i = 0; i < set.numPairs(); i++) {
+				uint32_t pairIndex = set.getPair(i);
+				const auto it = pairStore.promotedPairs.find(pairIndex);
+				if (it != pairStore.promotedPairs.end()) {
+					pairIndex = it->second;
+					changed = true;
+				}
+				promoted.addPair(pairIndex);
+			}
+			if (!changed) continue;
+			promoted.finalize();
+			promotedSets.emplace(promoted, (shard << (32 - SHARD_BITS)) + offset);
+		}
+	}
 }
@@ -0,0 +1,76 @@
+#include "data_store.h"
+
+#define DATA_STORE_SHARDS 256
+
+DataStore::DataStore():
+	shards(DATA_STORE_SHARDS) {
+}
+
+// Hash the whole key: structured keys such as "route_123_name" often only
+// differ in a few characters, and must still spread over every shard.
+static size_t shardHash(const std::string& key) {
+	return std::hash<std::string>()(key);
+}
+
+DataStore::Shard& DataStore::shardFor(const std::string& key) {
+	return shards[shardHash(key) % shards.size()];
+}
+
+const DataStore::Shard& DataStore::shardFor(const std::string& key) const {
+	return shards[shardHash(key) % shards.size()];
+}
+
+void DataStore::set(const std::string& key, DataValue value) {
+	Shard& shard = shardFor(key);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	shard.pending[key] = std::move(value);
+	shard.hasPending.store(true, std::memory_order_release);
+}
+
+bool DataStore::get(const std::string& key, DataValue& value) const {
+	const Shard& shard = shardFor(key);
+	if (shard.hasPending.load(std::memory_order_acquire)) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		auto it = shard.pending.find(key);
+		if (it != shard.pending.end()) {
+			value = it->second;
+			return true;
+		}
+	}
+
+	auto it = shard.committed.find(key);
+	if (it == shard.committed.end())
+		return false;
+	value = it->second;
+	return true;
+}
+
+void DataStore::endPhase() {
+	for (Shard& shard : shards) {
+		if (!shard.hasPending.load()) continue;
+		for (auto& entry : shard.pending)
+			shard.committed[entry.first] = std::move(entry.second);
+		shard.pending.clear();
+		shard.hasPending.store(false);
+	}
+}
+
+void DataStore::clear() {
+	for (Shard& shard : shards) {
+		std::unordered_map<std::string, DataValue>().swap(shard.committed);
+		std::unordered_map<std::string, DataValue>().swap(shard.pending);
+		shard.hasPending.store(false);
+	}
+}
+
+size_t DataStore::size() const {
+	size_t rv = 0;
+	for (const Shard& shard : shards) {
+		rv += shard.committed.size();
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		for (const auto& entry : shard.pending)
+			if (shard.committed.find(entry.first) == shard.committed.end())
+				rv++;
+	}
+	return rv;
+}
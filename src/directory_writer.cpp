@@ -0,0 +1,100 @@
+#include "directory_writer.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <boost/filesystem.hpp>
+
+DirectoryWriter::DirectoryWriter(const std::string& root, size_t ioThreads, size_t capacity):
+	root(root),
+	capacity(std::max<size_t>(1, capacity)),
+	finishing(false),
+	finished(false) {
+	for (size_t i = 0; i < std::max<size_t>(1, ioThreads); i++)
+		threads.emplace_back(&DirectoryWriter::writeLoop, this);
+}
+
+DirectoryWriter::~DirectoryWriter() {
+	if (finished)
+		return;
+	try {
+		finish();
+	} catch (std::exception& e) {
+		std::cerr << "Error writing tiles: " << e.what() << std::endl;
+	}
+}
+
+void DirectoryWriter::write(unsigned int zoom, TileCoordinates index, std::string&& data) {
+	std::unique_lock<std::mutex> lock(mutex);
+	spaceAvailable.wait(lock, [&]() { return queue.size() < capacity; });
+	queue.push_back({ zoom, index, std::move(data) });
+	tileQueued.notify_one();
+}
+
+void DirectoryWriter::writeLoop() {
+	std::vector<QueuedTile> batch;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			tileQueued.wait(lock, [&]() { return !queue.empty() || finishing; });
+			if (queue.empty())
+				return;
+
+			// Take a few tiles at a time, so that threads contend less for the queue
+			while (!queue.empty() && batch.size() < DIRECTORY_WRITER_BATCH) {
+				batch.push_back(std::move(queue.front()));
+				queue.pop_front();
+			}
+		}
+		spaceAvailable.notify_all();
+
+		for (const QueuedTile& tile : batch) {
+			try {
+				writeFile(tile);
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+		}
+		batch.clear();
+	}
+}
+
+void DirectoryWriter::writeFile(const QueuedTile& tile) {
+	ensureDirectory(tile.zoom, tile.index.x);
+	const std::string filename = root + "/" + std::to_string(tile.zoom) + "/" + std::to_string(tile.index.x) + "/" + std::to_string(tile.index.y) + ".pbf";
+	std::ofstream outfile(filename, std::ios::out | std::ios::trunc | std::ios::binary);
+	outfile.write(tile.data.data(), tile.data.size());
+	outfile.close();
+	if (!outfile)
+		throw std::runtime_error("Couldn't write " + filename);
+}
+
+void DirectoryWriter::ensureDirectory(unsigned int zoom, TileCoordinate x) {
+	const uint64_t key = (static_cast<uint64_t>(zoom) << 32) | x;
+	{
+		std::lock_guard<std::mutex> lock(directoriesMutex);
+		if (directories.find(key) != directories.end())
+			return;
+	}
+
+	// Another thread may be creating the same directory; that's harmless
+	boost::filesystem::create_directories(root + "/" + std::to_string(zoom) + "/" + std::to_string(x));
+	std::lock_guard<std::mutex> lock(directoriesMutex);
+	directories.insert(key);
+}
+
+void DirectoryWriter::finish() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finishing = true;
+	}
+	tileQueued.notify_all();
+
+	for (auto& thread : threads)
+		thread.join();
+	finished = true;
+
+	if (error)
+		std::rethrow_exception(error);
+}
@@ -5,12 +5,16 @@
 #include <iomanip>
 #include <sstream>
 #include <cstring>
+#include <memory>
 #include <boost/lexical_cast.hpp>
 #include <boost/algorithm/string.hpp>
 
 #include <sys/stat.h>
 #include "external/libdeflate/libdeflate.h"
 #include "helpers.h"
+#ifdef TM_ZSTD
+#include <zstd.h>
+#endif
 
 #ifdef _MSC_VER
 #define stat64 __stat64
@@ -72,7 +76,10 @@ public:
 };
 
 
-thread_local Compressor compressor(6);
+// Tiles at different zooms may be compressed at different levels, so each
+// thread keeps a compressor for each level it's used
+#define MAX_COMPRESSION_LEVEL 12
+thread_local std::unique_ptr<Compressor> compressors[MAX_COMPRESSION_LEVEL + 1];
 thread_local Decompressor decompressor;
 
 // Bounding box string parsing
@@ -106,8 +113,11 @@ std::string compress_string(const std::string& str,
 	if (compressionlevel == Z_DEFAULT_COMPRESSION)
 		compressionlevel = 6;
 
-	if (compressionlevel != compressor.level)
-		compressor.setLevel(compressionlevel);
+	if (compressionlevel < 0 || compressionlevel > MAX_COMPRESSION_LEVEL)
+		throw std::runtime_error("Invalid compression level " + std::to_string(compressionlevel));
+	if (!compressors[compressionlevel])
+		compressors[compressionlevel].reset(new Compressor(compressionlevel));
+	Compressor& compressor = *compressors[compressionlevel];
 
 	std::string rv;
 	if (asGzip) {
@@ -131,6 +141,62 @@ std::string compress_string(const std::string& str,
 	return rv;
 }
 
+#ifdef TM_ZSTD
+// zstd contexts are expensive to set up, so each thread keeps one of each
+struct ZstdContexts {
+	ZSTD_CCtx* cctx;
+	ZSTD_DCtx* dctx;
+
+	ZstdContexts(): cctx(ZSTD_createCCtx()), dctx(ZSTD_createDCtx()) {
+		if (!cctx || !dctx)
+			throw std::runtime_error("ZSTD_createCCtx/ZSTD_createDCtx failed");
+	}
+	ZstdContexts & operator=(const ZstdContexts&) = delete;
+	ZstdContexts(const ZstdContexts&) = delete;
+	~ZstdContexts() {
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+	}
+};
+
+thread_local ZstdContexts zstdContexts;
+#endif
+
+// Compress a STL string using zstd with given compression level (1-22)
+std::string compress_zstd(const std::string& str, int compressionlevel) {
+#ifdef TM_ZSTD
+	if (compressionlevel == Z_DEFAULT_COMPRESSION)
+		compressionlevel = ZSTD_CLEVEL_DEFAULT;
+
+	std::string rv;
+	rv.resize(ZSTD_compressBound(str.size()));
+	size_t compressedSize = ZSTD_compressCCtx(zstdContexts.cctx, &rv[0], rv.size(), str.data(), str.size(), compressionlevel);
+	if (ZSTD_isError(compressedSize))
+		throw std::runtime_error(std::string("ZSTD_compressCCtx failed: ") + ZSTD_getErrorName(compressedSize));
+	rv.resize(compressedSize);
+	return rv;
+#else
+	throw std::runtime_error("tilemaker was built without zstd support");
+#endif
+}
+
+// Decompress zstd data into a re-usable output buffer, as decompress_string does
+void decompress_zstd(std::string& output, const char* input, uint32_t inputSize) {
+#ifdef TM_ZSTD
+	unsigned long long contentSize = ZSTD_getFrameContentSize(input, inputSize);
+	if (contentSize == ZSTD_CONTENTSIZE_ERROR || contentSize == ZSTD_CONTENTSIZE_UNKNOWN)
+		throw std::runtime_error("ZSTD_getFrameContentSize failed");
+
+	output.resize(contentSize);
+	size_t uncompressedSize = ZSTD_decompressDCtx(zstdContexts.dctx, &output[0], output.size(), input, inputSize);
+	if (ZSTD_isError(uncompressedSize))
+		throw std::runtime_error(std::string("ZSTD_decompressDCtx failed: ") + ZSTD_getErrorName(uncompressedSize));
+	output.resize(uncompressedSize);
+#else
+	throw std::runtime_error("tilemaker was built without zstd support");
+#endif
+}
+
 // Decompress an STL string using zlib and return the original data.
 // The output buffer is passed in; callers are meant to re-use the buffer such
 // that eventually no allocations are needed when decompressing.
@@ -251,3 +317,65 @@ std::vector<OffsetAndLength> getNewlineChunks(const std::string &filename, uint6
 	fclose(fp);
 	return rv;
 }
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xff51afd7ed558ccdULL;
+	k ^= k >> 33;
+	k *= 0xc4ceb9fe1a85ec53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+ContentHash contentHash(const std::string& data) {
+	const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+	const size_t length = data.size();
+	const uint64_t c1 = 0x87c37b91114253d5ULL;
+	const uint64_t c2 = 0x4cf5ad432745937fULL;
+	uint64_t h1 = 0, h2 = 0;
+
+	// Body: 16 bytes at a time
+	const size_t blocks = length / 16;
+	for (size_t i = 0; i < blocks; i++) {
+		uint64_t k1, k2;
+		memcpy(&k1, bytes + i * 16, 8);
+		memcpy(&k2, bytes + i * 16 + 8, 8);
+
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+		h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+		h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+	}
+
+	// Tail: the last 0-15 bytes, little-endian
+	const uint8_t* tail = bytes + blocks * 16;
+	const size_t rest = length & 15;
+	uint64_t k1 = 0, k2 = 0;
+	for (size_t i = rest; i > 8; i--)
+		k2 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 9) * 8);
+	for (size_t i = std::min<size_t>(rest, 8); i > 0; i--)
+		k1 ^= static_cast<uint64_t>(tail[i - 1]) << ((i - 1) * 8);
+	if (rest > 8) {
+		k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+	}
+	if (rest > 0) {
+		k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+	}
+
+	// Finalization
+	h1 ^= length; h2 ^= length;
+	h1 += h2; h2 += h1;
+	h1 = fmix64(h1); h2 = fmix64(h2);
+	h1 += h2; h2 += h1;
+	return { h1, h2, libdeflate_crc32(0, bytes, length) };
+}
+
+std::string ContentHash::hex() const {
+	std::ostringstream ss;
+	ss << std::hex << std::setfill('0') << std::setw(16) << high << std::setw(16) << low << std::setw(8) << crc;
+	return ss.str();
+}
@@ -0,0 +1,340 @@
+#include "lua_profile.h"
+#include <set>
+
+extern "C" {
+	#include "lua.h"
+	#include "lauxlib.h"
+}
+
+// Values nested deeper than this are neither fingerprinted nor snapshotted
+const unsigned int LUA_PROFILE_MAX_DEPTH = 200;
+
+// Fingerprint entry for anything that prevents a snapshot: globals with
+// non-string keys, and values nested too deeply to describe
+const std::string UNSNAPSHOTTABLE(1, '\0');
+
+namespace {
+	void pushGlobals(lua_State* L) {
+#if LUA_VERSION_NUM >= 502
+		lua_pushglobaltable(L);
+#else
+		lua_pushvalue(L, LUA_GLOBALSINDEX);
+#endif
+	}
+
+	int writeBytecode(lua_State* L, const void* p, size_t size, void* ud) {
+		static_cast<std::string*>(ud)->append(static_cast<const char*>(p), size);
+		return 0;
+	}
+
+	template<typename T>
+	void appendBytes(std::string& out, const T& value) {
+		out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+	}
+
+	// Append a description of the value at (absolute) index to `out`. Tables
+	// are followed through their keys, values and metatables, and functions
+	// through their upvalues, so that changes made in place are noticed.
+	// Returns false if something was too deeply nested to describe.
+	bool describe(lua_State* L, int index, std::set<const void*>& visited, unsigned int depth, std::string& out) {
+		int type = lua_type(L, index);
+		out.push_back(static_cast<char>(type));
+
+		switch (type) {
+			case LUA_TNIL:
+				return true;
+
+			case LUA_TBOOLEAN:
+				out.push_back(lua_toboolean(L, index) ? '1' : '0');
+				return true;
+
+			case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+				if (lua_isinteger(L, index)) {
+					out.push_back('i');
+					appendBytes(out, lua_tointeger(L, index));
+					return true;
+				}
+#endif
+				appendBytes(out, lua_tonumber(L, index));
+				return true;
+
+			case LUA_TSTRING: {
+				size_t length = 0;
+				const char* s = lua_tolstring(L, index, &length);
+				appendBytes(out, length);
+				out.append(s, length);
+				return true;
+			}
+
+			case LUA_TTABLE:
+			case LUA_TFUNCTION: {
+				const void* p = lua_topointer(L, index);
+				if (!visited.insert(p).second) {
+					out.push_back('r');
+					appendBytes(out, p);
+					return true;
+				}
+				if (depth >= LUA_PROFILE_MAX_DEPTH || !lua_checkstack(L, 4))
+					return false;
+
+				bool complete = true;
+				if (type == LUA_TFUNCTION) {
+					appendBytes(out, p);
+					for (int n = 1; complete && lua_getupvalue(L, index, n) != nullptr; n++) {
+						complete = describe(L, lua_gettop(L), visited, depth + 1, out);
+						lua_pop(L, 1);
+					}
+					return complete;
+				}
+
+				if (lua_getmetatable(L, index)) {
+					out.push_back('m');
+					complete = describe(L, lua_gettop(L), visited, depth + 1, out);
+					lua_pop(L, 1);
+				}
+				out.push_back('{');
+				lua_pushnil(L);
+				while (lua_next(L, index)) {
+					int top = lua_gettop(L);
+					complete = describe(L, top - 1, visited, depth + 1, out) && complete;
+					complete = describe(L, top, visited, depth + 1, out) && complete;
+					lua_pop(L, 1);
+				}
+				out.push_back('}');
+				return complete;
+			}
+
+			default:
+				// userdata, threads: compare by identity
+				appendBytes(out, lua_topointer(L, index));
+				return true;
+		}
+	}
+}
+
+LuaProfile::LuaProfile() :
+	truncatedFingerprints(0),
+	captureState(CaptureState::Untried) {
+}
+
+const std::string& LuaProfile::bytecode(lua_State* L, const std::string& luaFile) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = bytecodes.find(luaFile);
+	if (it != bytecodes.end())
+		return it->second;
+
+	std::string& code = bytecodes[luaFile];
+	if (luaL_loadfile(L, luaFile.c_str()) == 0) {
+#if LUA_VERSION_NUM >= 503
+		int status = lua_dump(L, writeBytecode, &code, 0);
+#else
+		int status = lua_dump(L, writeBytecode, &code);
+#endif
+		if (status != 0) code.clear();
+	}
+	lua_pop(L, 1); // the compiled chunk, or the error message
+	return code;
+}
+
+bool LuaProfile::restoreInit(lua_State* L) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (captureState != CaptureState::Ready)
+			return false;
+	}
+
+	// Create every table first, so that shared and cyclic references can be
+	// filled in afterwards
+	lua_checkstack(L, 6);
+	lua_createtable(L, tables.size(), 0);
+	int tablesIndex = lua_gettop(L);
+	for (size_t i = 0; i < tables.size(); i++) {
+		lua_createtable(L, 0, tables[i].size());
+		lua_rawseti(L, tablesIndex, i + 1);
+	}
+	for (size_t i = 0; i < tables.size(); i++) {
+		lua_rawgeti(L, tablesIndex, i + 1);
+		for (const auto& entry : tables[i]) {
+			pushValue(L, entry.first, tablesIndex);
+			pushValue(L, entry.second, tablesIndex);
+			lua_rawset(L, -3);
+		}
+		lua_pop(L, 1);
+	}
+
+	pushGlobals(L);
+	for (const auto& global : globals) {
+		lua_pushlstring(L, global.first.data(), global.first.size());
+		pushValue(L, global.second, tablesIndex);
+		lua_rawset(L, -3);
+	}
+	lua_pop(L, 2);
+	return true;
+}
+
+bool LuaProfile::beginCapture() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if (captureState != CaptureState::Untried)
+		return false;
+	captureState = CaptureState::Capturing;
+	return true;
+}
+
+LuaProfile::Fingerprint LuaProfile::fingerprint(lua_State* L) const {
+	Fingerprint rv;
+	lua_checkstack(L, 4);
+	pushGlobals(L);
+	int globalsIndex = lua_gettop(L);
+	const void* globalsTable = lua_topointer(L, globalsIndex);
+
+	lua_pushnil(L);
+	while (lua_next(L, globalsIndex)) {
+		int top = lua_gettop(L);
+		std::set<const void*> visited = { globalsTable };
+		bool complete;
+		if (lua_type(L, top - 1) == LUA_TSTRING) {
+			size_t length = 0;
+			const char* name = lua_tolstring(L, top - 1, &length);
+			complete = describe(L, top, visited, 0, rv[std::string(name, length)]);
+		} else {
+			std::string& description = rv[UNSNAPSHOTTABLE];
+			complete = describe(L, top - 1, visited, 0, description) && describe(L, top, visited, 0, description);
+		}
+		// Make sure that incomplete fingerprints never compare equal
+		if (!complete) appendBytes(rv[UNSNAPSHOTTABLE], truncatedFingerprints++);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+	return rv;
+}
+
+void LuaProfile::endCapture(lua_State* L, const Fingerprint& before, bool eligible) {
+	Fingerprint after = fingerprint(L);
+	std::vector<std::string> changed;
+	for (const auto& global : after) {
+		auto it = before.find(global.first);
+		if (it == before.end() || it->second != global.second)
+			changed.push_back(global.first);
+	}
+	for (const auto& global : before) {
+		if (after.find(global.first) == after.end())
+			changed.push_back(global.first);
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	std::map<const void*, size_t> tableIndexes;
+	lua_checkstack(L, 4);
+	pushGlobals(L);
+	int globalsIndex = lua_gettop(L);
+	for (const std::string& name : changed) {
+		if (!eligible) break;
+		if (name == UNSNAPSHOTTABLE) { eligible = false; break; }
+
+		lua_pushlstring(L, name.data(), name.size());
+		lua_rawget(L, globalsIndex);
+		Value value;
+		eligible = snapshotValue(L, lua_gettop(L), tableIndexes, value, 0);
+		lua_pop(L, 1);
+		globals.emplace_back(name, value);
+	}
+	lua_pop(L, 1);
+
+	if (!eligible) {
+		tables.clear();
+		globals.clear();
+	}
+	captureState = eligible ? CaptureState::Ready : CaptureState::Unavailable;
+}
+
+// Copy plain data at (absolute) index into `out`; tables go in `tables`.
+// Returns false if anything else - functions, userdata, metatables - is found.
+bool LuaProfile::snapshotValue(lua_State* L, int index, std::map<const void*, size_t>& tableIndexes, Value& out, unsigned int depth) {
+	out.type = lua_type(L, index);
+	switch (out.type) {
+		case LUA_TNIL:
+			return true;
+
+		case LUA_TBOOLEAN:
+			out.boolean = lua_toboolean(L, index);
+			return true;
+
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(L, index)) {
+				out.isInteger = true;
+				out.integer = lua_tointeger(L, index);
+				return true;
+			}
+#endif
+			out.number = lua_tonumber(L, index);
+			return true;
+
+		case LUA_TSTRING: {
+			size_t length = 0;
+			const char* s = lua_tolstring(L, index, &length);
+			out.string.assign(s, length);
+			return true;
+		}
+
+		case LUA_TTABLE: {
+			const void* p = lua_topointer(L, index);
+			auto it = tableIndexes.find(p);
+			if (it != tableIndexes.end()) {
+				out.table = it->second;
+				return true;
+			}
+			if (depth >= LUA_PROFILE_MAX_DEPTH || !lua_checkstack(L, 4))
+				return false;
+			if (lua_getmetatable(L, index)) {
+				lua_pop(L, 1);
+				return false;
+			}
+
+			out.table = tables.size();
+			tableIndexes[p] = out.table;
+			tables.emplace_back();
+			lua_pushnil(L);
+			while (lua_next(L, index)) {
+				int top = lua_gettop(L);
+				std::pair<Value, Value> entry;
+				if (!snapshotValue(L, top - 1, tableIndexes, entry.first, depth + 1) ||
+				    !snapshotValue(L, top, tableIndexes, entry.second, depth + 1)) {
+					lua_pop(L, 2);
+					return false;
+				}
+				tables[out.table].push_back(std::move(entry));
+				lua_pop(L, 1);
+			}
+			return true;
+		}
+
+		default:
+			return false;
+	}
+}
+
+void LuaProfile::pushValue(lua_State* L, const Value& value, int tablesIndex) const {
+	switch (value.type) {
+		case LUA_TBOOLEAN:
+			lua_pushboolean(L, value.boolean);
+			break;
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (value.isInteger) {
+				lua_pushinteger(L, value.integer);
+				break;
+			}
+#endif
+			lua_pushnumber(L, value.number);
+			break;
+		case LUA_TSTRING:
+			lua_pushlstring(L, value.string.data(), value.string.size());
+			break;
+		case LUA_TTABLE:
+			lua_rawgeti(L, tablesIndex, value.table + 1);
+			break;
+		default:
+			lua_pushnil(L);
+	}
+}
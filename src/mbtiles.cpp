@@ -7,8 +7,10 @@ using namespace sqlite;
 using namespace std;
 
 MBTiles::MBTiles():
-  pendingStatements1(std::make_shared<std::vector<PendingStatement>>()),
-  pendingStatements2(std::make_shared<std::vector<PendingStatement>>())
+  inTransaction(false),
+  deferIndex(false),
+  deduplicate(false),
+  tilesSaved(0)
 {}
 
 MBTiles::~MBTiles() {
@@ -17,7 +19,26 @@ MBTiles::~MBTiles() {
 
 // ---- Write .mbtiles
 
-void MBTiles::openForWriting(string &filename) {
+// A statement that inserts or replaces `rows` rows at once
+static string insertStatement(const string& verb, const string& table, const string& columns, size_t columnCount, size_t rows) {
+	string row = "(?";
+	for (size_t i = 1; i < columnCount; i++)
+		row += ",?";
+	row += ")";
+
+	string sql = verb + " INTO " + table + " (" + columns + ") VALUES ";
+	for (size_t i = 0; i < rows; i++)
+		sql += (i == 0 ? "" : ",") + row;
+	return sql + ";";
+}
+
+bool MBTiles::tableExists(const string& name) {
+	int count = 0;
+	db << "SELECT COUNT(*) FROM sqlite_master WHERE name=?;" << name >> count;
+	return count > 0;
+}
+
+void MBTiles::openForWriting(string &filename, bool deferIndex, bool deduplicate) {
 	db.init(filename);
 
 	db << "PRAGMA synchronous = OFF;";
@@ -39,10 +60,44 @@ void MBTiles::openForWriting(string &filename) {
 	db << "PRAGMA page_size = 65536;";
 	db << "VACUUM;"; // make sure page_size takes effect
 	db << "CREATE TABLE IF NOT EXISTS metadata (name text, value text, UNIQUE (name));";
-	db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);";
-	db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
-	preparedStatements.emplace_back(db << "INSERT INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
-	preparedStatements.emplace_back(db << "REPLACE INTO tiles (zoom_level, tile_column, tile_row, tile_data) VALUES (?,?,?,?);");
+
+	// An existing file keeps the schema it has
+	if (tableExists("map")) {
+		deduplicate = true;
+	} else if (tableExists("tiles") && deduplicate) {
+		cout << "Existing mbtiles doesn't store identical tiles once, so neither will the merged tiles" << endl;
+		deduplicate = false;
+	}
+	this->deferIndex = deferIndex;
+	this->deduplicate = deduplicate;
+
+	if (deduplicate) {
+		// Each distinct tile is stored once in `images`, and `map` points
+		// each z/x/y at one. The `tiles` view lets readers see them as usual.
+		db << "CREATE TABLE IF NOT EXISTS map (zoom_level integer, tile_column integer, tile_row integer, tile_id text);";
+		db << "CREATE TABLE IF NOT EXISTS images (tile_data blob, tile_id text);";
+		db << "CREATE UNIQUE INDEX IF NOT EXISTS images_id on images (tile_id);";
+		db << "CREATE VIEW IF NOT EXISTS tiles AS SELECT map.zoom_level AS zoom_level, map.tile_column AS tile_column, map.tile_row AS tile_row, images.tile_data AS tile_data FROM map JOIN images ON images.tile_id = map.tile_id;";
+		if (!deferIndex)
+			db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);";
+	} else {
+		db << "CREATE TABLE IF NOT EXISTS tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);";
+		if (!deferIndex)
+			db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
+	}
+
+	const string table = deduplicate ? "map" : "tiles";
+	const string columns = deduplicate ? "zoom_level, tile_column, tile_row, tile_id" : "zoom_level, tile_column, tile_row, tile_data";
+	preparedStatements.emplace_back(db << insertStatement("INSERT", table, columns, 4, 1));
+	preparedStatements.emplace_back(db << insertStatement("REPLACE", table, columns, 4, 1));
+	preparedStatements.emplace_back(db << insertStatement("INSERT", table, columns, 4, MBTILES_BATCH_SIZE));
+	preparedStatements.emplace_back(db << insertStatement("REPLACE", table, columns, 4, MBTILES_BATCH_SIZE));
+	if (deduplicate) {
+		// A tile already in `images` from an earlier batch is skipped
+		preparedStatements.emplace_back(db << insertStatement("INSERT OR IGNORE", "images", "tile_data, tile_id", 2, 1));
+		preparedStatements.emplace_back(db << insertStatement("INSERT OR IGNORE", "images", "tile_data, tile_id", 2, MBTILES_BATCH_SIZE));
+	}
+	pendingStatements.reserve(MBTILES_BATCH_SIZE);
 
 	db << "BEGIN;"; // begin a transaction
 	cout << "Creating mbtiles at " << filename << endl;
@@ -55,47 +110,100 @@ void MBTiles::writeMetadata(string key, string value) {
 	m.unlock();
 }
 
+void MBTiles::bindTile(sqlite::database_binder& statement, int zoom, int x, int y, const std::string& data) {
+	int tmsY = pow(2, zoom) - 1 - y;
+	statement << zoom << x << tmsY;
+	// The tile's data, or its image's id
+	if (deduplicate)
+		statement << data;
+	else
+		statement && data;
+}
+
 void MBTiles::insertOrReplace(int zoom, int x, int y, const std::string& data, bool isMerge) {
 	// NB: assumes we have the `m` mutex
-	int tmsY = pow(2, zoom) - 1 - y;
 	int s = isMerge ? 1 : 0;
 	preparedStatements[s].reset();
-	preparedStatements[s] << zoom << x << tmsY && data;
+	bindTile(preparedStatements[s], zoom, x, y, data);
 	preparedStatements[s].execute();
 }
 
 void MBTiles::flushPendingStatements() {
-	// NB: assumes we have the `m` mutex
+	const std::lock_guard<std::mutex> lock(m);
 
-	for (int i = 0; i < 2; i++) {
-		while(!pendingStatements2->empty()) {
-			const PendingStatement& stmt = pendingStatements2->back();
-			insertOrReplace(stmt.zoom, stmt.x, stmt.y, stmt.data, stmt.isMerge);
-			pendingStatements2->pop_back();
+	// Images first, as that's what's most often buffered
+	if (pendingImages.size() == MBTILES_BATCH_SIZE) {
+		sqlite::database_binder& batch = preparedStatements[5];
+		batch.reset();
+		for (const auto& image : pendingImages)
+			(batch && image.second) << image.first;
+		batch.execute();
+	} else {
+		for (const auto& image : pendingImages) {
+			preparedStatements[4].reset();
+			(preparedStatements[4] && image.second) << image.first;
+			preparedStatements[4].execute();
 		}
+	}
+	pendingImages.clear();
+
+	// A full batch of the same kind of statement goes in one multi-row
+	// statement, anything else one row at a time
+	bool sameKind = true;
+	for (const PendingStatement& stmt : pendingStatements)
+		sameKind = sameKind && stmt.isMerge == pendingStatements.front().isMerge;
 
-		std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1.swap(pendingStatements2);
+	if (pendingStatements.size() == MBTILES_BATCH_SIZE && sameKind) {
+		sqlite::database_binder& batch = preparedStatements[pendingStatements.front().isMerge ? 3 : 2];
+		batch.reset();
+		for (const PendingStatement& stmt : pendingStatements)
+			bindTile(batch, stmt.zoom, stmt.x, stmt.y, stmt.data);
+		batch.execute();
+	} else {
+		for (const PendingStatement& stmt : pendingStatements)
+			insertOrReplace(stmt.zoom, stmt.x, stmt.y, stmt.data, stmt.isMerge);
 	}
+	pendingStatements.clear();
 }
 	
-void MBTiles::saveTile(int zoom, int x, int y, string *data, bool isMerge) {
-	// If the lock is available, write directly to SQLite.
-	if (m.try_lock()) {
-		insertOrReplace(zoom, x, y, *data, isMerge);
-		flushPendingStatements();
-		m.unlock();
+void MBTiles::saveTile(int zoom, int x, int y, string&& data, bool isMerge, const ContentHash& hash) {
+	tilesSaved++;
+	if (deduplicate) {
+		// Only queue the image if we haven't seen it lately. If it was written
+		// before that, SQLite ignores it.
+		const string tileId = hash.hex();
+		if (recentImages.insert(hash).second) {
+			if (recentImages.size() > MBTILES_RECENT_IMAGES) {
+				recentImages.clear();
+				recentImages.insert(hash);
+			}
+			pendingImages.emplace_back(tileId, std::move(data));
+		}
+		pendingStatements.push_back({zoom, x, y, tileId, isMerge});
 	} else {
-		// Else buffer the write for later, copying its binary blob.
-		const std::lock_guard<std::mutex> lock(pendingStatementsMutex);
-		pendingStatements1->push_back({zoom, x, y, *data, isMerge});
+		pendingStatements.push_back({zoom, x, y, std::move(data), isMerge});
 	}
+
+	if (pendingStatements.size() == MBTILES_BATCH_SIZE || pendingImages.size() == MBTILES_BATCH_SIZE)
+		flushPendingStatements();
 }
 
 void MBTiles::closeForWriting() {
 	flushPendingStatements();
-	preparedStatements[0].used(true);
-	preparedStatements[1].used(true);
+	if (deferIndex) {
+		cout << "Indexing mbtiles" << endl;
+		if (deduplicate)
+			db << "CREATE UNIQUE INDEX IF NOT EXISTS map_index on map (zoom_level, tile_column, tile_row);";
+		else
+			db << "CREATE UNIQUE INDEX IF NOT EXISTS tile_index on tiles (zoom_level, tile_column, tile_row);";
+	}
+	if (deduplicate) {
+		sqlite_int64 images = 0;
+		db << "SELECT COUNT(*) FROM images;" >> images;
+		cout << "Stored " << images << " distinct tiles for " << tilesSaved << " tiles written" << endl;
+	}
+	for (auto& statement : preparedStatements)
+		statement.used(true);
 }
 
 // ---- Read mbtiles
@@ -124,7 +232,7 @@ vector<char> MBTiles::readTile(int zoom, int col, int row) {
 	return pbfBlob;
 }
 
-bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool isCompressed, bool asGzip) {
+bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool isCompressed, bool asGzip, bool asZstd) {
 	m.lock();
 	int tmsY = pow(2,zoom) - 1 - y;
 	int exists=0;
@@ -143,7 +251,10 @@ bool MBTiles::readTileAndUncompress(string &data, int zoom, int x, int y, bool i
 	}
 
 	try {
-		decompress_string(data, compressed.data(), compressed.size(), asGzip);
+		if (asZstd)
+			decompress_zstd(data, compressed.data(), compressed.size());
+		else
+			decompress_string(data, compressed.data(), compressed.size(), asGzip);
 		return true;
 	} catch(std::runtime_error &e) {
 		return false;
@@ -23,6 +23,8 @@ po::options_description getParser(OptionsParser::Options& options) {
 		("output", po::value< string >(&options.outputFile),                             "target directory or .mbtiles/.pmtiles file")
 		("bbox",   po::value< string >(&options.bbox),                                   "bounding box to use if input file does not have a bbox header set, example: minlon,minlat,maxlon,maxlat")
 		("merge"  ,po::bool_switch(&options.mergeSqlite),                                "merge with existing .mbtiles (overwrites otherwise)")
+		("dedup"  ,po::bool_switch(&options.deduplicate),                                "store identical tiles once in .mbtiles (map/images schema)")
+		("cluster",po::bool_switch(&options.clustered),                                  "write .pmtiles tile data in tile ID order (clustered)")
 		("config", po::value< string >(&options.jsonFile)->default_value("config.json"), "config JSON file")
 		("process",po::value< string >(&options.luaFile)->default_value("process.lua"),  "tag-processing Lua file")
 		("quiet",  po::bool_switch(&options.quiet),                                      "quiet, suppress standard output")
@@ -10,6 +10,8 @@
 #include "tag_map.h"
 #include "node_store.h"
 #include "polylabel.h"
+#include "lua_profile.h"
+#include "data_store.h"
 #include <signal.h>
 
 using namespace std;
@@ -19,8 +21,8 @@ thread_local kaguya::State *g_luaState = nullptr;
 thread_local OsmLuaProcessing* osmLuaProcessing = nullptr;
 
 std::deque<std::mutex> vectorLayerMetadataMutexes;
-std::unordered_map<std::string, std::string> OsmLuaProcessing::dataStore;
-std::mutex OsmLuaProcessing::dataStoreMutex;
+DataStore OsmLuaProcessing::dataStore;
+LuaProfile luaProfile;
 
 void handleOsmLuaProcessingUserSignal(int signum) {
 	osmLuaProcessing->handleUserSignal(signum);
@@ -122,6 +124,97 @@ template<>  struct kaguya::lua_type_traits<protozero::data_view> {
 	}
 };
 
+// Values for SetData/GetData: strings, numbers, booleans, or tables of these
+#define DATA_TABLE_MAX_DEPTH 32
+DataValue getDataValue(lua_State* l, int index, unsigned int depth) {
+	DataValue rv;
+	switch (lua_type(l, index)) {
+		case LUA_TSTRING: {
+			size_t size = 0;
+			const char* buffer = lua_tolstring(l, index, &size);
+			rv.string = std::string(buffer, size);
+			break;
+		}
+		case LUA_TNUMBER:
+#if LUA_VERSION_NUM >= 503
+			if (lua_isinteger(l, index)) {
+				rv.type = DataValue::Type::Integer;
+				rv.integer = lua_tointeger(l, index);
+				break;
+			}
+#endif
+			rv.type = DataValue::Type::Number;
+			rv.number = lua_tonumber(l, index);
+			break;
+		case LUA_TBOOLEAN:
+			rv.type = DataValue::Type::Boolean;
+			rv.boolean = lua_toboolean(l, index);
+			break;
+		case LUA_TTABLE: {
+			if (depth >= DATA_TABLE_MAX_DEPTH) throw std::runtime_error("SetData: table is nested too deeply");
+			if (index < 0) index = lua_gettop(l) + index + 1;
+			// Each level holds a key and a value on the stack while it recurses
+			if (!lua_checkstack(l, 3)) throw std::runtime_error("SetData: not enough Lua stack for nested table");
+			auto table = std::make_shared<DataTable>();
+			lua_pushnil(l);
+			while (lua_next(l, index) != 0) {
+				table->keys.push_back(getDataValue(l, -2, depth + 1));
+				table->values.push_back(getDataValue(l, -1, depth + 1));
+				lua_pop(l, 1);
+			}
+			rv.type = DataValue::Type::Table;
+			rv.table = table;
+			break;
+		}
+		default:
+			throw std::runtime_error(std::string("SetData can't store a value of type ") + lua_typename(l, lua_type(l, index)));
+	}
+	return rv;
+}
+
+void pushDataValue(lua_State* l, const DataValue& value) {
+	switch (value.type) {
+		case DataValue::Type::String:  lua_pushlstring(l, value.string.data(), value.string.size()); break;
+		case DataValue::Type::Number:  lua_pushnumber(l, value.number); break;
+		case DataValue::Type::Integer: lua_pushinteger(l, value.integer); break;
+		case DataValue::Type::Boolean: lua_pushboolean(l, value.boolean); break;
+		case DataValue::Type::Table:
+			// Each level holds the table and a key while it recurses
+			if (!lua_checkstack(l, 3)) throw std::runtime_error("GetData: not enough Lua stack for nested table");
+			lua_createtable(l, 0, value.table->keys.size());
+			for (size_t i = 0; i < value.table->keys.size(); i++) {
+				pushDataValue(l, value.table->keys[i]);
+				pushDataValue(l, value.table->values[i]);
+				lua_rawset(l, -3);
+			}
+			break;
+	}
+}
+
+template<>  struct kaguya::lua_type_traits<DataValue> {
+	typedef DataValue get_type;
+	typedef const DataValue& push_type;
+
+	static bool strictCheckType(lua_State* l, int index)
+	{
+		int type = lua_type(l, index);
+		return type == LUA_TSTRING || type == LUA_TNUMBER || type == LUA_TBOOLEAN || type == LUA_TTABLE;
+	}
+	static bool checkType(lua_State* l, int index)
+	{
+		return strictCheckType(l, index);
+	}
+	static get_type get(lua_State* l, int index)
+	{
+		return getDataValue(l, index, 0);
+	}
+	static int push(lua_State* l, push_type value)
+	{
+		pushDataValue(l, value);
+		return 1;
+	}
+};
+
 // Gets a table of all the keys of the OSM tags
 kaguya::LuaTable getAllKeys(kaguya::State& luaState, const boost::container::flat_map<std::string, std::string>* tags) {
 	kaguya::LuaTable tagsTable = luaState.newTable();
@@ -200,13 +293,15 @@ std::string rawFindInRelation(const std::string& key) { return osmLuaProcessing-
 void rawAccept() { return osmLuaProcessing->Accept(); }
 double rawAreaIntersecting(const std::string& layerName) { return osmLuaProcessing->AreaIntersecting(layerName); }
 
-void rawSetData(const std::string &key, const std::string &value) { 
-	std::lock_guard<std::mutex> lock(osmLuaProcessing->dataStoreMutex);
-	osmLuaProcessing->dataStore[key] = value;
+void rawSetData(const std::string &key, const DataValue &value) { 
+	osmLuaProcessing->initHadSideEffects = true;
+	osmLuaProcessing->dataStore.set(key, value);
 }
-std::string rawGetData(const std::string &key) {
-	auto r = osmLuaProcessing->dataStore.find(key);
-	return r==osmLuaProcessing->dataStore.end() ? "" : r->second;
+DataValue rawGetData(const std::string &key) {
+	osmLuaProcessing->initHadSideEffects = true;
+	DataValue value;
+	osmLuaProcessing->dataStore.get(key, value);
+	return value; // empty string if not found
 }
 
 bool supportsRemappingShapefiles = false;
@@ -241,17 +336,21 @@ OsmLuaProcessing::OsmLuaProcessing(
 	layers(layers),
 	materializeGeometries(materializeGeometries) {
 
-	sigusr1Handler.initialize();
 	if (vectorLayerMetadataMutexes.size() <= layers.layers.size()) {
 		vectorLayerMetadataMutexes.resize(layers.layers.size() + 1);
 	}
 
 	// ----	Initialise Lua
-	g_luaState = &luaState;
+	attachToThread();
 	luaState.setErrorHandler(lua_error_handler);
-	luaState.dofile(luaFile.c_str());
+	const std::string& bytecode = luaProfile.bytecode(luaState.state(), luaFile);
+	if (bytecode.empty()) {
+		luaState.dofile(luaFile.c_str());
+	} else {
+		std::istringstream stream(bytecode);
+		luaState.dostream(stream, ("@" + luaFile).c_str());
+	}
 
-	osmLuaProcessing = this;
 	luaState["Id"] = &rawId;
 	luaState["OsmType"] = &rawOsmType;
 	luaState["AllKeys"] = &rawAllKeys;
@@ -306,12 +405,24 @@ OsmLuaProcessing::OsmLuaProcessing(
 	supportsWritingRelations    = !!luaState["relation_function"];
 
 	// ---- Call init_function of Lua logic
+	// (later states can usually copy the globals it set, rather than call it)
 
-	if (!!luaState["init_function"]) {
+	if (!!luaState["init_function"] && (isFirst || !luaProfile.restoreInit(luaState.state()))) {
+		bool capture = !isFirst && luaProfile.beginCapture();
+		LuaProfile::Fingerprint before;
+		if (capture) before = luaProfile.fingerprint(luaState.state());
+		initHadSideEffects = false;
 		luaState["init_function"](this->config.projectName, isFirst);
+		if (capture) luaProfile.endCapture(luaState.state(), before, !initHadSideEffects);
 	}
 }
 
+void OsmLuaProcessing::attachToThread() {
+	sigusr1Handler.initialize();
+	g_luaState = &luaState;
+	osmLuaProcessing = this;
+}
+
 OsmLuaProcessing::~OsmLuaProcessing() {
 	// Call exit_function of Lua logic
 	luaState("if exit_function~=nil then exit_function() end");
@@ -457,8 +568,8 @@ std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, boo
 			rtree.query(geom::index::intersects(box), back_inserter(results));
 			return results;
 		},
-		[&](OutputObject const &oo) { // checkQuery
-			return geom::intersects(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
+		[&](uint id, OutputObject const &oo) { // checkQuery
+			return shpMemTiles.indexedIntersects(id, geom);
 		}
 	);
 	return ids;
@@ -466,22 +577,7 @@ std::vector<uint> OsmLuaProcessing::intersectsQuery(const string &layerName, boo
 
 template <typename GeometryT>
 double OsmLuaProcessing::intersectsArea(const string &layerName, GeometryT &geom) const {
-	Box box; geom::envelope(geom, box);
-	double area = 0.0;
-	std::vector<uint> ids = shpMemTiles.QueryMatchingGeometries(layerName, false, box,
-		[&](const RTree &rtree) { // indexQuery
-			vector<IndexValue> results;
-			rtree.query(geom::index::intersects(box), back_inserter(results));
-			return results;
-		},
-		[&](OutputObject const &oo) { // checkQuery
-			MultiPolygon tmp;
-			geom::intersection(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID), tmp);
-			area += multiPolygonArea(tmp);
-			return false;
-		}
-	);
-	return area;
+	return shpMemTiles.AreaIntersecting(layerName, geom, [&](const MultiPolygon &mp) { return multiPolygonArea(mp); });
 }
 
 template <typename GeometryT>
@@ -493,9 +589,9 @@ std::vector<uint> OsmLuaProcessing::coveredQuery(const string &layerName, bool o
 			rtree.query(geom::index::intersects(box), back_inserter(results));
 			return results;
 		},
-		[&](OutputObject const &oo) { // checkQuery
+		[&](uint id, OutputObject const &oo) { // checkQuery
 			if (oo.geomType!=POLYGON_) return false; // can only be covered by a polygon!
-			return geom::covered_by(geom, shpMemTiles.retrieveMultiPolygon(oo.objectID));
+			return shpMemTiles.indexedCovers(id, geom);
 		}
 	);
 	return ids;
@@ -624,6 +720,15 @@ const MultiPolygon &OsmLuaProcessing::multiPolygonCached() {
 	return multiPolygonCache;
 }
 
+const Point &OsmLuaProcessing::centroidCached(CentroidAlgorithm algorithm) {
+	const size_t i = static_cast<size_t>(algorithm);
+	if (!centroidInited[i]) {
+		centroidCache[i] = calculateCentroid(algorithm);
+		centroidInited[i] = true;
+	}
+	return centroidCache[i];
+}
+
 // ----	Requests from Lua to write this way/node to a vector tile's Layer
 
 // Add object to specified layer from Lua
@@ -638,11 +743,13 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 	OutputGeometryType geomType = isRelation ? (area ? POLYGON_ : MULTILINESTRING_ ) :
 	                                   isWay ? (area ? POLYGON_ : LINESTRING_) : POINT_;
 	try {
-		// Lua profiles often write the same geometry twice, e.g. a river and its name,
-		// a highway and its name. Avoid duplicating geometry processing and storage
-		// when this occurs.
-		if (lastStoredGeometryId != 0 && lastStoredGeometryType == geomType) {
-			OutputObject oo(geomType, layers.layerMap[layerName], lastStoredGeometryId, 0, layerMinZoom);
+		// Lua profiles often write the same geometry more than once, e.g. a river
+		// and its name, or a relation as both an area and a boundary line. Each
+		// geometry type is corrected and stored at most once per object.
+		NodeID &storedId = storedGeometryIds[geomType];
+		if (storedId == INVALID_GEOMETRY_ID) return;
+		if (storedId != 0) {
+			OutputObject oo(geomType, layers.layerMap[layerName], storedId, 0, layerMinZoom);
 			outputs.push_back(std::make_pair(std::move(oo), attributes));
 			return;
 		}
@@ -650,11 +757,12 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 		if (geomType==POINT_) {
 			Point p = Point(lon, latp);
 
-			if(CorrectGeometry(p) == CorrectGeometryResult::Invalid) return;
+			if(CorrectGeometry(p) == CorrectGeometryResult::Invalid) { storedId = INVALID_GEOMETRY_ID; return; }
 
 			NodeID id = USE_NODE_STORE | originalOsmID;
 			if (materializeGeometries)
 				id = osmMemTiles.storePoint(p);
+			storedId = id;
 			OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 			outputs.push_back(std::make_pair(std::move(oo), attributes));
 			return;
@@ -667,8 +775,9 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 			if (isRelation) {
 				try {
 					mp = multiPolygonCached();
-					if(CorrectGeometry(mp) == CorrectGeometryResult::Invalid) return;
+					if(CorrectGeometry(mp) == CorrectGeometryResult::Invalid) { storedId = INVALID_GEOMETRY_ID; return; }
 					NodeID id = osmMemTiles.storeMultiPolygon(mp);
+					storedId = id;
 					OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 					outputs.push_back(std::make_pair(std::move(oo), attributes));
 				} catch(std::out_of_range &err) {
@@ -686,13 +795,14 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 				mp.push_back(std::move(p));
 
 				auto correctionResult = CorrectGeometry(mp);
-				if(correctionResult == CorrectGeometryResult::Invalid) return;
+				if(correctionResult == CorrectGeometryResult::Invalid) { storedId = INVALID_GEOMETRY_ID; return; }
 				NodeID id = 0;
 				if (!materializeGeometries && correctionResult == CorrectGeometryResult::Valid) {
 					id = USE_WAY_STORE | originalOsmID;
 					wayEmitted = true;
 				} else 
 					id = osmMemTiles.storeMultiPolygon(mp);
+				storedId = id;
 				OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 				outputs.push_back(std::make_pair(std::move(oo), attributes));
 			}
@@ -707,11 +817,10 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 				cout << "In relation " << originalOsmID << ": " << err.what() << endl;
 				return;
 			}
-			if (CorrectGeometry(mls) == CorrectGeometryResult::Invalid) return;
+			if (CorrectGeometry(mls) == CorrectGeometryResult::Invalid) { storedId = INVALID_GEOMETRY_ID; return; }
 
 			NodeID id = osmMemTiles.storeMultiLinestring(mls);
-			lastStoredGeometryId = id;
-			lastStoredGeometryType = geomType;
+			storedId = id;
 			OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 			outputs.push_back(std::make_pair(std::move(oo), attributes));
 		}
@@ -720,7 +829,7 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 			Linestring ls = linestringCached();
 
 			auto correctionResult = CorrectGeometry(ls);
-			if(correctionResult == CorrectGeometryResult::Invalid) return;
+			if(correctionResult == CorrectGeometryResult::Invalid) { storedId = INVALID_GEOMETRY_ID; return; }
 
 			if (isWay && !isRelation) {
 				NodeID id = 0;
@@ -729,14 +838,12 @@ void OsmLuaProcessing::Layer(const string &layerName, bool area) {
 					wayEmitted = true;
 				}	else 
 					id = osmMemTiles.storeLinestring(ls);
-				lastStoredGeometryId = id;
-				lastStoredGeometryType = geomType;
+				storedId = id;
 				OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 				outputs.push_back(std::make_pair(std::move(oo), attributes));
 			} else {
 				NodeID id = osmMemTiles.storeLinestring(ls);
-				lastStoredGeometryId = id;
-				lastStoredGeometryType = geomType;
+				storedId = id;
 				OutputObject oo(geomType, layers.layerMap[layerName], id, 0, layerMinZoom);
 				outputs.push_back(std::make_pair(std::move(oo), attributes));
 			}
@@ -815,7 +922,7 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName, kaguya::Variadic
 		}
 
 		if (!centroidFound)
-			geomp = calculateCentroid(algorithm);
+			geomp = centroidCached(algorithm);
 
 		// TODO: I think geom::is_empty always returns false for Points?
 		// See https://github.com/boostorg/geometry/blob/fa3623528ea27ba2c3c1327e4b67408a2b567038/include/boost/geometry/algorithms/is_empty.hpp#L103
@@ -846,7 +953,16 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName, kaguya::Variadic
 	//     express it in the ID and measure if there's a runtime impact in computing
 	//     the polylabel twice.
 	if (materializeGeometries || (isRelation && relationNode == 0) || (isWay && algorithm != CentroidAlgorithm::Centroid)) {
-		id = osmMemTiles.storePoint(geomp);
+		// A node used as a relation's label is stored like any other point,
+		// so only memoize the computed centroids
+		NodeID &storedCentroidId = storedCentroidIds[static_cast<size_t>(algorithm)];
+		if (relationNode != 0)
+			id = osmMemTiles.storePoint(geomp);
+		else {
+			if (storedCentroidId == 0)
+				storedCentroidId = osmMemTiles.storePoint(geomp);
+			id = storedCentroidId;
+		}
 	} else if (relationNode != 0) {
 		id = USE_NODE_STORE | relationNode;
 	} else if (!isRelation && !isWay) {
@@ -865,8 +981,7 @@ void OsmLuaProcessing::LayerAsCentroid(const string &layerName, kaguya::Variadic
 Point OsmLuaProcessing::calculateCentroid(CentroidAlgorithm algorithm) {
 	Point centroid;
 	if (isRelation) {
-		MultiPolygon tmp;
-		tmp = multiPolygonCached();
+		const MultiPolygon &tmp = multiPolygonCached();
 
 		if (algorithm == CentroidAlgorithm::Polylabel) {
 			int index = 0;
@@ -934,7 +1049,7 @@ kaguya::optional<std::vector<double>> OsmLuaProcessing::Centroid(kaguya::Variadi
 		break;
 	}
 	try {
-		Point c = calculateCentroid(algorithm);
+		const Point &c = centroidCached(algorithm);
 		return std::vector<double> { latp2lat(c.y()/10000000.0), c.x()/10000000.0 };
 	} catch (geom::centroid_exception &err) {
 		if (verbose) cerr << "Problem geometry " << (isRelation ? "relation " : isWay ? "way " : "node " ) << originalOsmID << ": " << err.what() << endl;
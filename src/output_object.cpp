@@ -33,29 +33,45 @@ std::ostream& operator<<(std::ostream& os, OutputGeometryType geomType)
 
 void OutputObject::writeAttributes(
 	const AttributeStore& attributeStore,
+	vtzero::layer_builder& vtLayer,
 	vtzero::feature_builder& fbuilder,
-	char zoom
+	char zoom,
+	EncodedAttributes& encodedAttributes
 ) const {
-	auto attr = attributeStore.getUnsafe(attributes);
+	auto encoded = encodedAttributes.find(attributes);
+	if (encoded == encodedAttributes.end()) {
+		// First use of this attribute set in the layer: add its keys and values
+		// to the layer's tables, and remember their indexes
+		std::vector<vtzero::index_value_pair> properties;
+		auto attr = attributeStore.getUnsafe(attributes);
 
-	for(auto const &it: attr) {
-		if (it->minzoom > zoom) continue;
+		for(auto const &it: attr) {
+			if (it->minzoom > zoom) continue;
 
-		// TODO: consider taking a data view that is stable
-		// Look for key
-		const std::string& key = attributeStore.keyStore.getKeyUnsafe(it->keyIndex);
-		
-		if (it->hasStringValue()) {
-			fbuilder.add_property(key, it->stringValue());
-		} else if (it->hasBoolValue()) {
-			fbuilder.add_property(key, it->boolValue());
-		} else if (it->hasIntValue()) {
-			// could potentially add ,vtzero::sint_value_type(2) to force sint encoding (efficient for -ve ints)
-			fbuilder.add_property(key, it->intValue());
-		} else if (it->hasFloatValue()) {
-			fbuilder.add_property(key, it->floatValue());
+			// TODO: consider taking a data view that is stable
+			// Look for key
+			const std::string& key = attributeStore.keyStore.getKeyUnsafe(it->keyIndex);
+			vtzero::index_value keyIndex = vtLayer.add_key(key);
+
+			vtzero::index_value valueIndex;
+			if (it->hasStringValue()) {
+				valueIndex = vtLayer.add_value(vtzero::encoded_property_value(it->stringValue()));
+			} else if (it->hasBoolValue()) {
+				valueIndex = vtLayer.add_value(vtzero::encoded_property_value(it->boolValue()));
+			} else if (it->hasIntValue()) {
+				// could potentially add ,vtzero::sint_value_type(2) to force sint encoding (efficient for -ve ints)
+				valueIndex = vtLayer.add_value(vtzero::encoded_property_value(it->intValue()));
+			} else if (it->hasFloatValue()) {
+				valueIndex = vtLayer.add_value(vtzero::encoded_property_value(it->floatValue()));
+			} else
+				continue;
+			properties.emplace_back(keyIndex, valueIndex);
 		}
+		encoded = encodedAttributes.emplace(attributes, std::move(properties)).first;
 	}
+
+	for (const auto& property : encoded->second)
+		fbuilder.add_property(property);
 }
 
 bool OutputObject::compatible(const OutputObject &other) {
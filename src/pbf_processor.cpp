@@ -463,6 +463,10 @@ bool PbfProcessor::ReadBlock(
 		}
 	}
 
+	// Lets the attribute store decide which pairs are common enough to be hot
+	if (read_groups > 0)
+		output.getAttributeStore().pairStore.blockDone();
+
 	// Possible cases of a block contents:
 	// - single group
 	// - multiple groups of the same type
@@ -744,6 +748,13 @@ int PbfProcessor::ReadPbfFile(
 		if(phase == ReadPhase::Ways) {
 			osmStore.ways.finalize(threadNum);
 		}
+
+		// Values set with SetData can now be read without locking
+		OsmLuaProcessing::dataStore.endPhase();
+
+		// Pairs common in this phase are hot from now on; the next phase
+		// (e.g. ways after nodes) has different ones, so sample it afresh
+		generate_output()->getAttributeStore().endPhase();
 	}
 	return 0;
 }
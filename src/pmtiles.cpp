@@ -2,59 +2,75 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <cstdio>
 #include <map>
 #include <unordered_map>
 #include <mutex>
+#include <thread>
 
 #include "pmtiles.h"
 #include "helpers.h"
 
 TileOffset::TileOffset() { }
+
+// The first tile ID at a zoom
+static uint64_t firstTileId(unsigned int zoom) {
+	return ((uint64_t(1) << (2 * zoom)) - 1) / 3;
+}
+
+static unsigned int tileIdZoom(uint64_t tileId) {
+	unsigned int zoom = 0;
+	while (tileId >= firstTileId(zoom + 1)) zoom++;
+	return zoom;
+}
+
+// Tile IDs follow a Hilbert curve at each zoom, which is hierarchical: from
+// z6 up, a z6 tile's descendants have one aligned range of IDs. This is which
+// range a tile is in, or 0 for any tile below z6.
+static uint64_t spillCluster(unsigned int zoom, uint64_t tileId) {
+	return zoom < 6 ? 0 : (tileId - firstTileId(zoom)) >> (2 * (zoom - 6));
+}
 PMTiles::PMTiles() { }
-PMTiles::~PMTiles() { }
 
-void PMTiles::open(std::string &filename) {
+// If close() wasn't reached, don't leave the spill files behind
+PMTiles::~PMTiles() {
+	removeSpillFiles();
+}
+
+void PMTiles::open(std::string &filename, bool clustered) {
 	std::cout << "Creating pmtiles at " << filename << std::endl;
 	outputStream.open(filename, std::ios::out | std::ios::trunc | std::ios::binary);
 	// dummy header/root directory for now - we'll write it all later
 	char header[HEADER_ROOT] = "PMTiles";
 	outputStream.write(header, HEADER_ROOT);
+
+	isClustered = clustered;
+	outputFilename = filename;
 }
 
 // Finish writing the .pmtiles file
 void PMTiles::close(std::string &metadata) {
 	std::cout << "\nClosing pmtiles file" << std::flush;
+	if (isClustered) clusterTiles();
 
-	// add all tiles to directories, writing leaf directories as we go
+	// add all tiles to directories
 	std::vector<pmtiles::entryv3> rootEntries;
-	std::vector<pmtiles::entryv3> entries;
-	leafStart = outputStream.tellp();
-	if (isSparse) {
-		for (auto it : sparseIndex) {
-			appendTileEntry(it.first, it.second, rootEntries, entries);
-		}
-	} else {
-		for (size_t tileId=0; tileId<denseIndex.size(); tileId++) {
-			if (denseIndex[tileId].length != 0xffffff) appendTileEntry(tileId, denseIndex[tileId], rootEntries, entries);
-		}
-	}
-	if (numTileEntries < ROOT_ONLY) {
-		rootEntries.insert(rootEntries.end(), entries.begin(), entries.end());
-		entries.clear();
-	} else {
-		flushEntries(rootEntries,entries);
-	}
+	writeDirectories(rootEntries);
+	std::map<uint64_t, TileOffset>().swap(sparseIndex);	// no longer needed, so make room
+	std::vector<TileOffset>().swap(denseIndex);
 	uint64_t leafLength = static_cast<uint64_t>(outputStream.tellp()) - leafStart;
 
 	// create JSON metadata
-	std::string compressed = compress_string(metadata, Z_DEFAULT_COMPRESSION, true);
+	std::string compressed = compress(metadata, compressionLevel);
 	uint64_t jsonStart = static_cast<uint64_t>(outputStream.tellp());
 	int jsonLength = compressed.size();
 	outputStream.write(compressed.c_str(), jsonLength);
 	
-	// write root directory
+	// write root directory (at the default level, whatever the tiles use,
+	// as it has to fit before the tile data)
 	std::string directory = pmtiles::serialize_directory(rootEntries);
-	compressed = compress_string(directory, Z_DEFAULT_COMPRESSION, true);
+	compressed = compress(directory, Z_DEFAULT_COMPRESSION);
 	int rootLength = compressed.size();
 	if (rootLength > (HEADER_ROOT-127)) { throw std::runtime_error(".pmtiles root directory was too large - please file an issue"); }
 	outputStream.seekp(127);
@@ -72,9 +88,9 @@ void PMTiles::close(std::string &metadata) {
 	header.addressed_tiles_count = numTilesAddressed;
 	header.tile_entries_count = numTileEntries;
 	header.tile_contents_count = numTilesWritten;
-	header.clustered = false;
-	header.internal_compression = pmtiles::COMPRESSION_GZIP;
-	header.tile_compression = pmtiles::COMPRESSION_GZIP;
+	header.clustered = isClustered;
+	header.internal_compression = zstd ? pmtiles::COMPRESSION_ZSTD : pmtiles::COMPRESSION_GZIP;
+	header.tile_compression = zstd ? pmtiles::COMPRESSION_ZSTD : pmtiles::COMPRESSION_GZIP;
 	header.tile_type = pmtiles::TILETYPE_MVT;
 
 	// write header
@@ -84,73 +100,276 @@ void PMTiles::close(std::string &metadata) {
 
 	// ...and we're done!
 	outputStream.close();
+	std::cout << std::endl << "Stored " << numTilesWritten << " distinct tiles for " << numTilesAddressed << " tiles written"
+		<< ", saving " << (bytesDeduplicated / 1024 / 1024) << "MB in " << numTilesDeduplicated << " repeated tiles" << std::endl;
 }
 
-// Add an entry either to the current leaf directory, or (for lowzoom) the root directory
-void PMTiles::appendTileEntry(uint64_t tileId, TileOffset offset, std::vector<pmtiles::entryv3> &rootEntries, std::vector<pmtiles::entryv3> &entries) {
-	pmtiles::entryv3 entry = pmtiles::entryv3(tileId, offset.offset, offset.length, 1); // 1=RLE
-	if (tileId<FIRST_LEAF_TILE) {
-		// <z6 so root directory
-		appendWithRLE(rootEntries, entry);
+std::string PMTiles::spillFilename(unsigned int zoom) const {
+	return outputFilename + "." + std::to_string(zoom) + ".tiles";
+}
+
+void PMTiles::removeSpillFiles() {
+	for (size_t zoom = 0; zoom < spillStreams.size(); zoom++) {
+		if (!spillStreams[zoom]) continue;
+		spillStreams[zoom]->close();
+		std::remove(spillFilename(zoom).c_str());
+	}
+	spillStreams.clear();
+}
+
+// Copy tiles from the spill files into the .pmtiles in tile ID order, so that
+// the archive is clustered, and point the index at their new offsets.
+// A repeated tile is copied where it first occurs.
+//
+// At each zoom from z6, a z6 tile's descendants have one contiguous range of
+// tile IDs, so going through the index in order, each spill segment is needed
+// once: it's read in one go and its tiles copied from memory. The exceptions
+// are segments over SPILL_READ_SIZE, and repeated tiles first written in a
+// segment that comes later, which are read a tile at a time.
+void PMTiles::clusterTiles() {
+	std::vector<std::ifstream> inputs(spillStreams.size());
+	for (size_t zoom = 0; zoom < spillStreams.size(); zoom++) {
+		if (!spillStreams[zoom]) continue;
+		spillStreams[zoom]->close();
+		if (!*spillStreams[zoom]) throw std::runtime_error("Couldn't write " + spillFilename(zoom));
+		inputs[zoom].open(spillFilename(zoom), std::ios::in | std::ios::binary);
+		if (!inputs[zoom]) throw std::runtime_error("Couldn't open " + spillFilename(zoom));
+		std::stable_sort(spillSegments[zoom].begin(), spillSegments[zoom].end(), [](const SpillSegment &a, const SpillSegment &b) {
+			return a.cluster < b.cluster;
+		});
+	}
+
+	const uint64_t unwritten = UINT64_MAX;
+	std::vector<uint64_t> clusteredOffsets(spillOffsets.size(), unwritten);
+	uint64_t position = 0;
+
+	// The segments read for the current zoom and cluster, and where each
+	// starts in `buffer`
+	unsigned int loadedZoom = 0;
+	uint64_t loadedCluster = unwritten;
+	std::vector<std::pair<SpillSegment, size_t>> loaded;
+	std::string buffer, tileBuffer;
+	auto load = [&](unsigned int zoom, uint64_t cluster) {
+		loadedZoom = zoom;
+		loadedCluster = cluster;
+		loaded.clear();
+		buffer.clear();
+		if (zoom >= spillSegments.size()) return;
+		const SpillSegment key = { cluster, 0, 0 };
+		auto range = std::equal_range(spillSegments[zoom].begin(), spillSegments[zoom].end(), key, [](const SpillSegment &a, const SpillSegment &b) {
+			return a.cluster < b.cluster;
+		});
+		uint64_t size = 0;
+		for (auto it = range.first; it != range.second; it++) size += it->end - it->begin;
+		if (size > SPILL_READ_SIZE) return;
+		for (auto it = range.first; it != range.second; it++) {
+			loaded.emplace_back(*it, buffer.size());
+			buffer.resize(buffer.size() + (it->end - it->begin));
+			inputs[zoom].seekg(it->begin);
+			inputs[zoom].read(&buffer[loaded.back().second], it->end - it->begin);
+		}
+	};
+
+	auto relocate = [&](uint64_t tileId, TileOffset &tile) {
+		const uint64_t i = tile.offset;
+		if (clusteredOffsets[i] == unwritten) {
+			const unsigned int zoom = tileIdZoom(tileId);
+			const uint64_t cluster = spillCluster(zoom, tileId);
+			if (zoom != loadedZoom || cluster != loadedCluster) load(zoom, cluster);
+
+			const char *data = nullptr;
+			if (spillZooms[i] == zoom) {
+				for (auto &segment : loaded) {
+					if (spillOffsets[i] >= segment.first.begin && spillOffsets[i] < segment.first.end)
+						data = &buffer[segment.second + spillOffsets[i] - segment.first.begin];
+				}
+			}
+			if (!data) {
+				tileBuffer.resize(tile.length);
+				inputs[spillZooms[i]].seekg(spillOffsets[i]);
+				inputs[spillZooms[i]].read(&tileBuffer[0], tile.length);
+				data = tileBuffer.data();
+			}
+			outputStream.write(data, tile.length);
+			clusteredOffsets[i] = position;
+			position += tile.length;
+		}
+		tile.offset = clusteredOffsets[i];
+	};
+
+	if (isSparse) {
+		for (auto &it : sparseIndex) relocate(it.first, it.second);
 	} else {
-		appendWithRLE(entries, entry);
-		if (entries.size()>=LEAF_DIRECTORY_SIZE) flushEntries(rootEntries, entries);
+		for (uint64_t tileId = 0; tileId < denseIndex.size(); tileId++) {
+			if (denseIndex[tileId].length != 0xffffff) relocate(tileId, denseIndex[tileId]);
+		}
 	}
+
+	for (size_t zoom = 0; zoom < inputs.size(); zoom++) {
+		if (inputs[zoom].is_open() && !inputs[zoom]) throw std::runtime_error("Couldn't read " + spillFilename(zoom));
+		inputs[zoom].close();
+	}
+	removeSpillFiles();
+	std::vector<std::vector<SpillSegment>>().swap(spillSegments);
+	std::vector<uint64_t>().swap(spillOffsets);
+	std::vector<uint8_t>().swap(spillZooms);
 }
 
-// Handle run-length encoding for appendTileEntry
-void PMTiles::appendWithRLE(std::vector<pmtiles::entryv3> &entries, pmtiles::entryv3 &entry) {
-	if (entries.empty() ||
-		entries.back().offset != entry.offset ||
-		entries.back().tile_id != (entry.tile_id-entries.back().run_length)) { 
-			entries.emplace_back(entry); 
-			numTileEntries++;
-			return;
+// Whether `entry` carries on the run that `last` ends
+static bool continuesRun(const pmtiles::entryv3 &last, const pmtiles::entryv3 &entry) {
+	return last.offset == entry.offset && last.tile_id == entry.tile_id - last.run_length;
+}
+
+// Handle run-length encoding for rangeEntries
+static void appendWithRLE(std::vector<pmtiles::entryv3> &entries, const pmtiles::entryv3 &entry) {
+	if (entries.empty() || !continuesRun(entries.back(), entry)) {
+		entries.emplace_back(entry);
+		return;
 	}
-	entries.back().run_length++;
+	entries.back().run_length += entry.run_length;
 }
 
-// Write a leaf directory to file, and add a reference to it to the root directory
-void PMTiles::flushEntries(std::vector<pmtiles::entryv3> &rootEntries, std::vector<pmtiles::entryv3> &entries) {
-	if (entries.size()==0) return;
-	uint64_t startId = entries[0].tile_id;
-	std::string directory = pmtiles::serialize_directory(entries);
-	std::string compressed = compress_string(directory, Z_DEFAULT_COMPRESSION, true);
-	entries.clear();
+// Run-length encoded entries for tile IDs [begin, end) of the index
+std::vector<pmtiles::entryv3> PMTiles::rangeEntries(uint64_t begin, uint64_t end) const {
+	std::vector<pmtiles::entryv3> entries;
+	if (isSparse) {
+		for (auto it = sparseIndex.lower_bound(begin); it != sparseIndex.end() && it->first < end; it++)
+			appendWithRLE(entries, pmtiles::entryv3(it->first, it->second.offset, it->second.length, 1)); // 1=RLE
+		return entries;
+	}
+	end = std::min<uint64_t>(end, denseIndex.size());
+	for (uint64_t tileId=begin; tileId<end; tileId++) {
+		const TileOffset &offset = denseIndex[tileId];
+		if (offset.length != 0xffffff) appendWithRLE(entries, pmtiles::entryv3(tileId, offset.offset, offset.length, 1));
+	}
+	return entries;
+}
 
-	// write the leaf directory to disk
-	std::lock_guard<std::mutex> lock(fileMutex);
-	uint64_t location = outputStream.tellp();
-	uint64_t length = compressed.size();
-	outputStream.write(compressed.c_str(), compressed.size());
+// Add every tile to the directories: <z6 in the root directory, the rest in
+// a leaf directory per leafTileIds tile IDs, unless there are only a few.
+//
+// Leaves are built a window of threadNum at a time, so that only a window's
+// entries are held at once. Each leaf's range is encoded on its own thread,
+// and a run that carries on over the join goes in the leaf it started in.
+// The last leaf so far is held back until the next window, as its last run
+// may carry on into it; the others are compressed in parallel and written.
+void PMTiles::writeDirectories(std::vector<pmtiles::entryv3> &rootEntries) {
+	rootEntries = rangeEntries(0, FIRST_LEAF_TILE);
+	numTileEntries = rootEntries.size();
+	leafStart = outputStream.tellp();
+
+	const uint64_t end = isSparse ? (sparseIndex.empty() ? 0 : sparseIndex.rbegin()->first + 1) : denseIndex.size();
+	const uint64_t leafSize = std::max<uint64_t>(1, leafTileIds);
+	const size_t windowSize = std::max(1u, threadNum);
+	std::vector<pmtiles::entryv3> last;
+	std::vector<std::vector<pmtiles::entryv3>> leaves;	// to write, or if still under ROOT_ONLY entries, to hold
+	for (uint64_t windowStart = FIRST_LEAF_TILE; windowStart < end; windowStart += windowSize * leafSize) {
+		std::vector<std::vector<pmtiles::entryv3>> window(windowSize);
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < windowSize; i++) {
+			const uint64_t begin = windowStart + i * leafSize;
+			if (begin >= end) break;
+			threads.emplace_back([this, &window, i, begin, leafSize, end]() {
+				window[i] = rangeEntries(begin, std::min(end, begin + leafSize));
+			});
+		}
+		for (auto &thread : threads) thread.join();
+
+		for (auto &leaf : window) {
+			numTileEntries += leaf.size();
+			if (!leaf.empty() && !last.empty() && continuesRun(last.back(), leaf.front())) {
+				last.back().run_length += leaf.front().run_length;
+				leaf.erase(leaf.begin());
+				numTileEntries--;
+			}
+			if (leaf.empty()) continue;
+			if (!last.empty()) leaves.emplace_back(std::move(last));
+			last = std::move(leaf);
+		}
+		if (numTileEntries >= ROOT_ONLY) {
+			writeLeafDirectories(rootEntries, leaves);
+			leaves.clear();
+		}
+	}
 
-	// append reference to the root directory
-	pmtiles::entryv3 rootEntry = pmtiles::entryv3(startId, location-leafStart, length, 0);
-	rootEntries.emplace_back(rootEntry);
+	if (!last.empty()) leaves.emplace_back(std::move(last));
+	if (numTileEntries < ROOT_ONLY) {
+		for (auto &leaf : leaves) rootEntries.insert(rootEntries.end(), leaf.begin(), leaf.end());
+	} else {
+		writeLeafDirectories(rootEntries, leaves);
+	}
+}
+
+// Compress metadata or a directory the same way as the tiles
+std::string PMTiles::compress(const std::string &data, int level) const {
+	return zstd ? compress_zstd(data, level) : compress_string(data, level, true);
+}
+
+// Write leaf directories, adding a reference to each to the root directory.
+// They're serialized and compressed in parallel, then written in order.
+void PMTiles::writeLeafDirectories(std::vector<pmtiles::entryv3> &rootEntries, const std::vector<std::vector<pmtiles::entryv3>> &leaves) {
+	std::vector<std::string> compressed(leaves.size());
+	std::vector<std::thread> threads;
+	for (size_t i = 0; i < leaves.size(); i++) {
+		threads.emplace_back([this, &leaves, &compressed, i]() {
+			compressed[i] = compress(pmtiles::serialize_directory(leaves[i]), compressionLevel);
+		});
+	}
+	for (auto &thread : threads) thread.join();
+
+	// write the leaf directories to disk, and add references to the root directory
+	std::lock_guard<std::mutex> lock(fileMutex);
+	for (size_t i = 0; i < leaves.size(); i++) {
+		uint64_t location = outputStream.tellp();
+		outputStream.write(compressed[i].c_str(), compressed[i].size());
+		rootEntries.emplace_back(pmtiles::entryv3(leaves[i].front().tile_id, location-leafStart, compressed[i].size(), 0));
+	}
 }
 
 // Write a tile to file and store it in the index
-// - if the tile is small and has already been written, reuse that instead
-// - we're a bit fussy about mutexs because compress_string is expensive
-void PMTiles::saveTile(int zoom, int x, int y, std::string &data) {
+// - if a tile with the same content has already been written, reuse that instead
+// - `compressed` is the gzipped tile and `hash` its ContentHash, which callers
+//   work out first as they're expensive
+void PMTiles::saveTile(int zoom, int x, int y, const std::string &compressed, const ContentHash &hash) {
 	TileOffset offset;
 	bool isNew = false;
 	uint64_t tileId = pmtiles::zxy_to_tileid(zoom,x,y);
 
-	// if it's a tiny tile (e.g. sea), see if we've written it already
+	// see if we've written it already
 	std::unique_lock<std::mutex> indexLock1(indexMutex);
-	if (data.size()<TINY_LENGTH && tinyCache.find(data) != tinyCache.end()) {
-		offset = tinyCache[data];
+	if (findWrittenTile(hash, compressed.size(), offset)) {
+		numTilesDeduplicated++;
+		bytesDeduplicated += compressed.size();
 		indexLock1.unlock();
 
-	// otherwise, compress it and write
+	// otherwise, write it
 	} else {
 		indexLock1.unlock();
-		std::string compressed = compress_string(data, Z_DEFAULT_COMPRESSION, true);
 		std::lock_guard<std::mutex> lock(fileMutex);
 		// write to file
-		offset = TileOffset(static_cast<uint64_t>(outputStream.tellp()) - HEADER_ROOT, compressed.size());
-		outputStream.write(compressed.c_str(), compressed.size());
+		if (isClustered) {
+			if (spillStreams.size() <= static_cast<size_t>(zoom)) {
+				spillStreams.resize(zoom+1);
+				spillSegments.resize(zoom+1);
+			}
+			if (!spillStreams[zoom]) {
+				spillStreams[zoom].reset(new std::ofstream(spillFilename(zoom), std::ios::out | std::ios::trunc | std::ios::binary));
+				if (!*spillStreams[zoom]) throw std::runtime_error("Couldn't open " + spillFilename(zoom));
+			}
+			std::ofstream &spillStream = *spillStreams[zoom];
+			const uint64_t position = spillStream.tellp();
+			const uint64_t cluster = spillCluster(zoom, tileId);
+			std::vector<SpillSegment> &segments = spillSegments[zoom];
+			if (segments.empty() || segments.back().cluster != cluster) segments.push_back({ cluster, position, position });
+			spillStream.write(compressed.c_str(), compressed.size());
+			segments.back().end = position + compressed.size();
+			offset = TileOffset(spillOffsets.size(), compressed.size());
+			spillOffsets.push_back(position);
+			spillZooms.push_back(zoom);
+		} else {
+			offset = TileOffset(static_cast<uint64_t>(outputStream.tellp()) - HEADER_ROOT, compressed.size());
+			outputStream.write(compressed.c_str(), compressed.size());
+		}
 		numTilesWritten++;
 		isNew = true;
 	}
@@ -165,9 +384,27 @@ void PMTiles::saveTile(int zoom, int x, int y, std::string &data) {
 		denseIndex[tileId] = offset;
 	}
 
-	// add to cache if tiny
-	if (isNew && data.size()<TINY_LENGTH) {
-		if (tinyCache.size()>TINY_MAX_SIZE) tinyCache.clear();
-		tinyCache.insert({ data, offset });
+	// remember it in case it turns up again
+	if (isNew) {
+		if (candidateTiles.size()>=DEDUP_CANDIDATES) candidateTiles.clear();
+		candidateTiles.insert({ hash, offset });
 	}
 }
+
+// Look up a tile we've already written, promoting it to repeatedTiles if
+// this is the second time we've seen it (indexMutex must be held)
+bool PMTiles::findWrittenTile(const ContentHash &hash, size_t length, TileOffset &offset) {
+	auto it = repeatedTiles.find(hash);
+	if (it != repeatedTiles.end()) {
+		offset = it->second;
+		return offset.length == length;
+	}
+
+	it = candidateTiles.find(hash);
+	if (it == candidateTiles.end()) return false;
+	offset = it->second;
+	candidateTiles.erase(it);
+	if (repeatedTiles.size()>=DEDUP_REPEATED) repeatedTiles.clear();
+	repeatedTiles.insert({ hash, offset });
+	return offset.length == length;
+}
@@ -0,0 +1,229 @@
+#include "prepared_geometry.h"
+#include "coordinates.h"
+#include <unordered_set>
+
+using namespace std;
+namespace geom = boost::geometry;
+
+void PreparedMultiPolygon::buildIndex() {
+	geom::assign_inverse(envelope);
+	vector<EdgeValue> values;
+	values.reserve(edges.size());
+	for (uint32_t i = 0; i < edges.size(); i++) {
+		Box box;
+		geom::envelope(edges[i], box);
+		geom::expand(envelope, box);
+		values.emplace_back(box, i);
+	}
+	edgeTree = EdgeTree(values.begin(), values.end()); // packing constructor
+}
+
+// Even-odd ray cast towards +x, looking only at the edges that the ray meets
+PreparedMultiPolygon::Location PreparedMultiPolygon::locate(const Point& p) const {
+	if (!geom::covered_by(p, envelope)) return Location::Exterior;
+
+	const double px = p.x(), py = p.y();
+	Box ray(p, Point(envelope.max_corner().x(), py));
+	bool inside = false;
+	for (auto it = edgeTree.qbegin(geom::index::intersects(ray)); it != edgeTree.qend(); ++it) {
+		const Segment& edge = edges[it->second];
+		const double ax = edge.first.x(), ay = edge.first.y();
+		const double bx = edge.second.x(), by = edge.second.y();
+
+		if (geom::covered_by(p, it->first) && (bx - ax) * (py - ay) == (by - ay) * (px - ax))
+			return Location::Boundary;
+
+		if ((ay > py) != (by > py)) {
+			double x = ax + (py - ay) * (bx - ax) / (by - ay);
+			if (x > px) inside = !inside;
+		}
+	}
+	return inside ? Location::Interior : Location::Exterior;
+}
+
+// State of the grid cell containing box, or Boundary if box isn't within one cell
+PreparedMultiPolygon::CellState PreparedMultiPolygon::cellState(const Box& box) const {
+	if (!geom::intersects(box, envelope)) return CellState::Outside;
+
+	uint32_t x = lon2tilex(box.min_corner().x(), cellZoom);
+	uint32_t y = latp2tiley(box.max_corner().y(), cellZoom);
+	if (x != lon2tilex(box.max_corner().x(), cellZoom) || y != latp2tiley(box.min_corner().y(), cellZoom))
+		return CellState::Boundary;
+
+	Box cell(
+		Point(tilex2lon(x, cellZoom), tiley2latp(y + 1, cellZoom)),
+		Point(tilex2lon(x + 1, cellZoom), tiley2latp(y, cellZoom))
+	);
+	if (!geom::covered_by(box, cell)) return CellState::Boundary;
+	if (!geom::intersects(cell, envelope)) return CellState::Outside;
+
+	const uint64_t key = (static_cast<uint64_t>(x) << 32) | y;
+	CellCache& cache = cellCaches[(x * 31 + y) % CELL_CACHE_SHARDS];
+	{
+		lock_guard<mutex> lock(cache.mutex);
+		auto it = cache.states.find(key);
+		if (it != cache.states.end()) return it->second;
+	}
+
+	CellState state = CellState::Outside;
+	for (auto it = edgeTree.qbegin(geom::index::intersects(cell)); it != edgeTree.qend(); ++it) {
+		if (geom::intersects(edges[it->second], cell)) { state = CellState::Boundary; break; }
+	}
+	if (state != CellState::Boundary) {
+		// No edges in the cell, so it's all on one side
+		Point centre;
+		geom::centroid(cell, centre);
+		if (locate(centre) == Location::Interior) state = CellState::Inside;
+	}
+
+	lock_guard<mutex> lock(cache.mutex);
+	if (cache.states.size() >= CELL_CACHE_SHARD_SIZE) cache.states.clear();
+	cache.states[key] = state;
+	return state;
+}
+
+// Does the segment touch or cross any edge?
+bool PreparedMultiPolygon::crossesBoundary(const Segment& segment) const {
+	Box box;
+	geom::envelope(segment, box);
+	for (auto it = edgeTree.qbegin(geom::index::intersects(box)); it != edgeTree.qend(); ++it) {
+		if (geom::intersects(segment, edges[it->second])) return true;
+	}
+	return false;
+}
+
+template<class RangeT>
+bool PreparedMultiPolygon::crossesBoundary(const RangeT& points) const {
+	for (size_t i = 1; i < points.size(); i++) {
+		if (crossesBoundary(Segment(points[i-1], points[i]))) return true;
+	}
+	return false;
+}
+
+// Does any ring of the multipolygon lie inside this polygon? Only meaningful
+// when no boundaries cross, so checking one vertex per ring is enough.
+bool PreparedMultiPolygon::containsRingOf(const Polygon& polygon) const {
+	Box box;
+	geom::envelope(polygon, box);
+	unordered_set<uint32_t> seen;
+	for (auto it = edgeTree.qbegin(geom::index::intersects(box)); it != edgeTree.qend(); ++it) {
+		if (!seen.insert(edgeRings[it->second]).second) continue;
+		if (geom::covered_by(edges[it->second].first, polygon)) return true;
+	}
+	return false;
+}
+
+// ----	Intersects
+
+bool PreparedMultiPolygon::intersects(const Point& p) const {
+	switch (cellState(Box(p, p))) {
+		case CellState::Inside: return true;
+		case CellState::Outside: return false;
+		default: return locate(p) != Location::Exterior;
+	}
+}
+
+bool PreparedMultiPolygon::intersects(const Linestring& ls) const {
+	if (ls.empty()) return false;
+	Box box;
+	geom::envelope(ls, box);
+	switch (cellState(box)) {
+		case CellState::Inside: return true;
+		case CellState::Outside: return false;
+		default: break;
+	}
+	// If no segment meets the boundary, the whole line is on one side of it
+	return crossesBoundary(ls) || locate(ls.front()) != Location::Exterior;
+}
+
+bool PreparedMultiPolygon::intersects(const MultiLinestring& mls) const {
+	for (const auto& ls : mls)
+		if (intersects(ls)) return true;
+	return false;
+}
+
+bool PreparedMultiPolygon::intersects(const Polygon& polygon) const {
+	if (polygon.outer().empty()) return false;
+	Box box;
+	geom::envelope(polygon, box);
+	switch (cellState(box)) {
+		case CellState::Inside: return true;
+		case CellState::Outside: return false;
+		default: break;
+	}
+	if (crossesBoundary(polygon.outer())) return true;
+	for (const auto& inner : polygon.inners())
+		if (crossesBoundary(inner)) return true;
+	// No boundaries cross, so either the polygon is inside the multipolygon,
+	// part of the multipolygon is inside the polygon, or they're disjoint
+	return locate(polygon.outer().front()) != Location::Exterior || containsRingOf(polygon);
+}
+
+bool PreparedMultiPolygon::intersects(const MultiPolygon& mp) const {
+	for (const auto& polygon : mp)
+		if (intersects(polygon)) return true;
+	return false;
+}
+
+bool PreparedMultiPolygon::intersects(const Box& box) const {
+	Polygon polygon;
+	geom::convert(box, polygon);
+	return intersects(polygon);
+}
+
+// ----	CoveredBy
+
+bool PreparedMultiPolygon::coveredBy(const Point& p, bool& certain) const {
+	certain = true;
+	return intersects(p);
+}
+
+bool PreparedMultiPolygon::coveredBy(const Linestring& ls, bool& certain) const {
+	certain = true;
+	if (ls.empty()) { certain = false; return false; }
+	Box box;
+	geom::envelope(ls, box);
+	if (!geom::covered_by(box, envelope)) return false;
+	switch (cellState(box)) {
+		case CellState::Inside: return true;
+		case CellState::Outside: return false;
+		default: break;
+	}
+	if (crossesBoundary(ls)) { certain = false; return false; }
+	return locate(ls.front()) != Location::Exterior;
+}
+
+bool PreparedMultiPolygon::coveredBy(const MultiLinestring& mls, bool& certain) const {
+	certain = true;
+	if (mls.empty()) { certain = false; return false; }
+	for (const auto& ls : mls)
+		if (!coveredBy(ls, certain)) return false;
+	return true;
+}
+
+bool PreparedMultiPolygon::coveredBy(const Polygon& polygon, bool& certain) const {
+	certain = true;
+	if (polygon.outer().empty()) { certain = false; return false; }
+	Box box;
+	geom::envelope(polygon, box);
+	if (!geom::covered_by(box, envelope)) return false;
+	switch (cellState(box)) {
+		case CellState::Inside: return true;
+		case CellState::Outside: return false;
+		default: break;
+	}
+	bool crosses = crossesBoundary(polygon.outer());
+	for (const auto& inner : polygon.inners())
+		crosses = crosses || crossesBoundary(inner);
+	if (crosses) { certain = false; return false; }
+	// Covered if it's inside, and no hole (or other ring) falls within it
+	return locate(polygon.outer().front()) != Location::Exterior && !containsRingOf(polygon);
+}
+
+bool PreparedMultiPolygon::coveredBy(const MultiPolygon& mp, bool& certain) const {
+	certain = true;
+	if (mp.empty()) { certain = false; return false; }
+	for (const auto& polygon : mp)
+		if (!coveredBy(polygon, certain)) return false;
+	return true;
+}
@@ -1,4 +1,7 @@
 #include "shared_data.h"
+#include <fstream>
+#include <sstream>
+#include "helpers.h"
 #include "rapidjson/document.h"
 #include "rapidjson/writer.h"
 #include "rapidjson/stringbuffer.h"
@@ -12,10 +15,44 @@ SharedData::SharedData(Config &configIn, const class LayerDefinition &layers)
 	: layers(layers), config(configIn) {
 	outputMode=OptionsParser::OutputMode::File;
 	mergeSqlite=false;
+	layerPool=nullptr;
+	threadNum=1;
 }
 
 SharedData::~SharedData() { }
 
+void SharedData::compressTile(RenderedTile& tile) const {
+	// .pmtiles are gzipped unless zstd is asked for
+	if (config.zstd)
+		tile.output = compress_zstd(tile.data, config.compressLevel(tile.zoom));
+	else if (outputMode == OptionsParser::OutputMode::PMTiles)
+		tile.output = compress_string(tile.data, config.compressLevel(tile.zoom), true);
+	else if (config.compress)
+		tile.output = compress_string(tile.data, config.compressLevel(tile.zoom), config.gzip);
+	else
+		tile.output = tile.data;
+
+	// Hashing here keeps it off the writer thread
+	if (outputMode == OptionsParser::OutputMode::PMTiles ||
+		(outputMode == OptionsParser::OutputMode::MBTiles && mbtiles.isDeduplicated()))
+		tile.hash = contentHash(tile.output);
+}
+
+void SharedData::writeTile(RenderedTile& tile) {
+	if (outputMode == OptionsParser::OutputMode::MBTiles) {
+		// Write to sqlite
+		mbtiles.saveTile(tile.zoom, tile.index.x, tile.index.y, std::move(tile.output), mergeSqlite, tile.hash);
+
+	} else if (outputMode == OptionsParser::OutputMode::PMTiles) {
+		// Write to pmtiles
+		pmtiles.saveTile(tile.zoom, tile.index.x, tile.index.y, tile.output, tile.hash);
+
+	} else {
+		// Write to file, on directoryWriter's threads
+		directoryWriter->write(tile.zoom, tile.index, std::move(tile.output));
+	}
+}
+
 // Write project data to .mbtiles file
 void SharedData::writeMBTilesProjectData() {
 	mbtiles.writeMetadata("name", config.projectName);
@@ -69,7 +106,7 @@ void SharedData::writeMBTilesMetadata(rapidjson::Document const &jsonConfig) {
 
 void SharedData::writeFileMetadata(rapidjson::Document const &jsonConfig) {
 	if(config.compress) 
-		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: gzip' in your webserver configuration for serving pbf files"  << std::endl;
+		std::cout << "When serving compressed tiles, make sure to include 'Content-Encoding: " << (config.zstd ? "zstd" : "gzip") << "' in your webserver configuration for serving pbf files"  << std::endl;
 
 	rapidjson::Document document;
 	document.SetObject();
@@ -226,7 +263,7 @@ std::string LayerDefinition::serialiseToJSON() const {
 // *****************************************************************
 
 Config::Config() {
-	includeID = false, compress = true, gzip = true, highResolution = false;
+	includeID = false, compress = true, gzip = true, zstd = false, highResolution = false;
 	clippingBoxFromJSON = false;
 	baseZoom = 0;
 	combineBelow = 0;
@@ -243,6 +280,13 @@ void Config::enlargeBbox(double cMinLon, double cMaxLon, double cMinLat, double
 	maxLat = std::max(maxLat, cMaxLat);
 }
 
+// ----	Compression level for tiles at a given zoom
+
+int Config::compressLevel(uint zoom) const {
+	if (compressLevels.empty()) return Z_DEFAULT_COMPRESSION;
+	return compressLevels[std::min<size_t>(zoom, compressLevels.size() - 1)];
+}
+
 // ----	Read all config details from JSON file
 
 void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, Box &clippingBox)  {
@@ -252,7 +296,7 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	includeID      = jsonConfig["settings"]["include_ids"].GetBool();
 	highResolution = jsonConfig["settings"].HasMember("high_resolution") && jsonConfig["settings"]["high_resolution"].GetBool();
 	if (! jsonConfig["settings"]["compress"].IsString()) {
-		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
+		cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"zstd\",\"none\" in JSON file." << endl;
 		exit (EXIT_FAILURE);
 	}
 	if (endZoom>15) {
@@ -264,6 +308,15 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	}
 
 	compressOpt    = jsonConfig["settings"]["compress"].GetString();
+	if (jsonConfig["settings"].HasMember("compress_level")) {
+		const rapidjson::Value& levels = jsonConfig["settings"]["compress_level"];
+		if (levels.IsArray()) {
+			for (rapidjson::SizeType i = 0; i < levels.Size(); i++)
+				compressLevels.push_back(levels[i].IsInt() ? levels[i].GetInt() : -1);
+		} else {
+			compressLevels.push_back(levels.IsInt() ? levels.GetInt() : -1);
+		}
+	}
 	combineBelow   = jsonConfig["settings"].HasMember("combine_below") ? jsonConfig["settings"]["combine_below"].GetUint() : 0;
 	mvtVersion     = jsonConfig["settings"].HasMember("mvt_version") ? jsonConfig["settings"]["mvt_version"].GetUint() : 2;
 	projectName    = jsonConfig["settings"]["name"].GetString();
@@ -295,9 +348,24 @@ void Config::readConfig(rapidjson::Document &jsonConfig, bool &hasClippingBox, B
 	if (! compressOpt.empty()) {
 		if      (compressOpt == "gzip"   ) { gzip = true;  }
 		else if (compressOpt == "deflate") { gzip = false; }
+		else if (compressOpt == "zstd"   ) {
+#ifdef TM_ZSTD
+			zstd = true;
+#else
+			cerr << "\"compress\": \"zstd\" needs tilemaker to be built with zstd installed." << endl;
+			exit (EXIT_FAILURE);
+#endif
+		}
 		else if (compressOpt == "none"   ) { compress = false; }
 		else {
-			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"none\" in JSON file." << endl;
+			cerr << "\"compress\" should be any of \"gzip\",\"deflate\",\"zstd\",\"none\" in JSON file." << endl;
+			exit (EXIT_FAILURE);
+		}
+	}
+	int maxLevel = zstd ? 22 : 12;
+	for (int level : compressLevels) {
+		if (level < 1 || level > maxLevel) {
+			cerr << "\"compress_level\" should be a number from 1 to " << maxLevel << ", or an array of them by zoom level, in JSON file." << endl;
 			exit (EXIT_FAILURE);
 		}
 	}
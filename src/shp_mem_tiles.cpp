@@ -7,11 +7,24 @@ using namespace std;
 namespace geom = boost::geometry;
 extern bool verbose;
 
+// Bounds on the caches used by AreaIntersecting
+#define AREA_CACHE_SHARDS_PER_THREAD 16
+#define AREA_CACHE_POINTS_PER_SHARD (1 << 16)
+// Most cells that one AreaIntersecting query will look at
+#define AREA_MAX_CELLS 16
+
 ShpMemTiles::ShpMemTiles(size_t threadNum, uint indexZoom)
 	: TileDataSource(threadNum, indexZoom, false),
+	cellUnions(threadNum * AREA_CACHE_SHARDS_PER_THREAD, AREA_CACHE_POINTS_PER_SHARD),
+	largePolygonClips(threadNum * AREA_CACHE_SHARDS_PER_THREAD, AREA_CACHE_POINTS_PER_SHARD),
 	spatialIndexZoom(15)
 { }
 
+ShpMemTiles::~ShpMemTiles() {
+	for (auto& prepared : preparedGeometries)
+		delete prepared.load();
+}
+
 // Look for shapefile objects that fulfil a spatial query (e.g. intersects)
 // Parameters:
 // - shapefile layer name to search
@@ -23,7 +36,7 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(
 	bool once,
 	Box& box,
 	function<vector<IndexValue>(const RTree &rtree)> indexQuery,
-	function<bool(const OutputObject& oo)> checkQuery
+	function<bool(uint id, const OutputObject& oo)> checkQuery
 ) const {
 	
 	// Find the layer
@@ -40,7 +53,7 @@ vector<uint> ShpMemTiles::QueryMatchingGeometries(
 	vector<uint> ids;
 	for (auto it: results) {
 		uint id = it.second;
-		if (checkQuery(indexedGeometries.at(id))) { ids.push_back(id); if (once) break; }
+		if (checkQuery(id, indexedGeometries.at(id))) { ids.push_back(id); if (once) break; }
 	}
 	return ids;
 }
@@ -55,13 +68,131 @@ vector<string> ShpMemTiles::namesOfGeometries(const vector<uint>& ids) const {
 	return names;
 }
 
+const PreparedMultiPolygon* ShpMemTiles::preparedGeometry(uint id) const {
+	if (!isLargePolygon[id]) return nullptr;
+	PreparedMultiPolygon* prepared = preparedGeometries[id].load();
+	if (prepared) return prepared;
+
+	// Several threads may race to build it; the first to finish wins
+	PreparedMultiPolygon* built = new PreparedMultiPolygon(retrieveMultiPolygon(indexedGeometries[id].objectID), spatialIndexZoom);
+	if (preparedGeometries[id].compare_exchange_strong(prepared, built))
+		return built;
+	delete built;
+	return prepared;
+}
+
+// ----	Cached unions for AreaIntersecting
+
+static Box cellBox(uint zoom, TileCoordinates index) {
+	return Box(
+		Point(tilex2lon(index.x, zoom), tiley2latp(index.y + 1, zoom)),
+		Point(tilex2lon(index.x + 1, zoom), tiley2latp(index.y, zoom))
+	);
+}
+
+// Clip to a box with fast_clip, falling back to boost if that leaves the
+// multipolygon invalid
+static MultiPolygon clipToBox(const MultiPolygon& source, const Box& box) {
+	MultiPolygon clipped = source;
+	fast_clip(clipped, box);
+	geom::correct(clipped);
+	if (!geom::is_valid(clipped)) {
+		clipped.clear();
+		geom::intersection(source, box, clipped);
+		geom::correct(clipped);
+	}
+	return clipped;
+}
+
+vector<shared_ptr<const MultiPolygon>> ShpMemTiles::cellUnionsIntersecting(const string& layerName, const Box& box) const {
+	vector<shared_ptr<const MultiPolygon>> unions;
+	auto f = indices.find(layerName);
+	if (f==indices.end()) {
+		if (verbose) cerr << "Couldn't find indexed layer " << layerName << endl;
+		return unions;
+	}
+	if (!mayIntersect(layerName, box))
+		return unions;
+
+	// Use coarser cells for big geometries, so we don't union lots of tiny ones
+	uint zoom = spatialIndexZoom;
+	uint32_t x1, x2, y1, y2;
+	while (true) {
+		const uint32_t maxTile = (1u << zoom) - 1u;
+		x1 = std::min(maxTile, lon2tilex(box.min_corner().x(), zoom));
+		x2 = std::min(maxTile, lon2tilex(box.max_corner().x(), zoom));
+		y1 = std::min(maxTile, latp2tiley(box.max_corner().y(), zoom));
+		y2 = std::min(maxTile, latp2tiley(box.min_corner().y(), zoom));
+		if (zoom == 0 || uint64_t(x2 - x1 + 1) * (y2 - y1 + 1) <= AREA_MAX_CELLS) break;
+		zoom--;
+	}
+
+	for (uint32_t x = x1; x <= x2; x++) {
+		for (uint32_t y = y1; y <= y2; y++) {
+			shared_ptr<const MultiPolygon> cellUnionPtr = cellUnion(f->second, zoom, TileCoordinates(x, y));
+			if (!cellUnionPtr->empty()) unions.push_back(cellUnionPtr);
+		}
+	}
+	return unions;
+}
+
+shared_ptr<const MultiPolygon> ShpMemTiles::cellUnion(const RTree& rtree, uint zoom, TileCoordinates index) const {
+	// Each layer has its own RTree, whose address identifies the layer
+	CellGeometryCache::Key key(reinterpret_cast<uintptr_t>(&rtree), zoom, index);
+	shared_ptr<const MultiPolygon> cached = cellUnions.get(key);
+	if (cached) return cached;
+
+	Box box = cellBox(zoom, index);
+	vector<IndexValue> results;
+	rtree.query(geom::index::intersects(box), back_inserter(results));
+	vector<MultiPolygon> pieces;
+	for (const auto& it : results) {
+		const OutputObject& oo = indexedGeometries.at(it.second);
+		if (oo.geomType != POLYGON_) continue;
+		shared_ptr<const MultiPolygon> clipped = clippedPolygon(oo.objectID, zoom, index, isLargePolygon[it.second]);
+		if (!clipped->empty()) pieces.push_back(*clipped);
+	}
+
+	auto result = make_shared<MultiPolygon>();
+	if (!pieces.empty()) {
+		union_many(pieces);
+		*result = std::move(pieces.front());
+	}
+	cellUnions.add(key, result);
+	return result;
+}
+
+shared_ptr<const MultiPolygon> ShpMemTiles::clippedPolygon(NodeID objectID, uint zoom, TileCoordinates index, bool large) const {
+	CellGeometryCache::Key key(objectID, zoom, index);
+	if (large) {
+		shared_ptr<const MultiPolygon> cached = largePolygonClips.get(key);
+		if (cached) return cached;
+	}
+
+	MultiPolygon source;
+	if (large && zoom > CLUSTER_ZOOM)
+		source = *clippedPolygon(objectID, zoom - 1, TileCoordinates(index.x / 2, index.y / 2), true);
+	else
+		geom::convert(retrieveMultiPolygon(objectID), source);
+
+	auto clipped = make_shared<const MultiPolygon>(clipToBox(source, cellBox(zoom, index)));
+	if (large) largePolygonClips.add(key, clipped);
+	return clipped;
+}
+
 void ShpMemTiles::CreateNamedLayerIndex(const std::string& layerName) {
 	indices[layerName]=RTree();
 
-	bitIndices[layerName] = std::vector<std::vector<bool>>();
+	bitIndices[layerName] = std::vector<BitIndex>();
 	bitIndices[layerName].resize((1u << CLUSTER_ZOOM) * (1u << CLUSTER_ZOOM));
 }
 
+// Two bits per spatialIndexZoom tile in a z6 tile
+size_t ShpMemTiles::bitIndexWords() const {
+	const size_t divisor = 1u << (spatialIndexZoom - CLUSTER_ZOOM);
+	return 2u * divisor * divisor / 64u;
+}
+
 bool ShpMemTiles::mayIntersect(const std::string& layerName, const Box& box) const {
 	// Check if any tiles in the bitmap might intersect this shape.
 	// If none, downstream code can skip querying the r-tree.
@@ -82,43 +213,48 @@ bool ShpMemTiles::mayIntersect(const std::string& layerName, const Box& box) con
 			uint32_t z6x = x / (1u << (spatialIndexZoom - CLUSTER_ZOOM));
 			uint32_t z6y = y / (1u << (spatialIndexZoom - CLUSTER_ZOOM));
 
-			auto& bitvec = sparseLayerVector[z6x * CLUSTER_ZOOM_WIDTH + z6y];
+			const BitIndex& bitvec = sparseLayerVector[z6x * CLUSTER_ZOOM_WIDTH + z6y];
+			if (!bitvec) continue;
 
 			uint32_t divisor = 1u << (spatialIndexZoom - CLUSTER_ZOOM);
 			uint64_t index = 2u * ((x - z6x * divisor) * divisor + (y - z6y * divisor));
 
-			if (!bitvec.empty() && bitvec[index]) {
-				if (bitvec[index + 1])
-					return true;
-				else {
-					// When we loaded the shapefiles, we did a rough index based on a bounding
-					// box. For large, irregularly shaped polygons like national forests, this
-					// can give false positives.
-					//
-					// We lazily do a more exacting check here, intersecting the index zoom tile.
-					// Afterwards, we eitehr set bitvec[index + 1] or clear bitvec[index].
-					TileBbox bbox(TileCoordinates(x, y), spatialIndexZoom, false, false);
-					std::vector<uint> intersections = QueryMatchingGeometries(
-						layerName,
-						true,
-						bbox.clippingBox,
-						[&](const RTree &rtree) { // indexQuery
-							vector<IndexValue> results;
-							rtree.query(geom::index::intersects(bbox.clippingBox), back_inserter(results));
-							return results;
-						},
-						[&](OutputObject const &oo) { // checkQuery
-							return geom::intersects(bbox.clippingBox, retrieveMultiPolygon(oo.objectID));
-						}
-					);
-
-					if (intersections.empty()) {
-						bitvec[index] = false;
-					} else {
-						bitvec[index + 1] = true;
-						return true;
-					}
+			// index is even, so both of the tile's bits are in the same word.
+			// A stale read only means the tile is refined again, with the same
+			// result, so relaxed ordering is enough.
+			std::atomic<uint64_t>& word = bitvec[index / 64];
+			const uint64_t mayHave = uint64_t(1) << (index % 64);
+			const uint64_t has = mayHave << 1;
+			const uint64_t bits = word.load(std::memory_order_relaxed);
+			if (!(bits & mayHave)) continue;
+			if (bits & has) return true;
+
+			// When we loaded the shapefiles, we did a rough index based on a bounding
+			// box. For large, irregularly shaped polygons like national forests, this
+			// can give false positives.
+			//
+			// We lazily do a more exacting check here, intersecting the index zoom tile.
+			// Afterwards, we either set bit index + 1 or clear bit index.
+			TileBbox bbox(TileCoordinates(x, y), spatialIndexZoom, false, false);
+			std::vector<uint> intersections = QueryMatchingGeometries(
+				layerName,
+				true,
+				bbox.clippingBox,
+				[&](const RTree &rtree) { // indexQuery
+					vector<IndexValue> results;
+					rtree.query(geom::index::intersects(bbox.clippingBox), back_inserter(results));
+					return results;
+				},
+				[&](uint id, OutputObject const &oo) { // checkQuery
+					return indexedIntersects(id, bbox.clippingBox);
 				}
+			);
+
+			if (intersections.empty()) {
+				word.fetch_and(~mayHave, std::memory_order_relaxed);
+			} else {
+				word.fetch_or(has, std::memory_order_relaxed);
+				return true;
 			}
 		}
 	}
@@ -195,6 +331,8 @@ void ShpMemTiles::StoreGeometry(
 	indices.at(layerName).insert(std::make_pair(box, id));
 	if (hasName) { indexedGeometryNames[id] = name; }
 	indexedGeometries.push_back(*oo);
+	isLargePolygon.push_back(geomType == POLYGON_ && geom::num_points(geometry) >= PreparedMultiPolygon::MIN_POINTS);
+	preparedGeometries.emplace_back(nullptr);
 
 	// Store a bitmap of which tiles at the spatialIndexZoom that might intersect
 	// this shape.
@@ -215,14 +353,15 @@ void ShpMemTiles::StoreGeometry(
 			uint32_t z6y = y / (1u << (spatialIndexZoom - CLUSTER_ZOOM));
 
 			uint32_t sparseIndex = z6x * CLUSTER_ZOOM_WIDTH + z6y;
-			auto& bitvec = sparseLayerVector[sparseIndex];
+			BitIndex& bitvec = sparseLayerVector[sparseIndex];
 
-			if (bitvec.empty())
-				bitvec.resize(2u * (1u << (spatialIndexZoom - CLUSTER_ZOOM)) * (1u << (spatialIndexZoom - CLUSTER_ZOOM)));
+			// Value-initialized, so every bit starts clear
+			if (!bitvec)
+				bitvec.reset(new std::atomic<uint64_t>[bitIndexWords()]());
 
 			uint32_t divisor = 1u << (spatialIndexZoom - CLUSTER_ZOOM);
 			uint64_t index = 2u * ((x - z6x * divisor) * divisor + (y - z6y * divisor));
-			bitvec[index] = true;
+			bitvec[index / 64].fetch_or(uint64_t(1) << (index % 64), std::memory_order_relaxed);
 		}
 	}
 }
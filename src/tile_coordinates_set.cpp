@@ -1,17 +1,69 @@
 #include "tile_coordinates_set.h"
+#include "bit_scan.h"
+#include <algorithm>
 #include <string>
 #include <stdexcept>
 
+#define CONTAINER_ZOOM_OFFSET 6
+
 PreciseTileCoordinatesSet::PreciseTileCoordinatesSet(unsigned int zoom):
 	zoom_(zoom),
-	tiles((1 << zoom) * (1 << zoom)) {}
+	containerZoom(zoom < CONTAINER_ZOOM_OFFSET ? zoom : zoom - CONTAINER_ZOOM_OFFSET),
+	count(0),
+	containers(zoom < CONTAINER_ZOOM_OFFSET ? 1 : 1 << (2 * CONTAINER_ZOOM_OFFSET)) {
+	if (zoom > 14)
+		throw std::out_of_range("PreciseTileCoordinatesSet: zoom cannot be higher than 14, but was " + std::to_string(zoom));
+}
+
+bool PreciseTileCoordinatesSet::Container::test(uint16_t offset) const {
+	if (!bits.empty())
+		return (bits[offset / 64] >> (offset % 64)) & 1;
+
+	return std::binary_search(offsets.begin(), offsets.end(), offset);
+}
+
+bool PreciseTileCoordinatesSet::Container::set(uint16_t offset) {
+	if (!bits.empty()) {
+		const uint64_t mask = uint64_t(1) << (offset % 64);
+		if (bits[offset / 64] & mask)
+			return false;
+		bits[offset / 64] |= mask;
+		return true;
+	}
+
+	auto it = std::lower_bound(offsets.begin(), offsets.end(), offset);
+	if (it != offsets.end() && *it == offset)
+		return false;
+	offsets.insert(it, offset);
+	return true;
+}
+
+void PreciseTileCoordinatesSet::Container::forEach(const std::function<void(uint16_t offset)>& fn) const {
+	if (bits.empty()) {
+		for (const uint16_t offset : offsets)
+			fn(offset);
+		return;
+	}
+
+	for (size_t i = 0; i < bits.size(); i++) {
+		uint64_t word = bits[i];
+		while (word != 0) {
+			fn(i * 64 + lowestBit(word));
+			word &= word - 1;
+		}
+	}
+}
 
 bool PreciseTileCoordinatesSet::test(TileCoordinate x, TileCoordinate y) const {
-	uint64_t loc = x * (1 << zoom_) + y;
-	if (loc >= tiles.size())
+	if (x >= (1u << zoom_) || y >= (1u << zoom_))
 		return false;
 
-	return tiles[loc];
+	const Container* container = containers[(x >> containerZoom) * (1 << (zoom_ - containerZoom)) + (y >> containerZoom)].get();
+	if (container == nullptr)
+		return false;
+
+	const TileCoordinate mask = (1 << containerZoom) - 1;
+	return container->test(((x & mask) << containerZoom) | (y & mask));
 }
 
 size_t PreciseTileCoordinatesSet::zoom() const {
@@ -19,19 +71,46 @@ size_t PreciseTileCoordinatesSet::zoom() const {
 }
 
 size_t PreciseTileCoordinatesSet::size() const {
-	size_t rv = 0;
-	for (int i = 0; i < tiles.size(); i++)
-		if (tiles[i])
-			rv++;
-
-	return rv;
+	return count;
 }
 
 void PreciseTileCoordinatesSet::set(TileCoordinate x, TileCoordinate y) {
-	uint64_t loc = x * (1 << zoom_) + y;
-	if (loc >= tiles.size())
+	if (x >= (1u << zoom_) || y >= (1u << zoom_))
 		return;
-	tiles[loc] = true;
+
+	auto& container = containers[(x >> containerZoom) * (1 << (zoom_ - containerZoom)) + (y >> containerZoom)];
+	if (container == nullptr)
+		container.reset(new Container());
+
+	const TileCoordinate mask = (1 << containerZoom) - 1;
+	if (!container->set(((x & mask) << containerZoom) | (y & mask)))
+		return;
+	count++;
+
+	// Switch to a bitmap once that's smaller than the array
+	const size_t capacity = size_t(1) << (2 * containerZoom);
+	if (container->bits.empty() && container->offsets.size() * 16 > capacity) {
+		container->bits.resize((capacity + 63) / 64);
+		for (const uint16_t offset : container->offsets)
+			container->bits[offset / 64] |= uint64_t(1) << (offset % 64);
+		std::vector<uint16_t>().swap(container->offsets);
+	}
+}
+
+void PreciseTileCoordinatesSet::forEach(const std::function<void(TileCoordinate x, TileCoordinate y)>& fn) const {
+	const unsigned int containersWide = 1 << (zoom_ - containerZoom);
+	const TileCoordinate mask = (1 << containerZoom) - 1;
+
+	for (size_t i = 0; i < containers.size(); i++) {
+		if (containers[i] == nullptr)
+			continue;
+
+		const TileCoordinate baseX = (i / containersWide) << containerZoom;
+		const TileCoordinate baseY = (i % containersWide) << containerZoom;
+		containers[i]->forEach([&](uint16_t offset) {
+			fn(baseX + (offset >> containerZoom), baseY + (offset & mask));
+		});
+	}
 }
 
 LossyTileCoordinatesSet::LossyTileCoordinatesSet(unsigned int zoom, const TileCoordinatesSet& underlying) : zoom_(zoom), tiles(underlying), scale(1 << (zoom - underlying.zoom())) {
@@ -55,3 +134,11 @@ void LossyTileCoordinatesSet::set(TileCoordinate x, TileCoordinate y) {
 	throw std::logic_error("LossyTileCoordinatesSet::set() is not implemented; LossyTileCoordinatesSet is read-only");
 }
 
+void LossyTileCoordinatesSet::forEach(const std::function<void(TileCoordinate x, TileCoordinate y)>& fn) const {
+	tiles.forEach([&](TileCoordinate x, TileCoordinate y) {
+		for (TileCoordinate dx = 0; dx < scale; dx++)
+			for (TileCoordinate dy = 0; dy < scale; dy++)
+				fn(x * scale + dx, y * scale + dy);
+	});
+}
+
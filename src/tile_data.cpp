@@ -1,6 +1,7 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
 #include "tile_data.h"
 #include "coordinates_geom.h"
 #include "leased_store.h"
@@ -44,6 +45,10 @@ thread_local LeasedStore<TileDataSource::linestring_store_t> linestringStore;
 thread_local LeasedStore<TileDataSource::multi_linestring_store_t> multilinestringStore;
 thread_local LeasedStore<TileDataSource::multi_polygon_store_t> multipolygonStore;
 
+// Identifies each TileDataSource, so that a thread's cached buffer can't be
+// mistaken for one belonging to a later source at the same address
+static std::atomic<uint64_t> nextInstanceId(1);
+
 TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool includeID)
 	:
 	includeID(includeID),
@@ -59,7 +64,8 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool in
 	multilinestringStores(threadNum),
 	multipolygonStores(threadNum),
 	multiPolygonClipCache(ClipCache<MultiPolygon>(threadNum, indexZoom)),
-	multiLinestringClipCache(ClipCache<MultiLinestring>(threadNum, indexZoom))
+	multiLinestringClipCache(ClipCache<MultiLinestring>(threadNum, indexZoom)),
+	instanceId(nextInstanceId++)
 {
 	// TileDataSource can only index up to zoom 14. The caller is responsible for
 	// ensuring it does not use a higher zoom.
@@ -84,7 +90,7 @@ TileDataSource::TileDataSource(size_t threadNum, unsigned int indexZoom, bool in
 
 thread_local std::vector<std::tuple<TileCoordinates, OutputObject, uint64_t>>* tlsPendingSmallIndexObjects = nullptr;
 
-void TileDataSource::finalize(size_t threadNum) {
+void TileDataSource::finalize(size_t threadNum, boost::asio::thread_pool& pool, std::vector<std::future<void>>& tasks) {
 	uint64_t finalized = 0;
 	for (const auto& vec : pendingSmallIndexObjects) {
 		for (const auto& tuple : vec) {
@@ -95,8 +101,29 @@ void TileDataSource::finalize(size_t threadNum) {
 
 	std::cout << "indexed " << finalized << " contended objects" << std::endl;
 
-	finalizeObjects<OutputObjectXY>(name(), threadNum, indexZoom, objects.begin(), objects.end(), lowZoomObjects);
-	finalizeObjects<OutputObjectXYID>(name(), threadNum, indexZoom, objectsWithIds.begin(), objectsWithIds.end(), lowZoomObjectsWithIds);
+	finalizeObjects<OutputObject>(threadNum, pool, objects, lowZoomObjects, tasks);
+	finalizeObjects<OutputObjectID>(threadNum, pool, objectsWithIds, lowZoomObjectsWithIds, tasks);
+
+	// Bulk load the large objects. Boost packs the rtree when it's built
+	// from a range, giving fuller nodes than inserting one by one.
+	auto task = std::make_shared<std::packaged_task<void()>>([this]() {
+		std::vector<std::pair<Box, OutputObject>> large;
+		std::vector<std::pair<Box, OutputObjectID>> largeWithIds;
+		for (auto& buffer : largeObjectBuffers) {
+			for (const auto& entry : buffer) {
+				if (entry.second.id == 0)
+					large.push_back(std::make_pair(entry.first, entry.second.oo));
+				else
+					largeWithIds.push_back(entry);
+			}
+			large_object_buffer_t().swap(buffer);
+		}
+
+		boxRtree = decltype(boxRtree)(large.begin(), large.end());
+		boxRtreeWithIds = decltype(boxRtreeWithIds)(largeWithIds.begin(), largeWithIds.end());
+	});
+	tasks.push_back(task->get_future());
+	boost::asio::post(pool, [task]() { (*task)(); });
 }
 
 void TileDataSource::addObjectToSmallIndex(const TileCoordinates& index, const OutputObject& oo, uint64_t id) {
@@ -132,26 +159,35 @@ void TileDataSource::addObjectToSmallIndexUnsafe(const TileCoordinates& index, c
 	const size_t z6x = index.x / z6OffsetDivisor;
 	const size_t z6y = index.y / z6OffsetDivisor;
 	const size_t z6index = z6x * CLUSTER_ZOOM_WIDTH + z6y;
+	const Z6Key key = z6Key(
+		(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
+		(Z6Offset)(index.y - (z6y * z6OffsetDivisor))
+	);
 
 	if (id == 0 || !includeID)
-		objects[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor))
-		});
+		objects[z6index].push_back(key, oo);
 	else
-		objectsWithIds[z6index].push_back({
-			oo,
-			(Z6Offset)(index.x - (z6x * z6OffsetDivisor)),
-			(Z6Offset)(index.y - (z6y * z6OffsetDivisor)),
-			id
-		});
+		objectsWithIds[z6index].push_back(key, { oo, id });
+}
+
+// This thread's large object buffer in each source, keyed by instanceId
+thread_local std::unordered_map<uint64_t, std::vector<std::pair<Box, OutputObjectID>>*> tlsLargeObjects;
+
+void TileDataSource::addObjectToLargeIndex(const Box& envelope, const OutputObject& oo, uint64_t id) {
+	large_object_buffer_t*& buffer = tlsLargeObjects[instanceId];
+	if (buffer == nullptr) {
+		std::lock_guard<std::mutex> lock(mutex);
+		largeObjectBuffers.emplace_back();
+		buffer = &largeObjectBuffers.back();
+	}
+
+	buffer->push_back(std::make_pair(envelope, OutputObjectID({oo, includeID ? id : 0})));
 }
 
 void TileDataSource::collectTilesWithObjectsAtZoom(std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms) {
 	// Scan through all shards. Convert to base zoom, then convert to the requested zoom.
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXY>(indexZoom, objects.begin(), objects.size(), zooms);
-	collectTilesWithObjectsAtZoomTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), objectsWithIds.size(), zooms);
+	collectTilesWithObjectsAtZoomTemplate<OutputObject>(indexZoom, objects.begin(), objects.size(), zooms);
+	collectTilesWithObjectsAtZoomTemplate<OutputObjectID>(indexZoom, objectsWithIds.begin(), objectsWithIds.size(), zooms);
 }
 
 void addCoveredTilesToOutput(const uint indexZoom, std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms, const Box& box) {
@@ -191,8 +227,8 @@ void TileDataSource::collectObjectsForTile(
 	std::vector<OutputObjectID>& output
 ) {
 	if (zoom < CLUSTER_ZOOM) {
-		collectLowZoomObjectsForTile<OutputObjectXY>(indexZoom, lowZoomObjects, zoom, dstIndex, output);
-		collectLowZoomObjectsForTile<OutputObjectXYID>(indexZoom, lowZoomObjectsWithIds, zoom, dstIndex, output);
+		collectLowZoomObjectsForTile<OutputObject>(indexZoom, lowZoomObjects, zoom, dstIndex, output);
+		collectLowZoomObjectsForTile<OutputObjectID>(indexZoom, lowZoomObjectsWithIds, zoom, dstIndex, output);
 		return;
 	}
 
@@ -211,16 +247,12 @@ void TileDataSource::collectObjectsForTile(
 		iEnd = iStart + 1;
 	}
 
-	collectObjectsForTileTemplate<OutputObjectXY>(indexZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
-	collectObjectsForTileTemplate<OutputObjectXYID>(indexZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate<OutputObject>(indexZoom, objects.begin(), iStart, iEnd, zoom, dstIndex, output);
+	collectObjectsForTileTemplate<OutputObjectID>(indexZoom, objectsWithIds.begin(), iStart, iEnd, zoom, dstIndex, output);
 }
 
-// Copy objects from the large index into output
-void TileDataSource::collectLargeObjectsForTile(
-	uint zoom,
-	TileCoordinates dstIndex,
-	std::vector<OutputObjectID>& output
-) {
+// The index zoom tiles a tile covers, as a box to query the large index with
+static Box largeIndexBoxForTile(unsigned int indexZoom, uint zoom, TileCoordinates dstIndex) {
 	unsigned int clampedZoom = zoom;
 	while (clampedZoom > indexZoom) {
 		clampedZoom--;
@@ -230,8 +262,17 @@ void TileDataSource::collectLargeObjectsForTile(
 	int scale = pow(2, indexZoom - clampedZoom);
 	TileCoordinates srcIndex1( dstIndex.x   *scale  ,  dstIndex.y   *scale  );
 	TileCoordinates srcIndex2((dstIndex.x+1)*scale-1, (dstIndex.y+1)*scale-1);
-	Box box = Box(geom::make<Point>(srcIndex1.x, srcIndex1.y),
-	              geom::make<Point>(srcIndex2.x, srcIndex2.y));
+	return Box(geom::make<Point>(srcIndex1.x, srcIndex1.y),
+	           geom::make<Point>(srcIndex2.x, srcIndex2.y));
+}
+
+// Copy objects from the large index into output
+void TileDataSource::collectLargeObjectsForTile(
+	uint zoom,
+	TileCoordinates dstIndex,
+	std::vector<OutputObjectID>& output
+) {
+	const Box box = largeIndexBoxForTile(indexZoom, zoom, dstIndex);
 	for(auto const& result: boxRtree | boost::geometry::index::adaptors::queried(boost::geometry::index::intersects(box))) {
 		if (result.second.minZoom <= zoom)
 			output.push_back({result.second, 0});
@@ -489,6 +530,33 @@ std::vector<OutputObjectID> TileDataSource::getObjectsForTile(
 	return data;
 }
 
+size_t TileDataSource::estimateTileCost(unsigned int zoom, TileCoordinates coordinates) {
+	size_t cost = 0;
+	if (zoom < CLUSTER_ZOOM) {
+		cost += countLowZoomObjectsForTile<OutputObject>(indexZoom, lowZoomObjects, zoom, coordinates);
+		cost += countLowZoomObjectsForTile<OutputObjectID>(indexZoom, lowZoomObjectsWithIds, zoom, coordinates);
+	} else {
+		TileCoordinate z6x = coordinates.x / (1 << (zoom - CLUSTER_ZOOM));
+		TileCoordinate z6y = coordinates.y / (1 << (zoom - CLUSTER_ZOOM));
+		if (z6x < CLUSTER_ZOOM_WIDTH && z6y < CLUSTER_ZOOM_WIDTH) {
+			const size_t i = z6x * CLUSTER_ZOOM_WIDTH + z6y;
+			cost += countObjectsForTileTemplate<OutputObject>(indexZoom, objects[i], zoom, coordinates);
+			cost += countObjectsForTileTemplate<OutputObjectID>(indexZoom, objectsWithIds[i], zoom, coordinates);
+		}
+	}
+
+	// Large objects are mostly big polygons that have to be clipped to the
+	// tile, so each costs about as much as several small objects.
+	const Box box = largeIndexBoxForTile(indexZoom, zoom, coordinates);
+	size_t largeObjects = 0;
+	for (auto it = boxRtree.qbegin(boost::geometry::index::intersects(box)); it != boxRtree.qend(); it++)
+		largeObjects++;
+	for (auto it = boxRtreeWithIds.qbegin(boost::geometry::index::intersects(box)); it != boxRtreeWithIds.qend(); it++)
+		largeObjects++;
+
+	return cost + largeObjects * LARGE_OBJECT_COST;
+}
+
 // ------------------------------------
 // Add geometries to tile/large indices
 
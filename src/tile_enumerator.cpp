@@ -0,0 +1,173 @@
+#include <algorithm>
+#include "tile_enumerator.h"
+#include "tile_data_base.h"
+
+#define BATCH_WEIGHT 1000
+
+// With a cost estimate, a batch is about this many objects' worth of work
+#define BATCH_COST 10000
+
+TileEnumerator::TileEnumerator(
+	const std::vector<std::shared_ptr<TileCoordinatesSet>>& zooms,
+	unsigned int startZoom,
+	unsigned int endZoom,
+	Filter filter,
+	CostEstimate cost
+):
+	zooms(zooms),
+	startZoom(startZoom),
+	endZoom(endZoom),
+	filter(filter),
+	cost(cost),
+	lowZoomsDone(false),
+	nextZ6Tile(0) {
+}
+
+size_t TileEnumerator::tileWeight(unsigned int zoom) {
+	// Higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
+	if (zoom > 12)
+		return 1;
+	if (zoom > 11)
+		return 10;
+	if (zoom > 10)
+		return 100;
+	return 1000;
+}
+
+size_t TileEnumerator::weight(unsigned int zoom, TileCoordinate x, TileCoordinate y) const {
+	if (cost)
+		return TILE_COST + cost(zoom, x, y);
+	return tileWeight(zoom);
+}
+
+bool TileEnumerator::next(std::vector<ZoomedTileCoordinates>& batch) {
+	std::vector<size_t> weights;
+	return next(batch, weights);
+}
+
+bool TileEnumerator::next(std::vector<ZoomedTileCoordinates>& batch, std::vector<size_t>& weights) {
+	batch.clear();
+	weights.clear();
+	const size_t batchWeight = cost ? BATCH_COST : BATCH_WEIGHT;
+	size_t total = 0;
+	while (total < batchWeight) {
+		if (pending.empty()) {
+			if (!lowZoomsDone) {
+				lowZoomsDone = true;
+				addLowZooms();
+				orderZ6Tiles();
+				continue;
+			}
+
+			// Move on to the next z6 tile that has any tiles in it
+			if (nextZ6Tile >= z6Order.size())
+				break;
+			const size_t z6 = z6Order[nextZ6Tile++];
+			addZ6Tile(z6 / CLUSTER_ZOOM_WIDTH, z6 % CLUSTER_ZOOM_WIDTH);
+			continue;
+		}
+
+		total += pending.front().second;
+		batch.push_back(pending.front().first);
+		weights.push_back(pending.front().second);
+		pending.pop_front();
+	}
+
+	return !batch.empty();
+}
+
+void TileEnumerator::addLowZooms() {
+	// Breadth-first: by zoom, then x, then y, which is the order forEach
+	// visits tiles below z6 in
+	for (unsigned int zoom = startZoom; zoom < CLUSTER_ZOOM && zoom <= endZoom; zoom++) {
+		zooms[zoom]->forEach([&](TileCoordinate x, TileCoordinate y) {
+			if (filter(zoom, x, y))
+				pending.push_back(std::make_pair(std::make_pair(zoom, TileCoordinates(x, y)), weight(zoom, x, y)));
+		});
+	}
+
+	// Low zoom tiles can take minutes each, so start the slowest first
+	if (cost)
+		std::stable_sort(pending.begin(), pending.end(), [](const std::pair<ZoomedTileCoordinates, size_t>& a, const std::pair<ZoomedTileCoordinates, size_t>& b) {
+			return a.second > b.second;
+		});
+}
+
+void TileEnumerator::orderZ6Tiles() {
+	if (endZoom < CLUSTER_ZOOM)
+		return;
+
+	if (cost)
+		z6Costs.resize(CLUSTER_ZOOM_AREA);
+	zooms[CLUSTER_ZOOM]->forEach([&](TileCoordinate x, TileCoordinate y) {
+		if (!filter(CLUSTER_ZOOM, x, y))
+			return;
+		const size_t z6 = x * CLUSTER_ZOOM_WIDTH + y;
+		z6Order.push_back(z6);
+		// A z6 tile's own cost stands in for the cost of its descendants,
+		// as they hold the same objects.
+		if (cost)
+			z6Costs[z6] = cost(CLUSTER_ZOOM, x, y);
+	});
+
+	if (cost)
+		std::stable_sort(z6Order.begin(), z6Order.end(), [this](size_t a, size_t b) {
+			return z6Costs[a] > z6Costs[b];
+		});
+}
+
+void TileEnumerator::addZ6Tile(TileCoordinate x, TileCoordinate y) {
+	const size_t first = pending.size();
+	std::vector<size_t> tilesAtZoom(endZoom + 1);
+	walk(CLUSTER_ZOOM, x, y, [&](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		if (zoom >= startZoom) {
+			pending.push_back(std::make_pair(std::make_pair(zoom, TileCoordinates(x, y)), tileWeight(zoom)));
+			tilesAtZoom[zoom]++;
+		}
+	});
+	if (!cost)
+		return;
+
+	// Estimating every tile would mean an index query per tile, on the
+	// thread that feeds the pool. Instead, each zoom's tiles share the z6
+	// tile's cost, as each of its objects is in about one tile per zoom.
+	const size_t z6Cost = z6Costs[x * CLUSTER_ZOOM_WIDTH + y];
+	for (size_t i = first; i < pending.size(); i++)
+		pending[i].second = TILE_COST + z6Cost / tilesAtZoom[pending[i].first.first];
+}
+
+// Calls fn for the tile and each of its descendants that's in the sets and
+// passes the filter, depth-first, x before y.
+template<typename Fn> void TileEnumerator::walk(unsigned int zoom, TileCoordinate x, TileCoordinate y, Fn fn) const {
+	if (!zooms[zoom]->test(x, y) || !filter(zoom, x, y))
+		return;
+
+	fn(zoom, x, y);
+	if (zoom == endZoom)
+		return;
+
+	for (TileCoordinate dx = 0; dx < 2; dx++)
+		for (TileCoordinate dy = 0; dy < 2; dy++)
+			walk(zoom + 1, x * 2 + dx, y * 2 + dy, fn);
+}
+
+std::vector<size_t> TileEnumerator::count() const {
+	std::vector<size_t> counts(endZoom + 1);
+	for (unsigned int zoom = startZoom; zoom < CLUSTER_ZOOM && zoom <= endZoom; zoom++) {
+		zooms[zoom]->forEach([&](TileCoordinate x, TileCoordinate y) {
+			if (filter(zoom, x, y))
+				counts[zoom]++;
+		});
+	}
+
+	if (endZoom >= CLUSTER_ZOOM) {
+		zooms[CLUSTER_ZOOM]->forEach([&](TileCoordinate x, TileCoordinate y) {
+			walk(CLUSTER_ZOOM, x, y, [&](unsigned int zoom, TileCoordinate, TileCoordinate) {
+				if (zoom >= startZoom)
+					counts[zoom]++;
+			});
+		});
+	}
+
+	return counts;
+}
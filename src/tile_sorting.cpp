@@ -1,76 +1,200 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <iostream>
 #include "tile_data_base.h"
 #include "append_vector.h"
 #include <boost/sort/sort.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+// Below this many objects, a single thread sorts faster than starting more
+#define RADIX_SORT_PARALLEL_THRESHOLD (1 << 16)
+
+// Sorts of at least this many objects are large...
+#define LARGE_SORT_OBJECTS (1 << 22)
+// ...and only this many of them run at once
+#define MAX_LARGE_SORTS 4
+
+// Runs fn(chunk, begin, end) over chunkCount chunks of [0, n).
+//
+// The calling thread takes chunks, and so do chunkCount-1 helpers posted to
+// `pool` (if there is one), so the work never waits for a pool thread that's
+// busy elsewhere: helpers that only start once every chunk is taken just
+// return. It then waits for the chunks other threads took, which are all
+// underway.
+template<typename Fn> static void forEachChunk(boost::asio::thread_pool* pool, const size_t chunkCount, const size_t n, Fn fn) {
+    const size_t chunkSize = (n + chunkCount - 1) / chunkCount;
+    struct Chunks {
+        std::atomic<size_t> next;
+        size_t done;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto chunks = std::make_shared<Chunks>();
+    chunks->next = 0;
+    chunks->done = 0;
+
+    auto work = [chunks, chunkCount, chunkSize, n, &fn]() {
+        size_t t;
+        while ((t = chunks->next++) < chunkCount) {
+            fn(t, std::min(n, t * chunkSize), std::min(n, (t + 1) * chunkSize));
+
+            std::lock_guard<std::mutex> lock(chunks->mutex);
+            if (++chunks->done == chunkCount)
+                chunks->finished.notify_one();
+        }
+    };
+
+    if (pool)
+        for (size_t t = 1; t < chunkCount; t++)
+            boost::asio::post(*pool, work);
+    work();
+
+    std::unique_lock<std::mutex> lock(chunks->mutex);
+    chunks->finished.wait(lock, [&]() { return chunks->done == chunkCount; });
+}
+
+// Holds one of the MAX_LARGE_SORTS slots for as long as it lives
+class LargeSortSlot {
+public:
+    LargeSortSlot() {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, []() { return running < MAX_LARGE_SORTS; });
+        running++;
+    }
+    ~LargeSortSlot() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running--;
+        }
+        available.notify_one();
+    }
+
+private:
+    static std::mutex mutex;
+    static std::condition_variable available;
+    static size_t running;
+};
+std::mutex LargeSortSlot::mutex;
+std::condition_variable LargeSortSlot::available;
+size_t LargeSortSlot::running = 0;
+
+// Fills `order` with the positions of `keys`, sorted by key, then by
+// position, and sorts `keys`.
+//
+// Keys are 16 bits, so this is a single counting pass. It splits the input
+// into one chunk per thread. Threads count the keys in their chunk, then
+// each scatters its chunk's positions to offsets computed from everyone's
+// counts, which keeps the sort stable. The sorted keys are then written
+// back from the counts, so they're never copied.
+static void radixSortPositions(
+    const size_t threadNum,
+    boost::asio::thread_pool* pool,
+    std::vector<Z6Key, mmap_allocator<Z6Key>>& keys,
+    std::vector<uint32_t>& order
+) {
+    const size_t n = keys.size();
+    const size_t digits = size_t(1) << (8 * sizeof(Z6Key));
+    const size_t threadCount = n < RADIX_SORT_PARALLEL_THRESHOLD ? 1 : std::max<size_t>(1, threadNum);
+    std::vector<std::vector<uint32_t>> counts(threadCount, std::vector<uint32_t>(digits));
+
+    forEachChunk(pool, threadCount, n, [&](size_t t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            counts[t][keys[i]]++;
+    });
+
+    // Turn the counts into each thread's first offset for each key
+    size_t offset = 0;
+    for (size_t digit = 0; digit < digits; digit++) {
+        for (size_t t = 0; t < threadCount; t++) {
+            const size_t count = counts[t][digit];
+            counts[t][digit] = offset;
+            offset += count;
+        }
+    }
+
+    forEachChunk(pool, threadCount, n, [&](size_t t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++)
+            order[counts[t][keys[i]]++] = i;
+    });
+
+    // The last thread's offsets now mark where each key's run ends
+    size_t start = 0;
+    for (size_t digit = 0; digit < digits; digit++) {
+        const size_t end = counts[threadCount - 1][digit];
+        std::fill(keys.begin() + start, keys.begin() + end, static_cast<Z6Key>(digit));
+        start = end;
+    }
+}
 
 template<typename OO> void sortOutputObjects(
-    const unsigned int indexZoom,
     const size_t threadNum,
-	typename AppendVectorNS::AppendVector<OO>::Iterator begin,
-	typename AppendVectorNS::AppendVector<OO>::Iterator end
+    boost::asio::thread_pool* pool,
+	Z6Objects<OO>& objects
 )
 {
-    // If the user is doing a a small extract, there are few populated
-    // entries in `object`.
+    // Each z6 tile is sorted as its own task (see finalizeObjects), so for a
+    // global extract, threadNum is usually 1. It's higher for z6 tiles with
+    // more than their share of objects.
     //
     // e.g. Colorado has ~9 z6 tiles, 1 of which has 95% of its output
-    // objects.
-    //
-    // This optimizes for the small extract case by doing:
-    // - for each vector in objects
-    //   - do a multi-threaded sort of vector
+    // objects, so that one is sorted on every thread. The extra threads
+    // come from `pool`, which is the one the z6 tasks themselves run on.
     //
-    // For small extracts, this ensures that all threads are used even if
-    // only a handful of entries in `objects` are non-empty.
+    // The keys already encode the sort order, so we sort the positions of
+    // the objects by key, then permute the objects into that order. Ties
+    // keep their original order, so the output doesn't depend on threads.
     //
-    // For a global extract, this will have some overhead of repeatedly
-    // setting up/tearing down threads. In that case, it would be 
-    // better to assign chunks of `objects` to each thread.
-    //
-    // That's a future performance improvement, so deferring for now.
-    boost::sort::block_indirect_sort(
-        begin, end, 
-        [indexZoom](const OO& a, const OO& b) {
-            // Cluster by parent zoom, so that a subsequent search
-            // can find a contiguous range of entries for any tile
-            // at zoom 6 or higher.
-            const size_t aX = a.x;
-            const size_t aY = a.y;
-            const size_t bX = b.x;
-            const size_t bY = b.y;
-            for (size_t z = CLUSTER_ZOOM; z <= indexZoom; z++) {
-                const auto aXz = aX / (1 << (indexZoom - z));
-                const auto bXz = bX / (1 << (indexZoom - z));
-                if (aXz != bXz)
-                    return aXz < bXz;
-
-                const auto aYz = aY / (1 << (indexZoom - z));
-                const auto bYz = bY / (1 << (indexZoom - z));
-
-                if (aYz != bYz)
-                    return aYz < bYz;
+    // Besides a 256KB count table per thread, a sort needs 4 bytes per
+    // object for the positions. Z6 tiles are sorted concurrently, one per
+    // pool thread, but at most MAX_LARGE_SORTS tiles of LARGE_SORT_OBJECTS
+    // or more at once: so at peak, that's 4 bytes per object in those tiles,
+    // plus under 16MB for each smaller tile being sorted.
+    const size_t n = objects.size();
+    std::unique_ptr<LargeSortSlot> slot;
+    if (n >= LARGE_SORT_OBJECTS)
+        slot.reset(new LargeSortSlot());
+
+    std::vector<uint32_t> order(n);
+    radixSortPositions(threadNum, pool, objects.keys, order);
+
+    // Permute the objects in place, a cycle at a time, so that we never hold
+    // a second copy of them. Each slot we fill is marked by pointing order at
+    // itself.
+    for (size_t i = 0; i < n; i++) {
+        if (order[i] == i)
+            continue;
+
+        OO first = objects.objects[i];
+        size_t j = i;
+        while (true) {
+            const size_t from = order[j];
+            order[j] = j;
+            if (from == i) {
+                objects.objects[j] = first;
+                break;
             }
-
-            return false;
-        },
-        threadNum
-    );
+            objects.objects[j] = objects.objects[from];
+            j = from;
+        }
+    }
 }
 
-template void sortOutputObjects<OutputObjectXY>(
-    const unsigned int indexZoom,
+template void sortOutputObjects<OutputObject>(
     const size_t threadNum,
-	typename AppendVectorNS::AppendVector<OutputObjectXY>::Iterator begin,
-	typename AppendVectorNS::AppendVector<OutputObjectXY>::Iterator end
+    boost::asio::thread_pool* pool,
+	Z6Objects<OutputObject>& objects
 );
 
-template void sortOutputObjects<OutputObjectXYID>(
-    const unsigned int indexZoom,
+template void sortOutputObjects<OutputObjectID>(
     const size_t threadNum,
-	typename AppendVectorNS::AppendVector<OutputObjectXYID>::Iterator begin,
-	typename AppendVectorNS::AppendVector<OutputObjectXYID>::Iterator end
+    boost::asio::thread_pool* pool,
+	Z6Objects<OutputObjectID>& objects
 );
 
 void sortOutputObjectIDs(
@@ -94,59 +218,3 @@ void sortOutputObjectIDs(
 		return false;
 	});
 }
-
-void sortTileCoordinates(
-    const size_t baseZoom,
-    const size_t threadNum,
-    std::deque<std::pair<unsigned int, TileCoordinates>>& tileCoordinates
-)
-{
-    boost::sort::block_indirect_sort(
-		tileCoordinates.begin(), tileCoordinates.end(), 
-		[baseZoom](auto const &a, auto const &b) {
-			const auto aZoom = a.first;
-			const auto bZoom = b.first;
-			const auto aX = a.second.x;
-			const auto aY = a.second.y;
-			const auto bX = b.second.x;
-			const auto bY = b.second.y;
-			const bool aLowZoom = aZoom < CLUSTER_ZOOM;
-			const bool bLowZoom = bZoom < CLUSTER_ZOOM;
-
-			// Breadth-first for z0..5
-			if (aLowZoom != bLowZoom)
-				return aLowZoom;
-
-			if (aLowZoom && bLowZoom) {
-				if (aZoom != bZoom)
-					return aZoom < bZoom;
-
-				if (aX != bX)
-					return aX < bX;
-
-				return aY < bY;
-			}
-
-			for (size_t z = CLUSTER_ZOOM; z <= baseZoom; z++) {
-				// Translate both a and b to zoom z, compare.
-				// First, sanity check: can we translate it to this zoom?
-				if (aZoom < z || bZoom < z) {
-					return aZoom < bZoom;
-				}
-
-				const auto aXz = aX / (1 << (aZoom - z));
-				const auto aYz = aY / (1 << (aZoom - z));
-				const auto bXz = bX / (1 << (bZoom - z));
-				const auto bYz = bY / (1 << (bZoom - z));
-
-				if (aXz != bXz)
-					return aXz < bXz;
-
-				if (aYz != bYz)
-					return aYz < bYz;
-			}
-
-			return false;
-		}, 
-		threadNum);
-}
\ No newline at end of file
@@ -1,7 +1,8 @@
 /*! \file */ 
 #include "tile_worker.h"
-#include <fstream>
-#include <boost/filesystem.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <boost/asio/post.hpp>
 #include <vtzero/builder.hpp>
 #include <signal.h>
 #include "helpers.h"
@@ -10,6 +11,9 @@
 using namespace std;
 extern bool verbose;
 
+// Tiles with at least this estimated cost build their layer groups in parallel
+#define PARALLEL_TILE_COST 50000
+
 thread_local bool enabledUserSignal = false;
 thread_local MultiPolygon scaledMultiPolygon;
 typedef std::vector<OutputObjectID>::const_iterator OutputObjectsConstIt;
@@ -104,7 +108,8 @@ void writeMultiLinestring(
 	unsigned zoom,
 	double simplifyLevel,
 	unsigned simplifyAlgo,
-	const MultiLinestring& mls
+	const MultiLinestring& mls,
+	EncodedAttributes& encodedAttributes
 ) {
 	vtzero::linestring_feature_builder fbuilder{vtLayer};
 
@@ -168,7 +173,7 @@ void writeMultiLinestring(
 
 	if (hadLine) {
 		// add the properties
-		oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+		oo.oo.writeAttributes(attributeStore, vtLayer, fbuilder, zoom, encodedAttributes);
 		// call commit() when you are done
 		fbuilder.commit();
 	}
@@ -221,7 +226,8 @@ void writeMultiPolygon(
 	unsigned zoom,
 	double simplifyLevel,
 	unsigned simplifyAlgo,
-	const MultiPolygon& mp
+	const MultiPolygon& mp,
+	EncodedAttributes& encodedAttributes
 ) {
 	bbox.scaleGeometry(scaledMultiPolygon, mp);
 	MultiPolygon &current = scaledMultiPolygon;
@@ -294,7 +300,7 @@ void writeMultiPolygon(
 
 	if (hadPoly) {
 		// add the properties
-		oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+		oo.oo.writeAttributes(attributeStore, vtLayer, fbuilder, zoom, encodedAttributes);
 		// call commit() when you are done
 		fbuilder.commit();
 	}
@@ -314,7 +320,8 @@ void ProcessObjects(
 	bool combinePolygons,
 	unsigned zoom,
 	const TileBbox &bbox,
-	vtzero::layer_builder& vtLayer
+	vtzero::layer_builder& vtLayer,
+	EncodedAttributes& encodedAttributes
 ) {
 	for (auto jt = ooSameLayerBegin; jt != ooSameLayerEnd; ++jt) {
 		OutputObjectID oo = *jt;
@@ -364,7 +371,7 @@ void ProcessObjects(
 			for (const auto &point : multipoint)
 				fbuilder.set_point(point.first, point.second);
 
-			oo.oo.writeAttributes(attributeStore, fbuilder, zoom);
+			oo.oo.writeAttributes(attributeStore, vtLayer, fbuilder, zoom, encodedAttributes);
 			fbuilder.commit();
 
 			oo = *jt;
@@ -410,9 +417,9 @@ void ProcessObjects(
 			}
 
 			if (oo.oo.geomType == LINESTRING_ || oo.oo.geomType == MULTILINESTRING_)
-				writeMultiLinestring(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, simplifyAlgo, boost::get<MultiLinestring>(g));
+				writeMultiLinestring(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, simplifyAlgo, boost::get<MultiLinestring>(g), encodedAttributes);
 			else if (oo.oo.geomType == POLYGON_)
-				writeMultiPolygon(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, simplifyAlgo, boost::get<MultiPolygon>(g));
+				writeMultiPolygon(attributeStore, sharedData, vtLayer, bbox, oo, zoom, simplifyLevel, simplifyAlgo, boost::get<MultiPolygon>(g), encodedAttributes);
 		}
 	}
 }
@@ -449,6 +456,7 @@ void ProcessLayer(
 ) {
 	std::string layerName = sharedData.layers.layers[ltx.at(0)].name;
 	vtzero::layer_builder vtLayer{tile, layerName, sharedData.config.mvtVersion, bbox.hires ? 8192u : 4096u};
+	EncodedAttributes encodedAttributes;
 
 	vtzero::layer existingLayer = existingTile.get_layer_by_name(layerName);
 	if (existingLayer) {
@@ -496,7 +504,7 @@ void ProcessLayer(
 			ProcessObjects(sources[i], attributeStore, 
 				ooListSameLayer.first, end, sharedData, 
 				simplifyLevel, ld.simplifyAlgo,
-				filterArea, ld.combinePoints, zoom < ld.combineLinesBelow, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer);
+				filterArea, ld.combinePoints, zoom < ld.combineLinesBelow, zoom < ld.combinePolygonsBelow, zoom, bbox, vtLayer, encodedAttributes);
 		}
 	}
 	if (verbose && std::time(0)-start>3) {
@@ -510,14 +518,72 @@ void handleUserSignal(int signum) {
 	signalStop=true;
 }
 
+// Builds each layer group of a tile into its own tile, serialized into
+// `layers`, spread over the layer pool's threads.
+//
+// The calling thread takes groups too, so the tile never waits for a pool
+// thread: helpers that only start once every group is taken just return.
+// It then waits for the groups other threads took, which are all underway.
+void ProcessLayersInParallel(
+	const SourceList& sources,
+	const AttributeStore& attributeStore,
+	TileCoordinates index,
+	uint zoom,
+	const std::vector<std::vector<OutputObjectID>>& data,
+	vtzero::vector_tile existingTile,
+	const TileBbox& bbox,
+	SharedData& sharedData,
+	std::vector<std::string>& layers
+) {
+	struct LayerGroups {
+		std::atomic<size_t> next;
+		size_t done;
+		std::mutex mutex;
+		std::condition_variable finished;
+	};
+	auto groups = std::make_shared<LayerGroups>();
+	groups->next = 0;
+	groups->done = 0;
+
+	const auto& layerOrder = sharedData.layers.layerOrder;
+	auto work = [&, groups]() {
+		size_t i;
+		while ((i = groups->next++) < layerOrder.size()) {
+			if (!signalStop) {
+				vtzero::tile_builder tile;
+				ProcessLayer(sources, attributeStore, index, zoom, data, existingTile, tile, bbox, layerOrder[i], sharedData);
+				tile.serialize(layers[i]);
+			}
+
+			std::lock_guard<std::mutex> lock(groups->mutex);
+			if (++groups->done == layerOrder.size())
+				groups->finished.notify_one();
+		}
+	};
+
+	const size_t helpers = std::min<size_t>(sharedData.threadNum, layerOrder.size()) - 1;
+	for (size_t i = 0; i < helpers; i++)
+		boost::asio::post(*sharedData.layerPool, work);
+	work();
+
+	std::unique_lock<std::mutex> lock(groups->mutex);
+	groups->finished.wait(lock, [&]() { return groups->done == layerOrder.size(); });
+}
+
 void outputProc(
 	SharedData& sharedData, 
 	const SourceList& sources,
 	const AttributeStore& attributeStore,
 	const std::vector<std::vector<OutputObjectID>>& data, 
 	TileCoordinates coordinates,
-	uint zoom
+	uint zoom,
+	size_t cost
 ) {
+	// An expensive tile builds its layer groups on several threads, then
+	// copies them into the tile in order. They're declared first so that
+	// they outlive the tile.
+	std::vector<std::string> layers;
+
 	// Create tile
 	vtzero::tile_builder tile;
 
@@ -532,7 +598,7 @@ void outputProc(
 	// Read existing tile if merging
 	std::string rawExistingTile;
 	if (sharedData.mergeSqlite) {
-		sharedData.mbtiles.readTileAndUncompress(rawExistingTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip);
+		sharedData.mbtiles.readTileAndUncompress(rawExistingTile, zoom, bbox.index.x, bbox.index.y, sharedData.config.compress, sharedData.config.gzip, sharedData.config.zstd);
 	}
 	vtzero::vector_tile existingTile{rawExistingTile};
 
@@ -545,41 +611,23 @@ void outputProc(
 #endif
 	signalStop=false;
 
-	for (auto lt = sharedData.layers.layerOrder.begin(); lt != sharedData.layers.layerOrder.end(); ++lt) {
-		if (signalStop) break;
-		ProcessLayer(sources, attributeStore, coordinates, zoom, data, existingTile, tile, bbox, *lt, sharedData);
-	}
-
-	// Write to file or sqlite
-	string outputdata, compressed;
-	if (sharedData.outputMode == OptionsParser::OutputMode::MBTiles) {
-		// Write to sqlite
-		//tile.SerializeToString(&outputdata);
-		tile.serialize(outputdata);
-
-		if (sharedData.config.compress) { compressed = compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip); }
-		sharedData.mbtiles.saveTile(zoom, bbox.index.x, bbox.index.y, sharedData.config.compress ? &compressed : &outputdata, sharedData.mergeSqlite);
-
-	} else if (sharedData.outputMode == OptionsParser::OutputMode::PMTiles) {
-		// Write to pmtiles
-		tile.serialize(outputdata);
-		sharedData.pmtiles.saveTile(zoom, bbox.index.x, bbox.index.y, outputdata);
-
+	if (sharedData.layerPool && sharedData.layers.layerOrder.size() > 1 && cost >= PARALLEL_TILE_COST) {
+		layers.resize(sharedData.layers.layerOrder.size());
+		ProcessLayersInParallel(sources, attributeStore, coordinates, zoom, data, existingTile, bbox, sharedData, layers);
+		for (const auto& layer : layers) {
+			vtzero::vector_tile layerTile{layer};
+			while (auto vtLayer = layerTile.next_layer())
+				tile.add_existing_layer(vtLayer);
+		}
 	} else {
-		// Write to file
-		stringstream dirname, filename;
-		dirname  << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x;
-		filename << sharedData.outputFile << "/" << zoom << "/" << bbox.index.x << "/" << bbox.index.y << ".pbf";
-		boost::filesystem::create_directories(dirname.str());
-		fstream outfile(filename.str(), ios::out | ios::trunc | ios::binary);
-		if (sharedData.config.compress) {
-			//tile.SerializeToString(&outputdata);
-			tile.serialize(outputdata);
-			outfile << compress_string(outputdata, Z_DEFAULT_COMPRESSION, sharedData.config.gzip);
-		} else {
-			tile.serialize(outputdata);
-			outfile << outputdata;
+		for (auto lt = sharedData.layers.layerOrder.begin(); lt != sharedData.layers.layerOrder.end(); ++lt) {
+			if (signalStop) break;
+			ProcessLayer(sources, attributeStore, coordinates, zoom, data, existingTile, tile, bbox, *lt, sharedData);
 		}
-		outfile.close();
 	}
+
+	// Hand over to the writer to compress and write
+	string outputdata;
+	tile.serialize(outputdata);
+	sharedData.writer->push(zoom, bbox.index, std::move(outputdata));
 }
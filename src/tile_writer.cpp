@@ -0,0 +1,157 @@
+#include "tile_writer.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+static uint64_t nanosecondsSince(const std::chrono::steady_clock::time_point& start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+TileWriter::TileWriter(size_t compressorThreads, size_t capacity, Stage compress, Stage write):
+	capacity(std::max<size_t>(1, capacity)),
+	compress(compress),
+	write(write),
+	nextSequence(0),
+	nextToWrite(0),
+	inFlight(0),
+	finishing(false),
+	finished(false),
+	pushWaitNs(0),
+	compressNs(0),
+	writeNs(0),
+	writerIdleNs(0),
+	tilesWritten(0) {
+	for (size_t i = 0; i < std::max<size_t>(1, compressorThreads); i++)
+		compressors.emplace_back(&TileWriter::compressLoop, this);
+	writer = std::thread(&TileWriter::writeLoop, this);
+}
+
+TileWriter::~TileWriter() {
+	if (finished)
+		return;
+	try {
+		finish();
+	} catch (std::exception& e) {
+		std::cerr << "Error writing tiles: " << e.what() << std::endl;
+	}
+}
+
+void TileWriter::push(unsigned int zoom, TileCoordinates index, std::string&& data) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if (inFlight >= capacity) {
+		const auto start = std::chrono::steady_clock::now();
+		spaceAvailable.wait(lock, [&]() { return inFlight < capacity; });
+		pushWaitNs += nanosecondsSince(start);
+	}
+	if (error)
+		return;
+
+	inFlight++;
+	rendered.push_back({ zoom, index, std::move(data), std::string(), ContentHash({ 0, 0, 0 }), nextSequence++, false });
+	tileRendered.notify_one();
+}
+
+void TileWriter::compressLoop() {
+	while (true) {
+		RenderedTile tile;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			tileRendered.wait(lock, [&]() { return !rendered.empty() || finishing; });
+			if (rendered.empty())
+				return;
+			tile = std::move(rendered.front());
+			rendered.pop_front();
+			// No point compressing once the output is known to be broken
+			if (error)
+				tile.failed = true;
+		}
+
+		if (!tile.failed) {
+			const auto start = std::chrono::steady_clock::now();
+			try {
+				compress(tile);
+			} catch (...) {
+				tile.failed = true;
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+			compressNs += nanosecondsSince(start);
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		const uint64_t sequence = tile.sequence;
+		compressed.emplace(sequence, std::move(tile));
+		if (sequence == nextToWrite)
+			tileCompressed.notify_one();
+	}
+}
+
+void TileWriter::writeLoop() {
+	std::vector<RenderedTile> tiles;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			const auto start = std::chrono::steady_clock::now();
+			tileCompressed.wait(lock, [&]() {
+				return (!compressed.empty() && compressed.begin()->first == nextToWrite) || (finishing && inFlight == 0);
+			});
+			writerIdleNs += nanosecondsSince(start);
+			if (compressed.empty() || compressed.begin()->first != nextToWrite)
+				return;
+
+			// Take every tile that's ready to go in order
+			auto it = compressed.begin();
+			while (it != compressed.end() && it->first == nextToWrite) {
+				tiles.push_back(std::move(it->second));
+				it = compressed.erase(it);
+				nextToWrite++;
+			}
+		}
+
+		const auto start = std::chrono::steady_clock::now();
+		for (RenderedTile& tile : tiles) {
+			if (tile.failed)
+				continue;
+			try {
+				write(tile);
+				tilesWritten++;
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error) error = std::current_exception();
+			}
+		}
+		writeNs += nanosecondsSince(start);
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			inFlight -= tiles.size();
+		}
+		spaceAvailable.notify_all();
+		tiles.clear();
+	}
+}
+
+void TileWriter::finish() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finishing = true;
+	}
+	tileRendered.notify_all();
+	tileCompressed.notify_all();
+
+	for (auto& compressor : compressors)
+		compressor.join();
+	writer.join();
+	finished = true;
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+void TileWriter::reportTimings() const {
+	std::cout << "Wrote " << tilesWritten << " tiles on " << compressors.size() << " compressor thread(s)"
+		<< ": compressing " << (compressNs.load() / 1000000) << "ms"
+		<< ", writing " << (writeNs / 1000000) << "ms"
+		<< ", writer idle " << (writerIdleNs / 1000000) << "ms"
+		<< ", renderers waited " << (pushWaitNs.load() / 1000000) << "ms for the queue" << std::endl;
+}
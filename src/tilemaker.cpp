@@ -12,7 +12,9 @@
 #include <stdexcept>
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
+#include <future>
 
 // Other utilities
 #include <boost/algorithm/string.hpp>
@@ -56,6 +58,7 @@
 #include "tile_worker.h"
 #include "osm_mem_tiles.h"
 #include "shp_mem_tiles.h"
+#include "tile_enumerator.h"
 
 #include <boost/asio/post.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
@@ -74,11 +77,21 @@ namespace geom = boost::geometry;
 // Global verbose switch
 bool verbose = false;
 
-void sortTileCoordinates(
-    const size_t baseZoom,
-    const size_t threadNum,
-    std::deque<std::pair<unsigned int, TileCoordinates>>& tileCoordinates
-);
+// Lua states are slow to create, so reading threads lease them from this pool
+// and return them when the thread exits. States therefore carry over between
+// reading phases and input files.
+std::mutex luaStatesMutex;
+std::vector<std::shared_ptr<OsmLuaProcessing>> availableLuaStates;
+
+struct LuaStateLease {
+	std::shared_ptr<OsmLuaProcessing> state;
+
+	~LuaStateLease() {
+		if (!state) return;
+		std::lock_guard<std::mutex> lock(luaStatesMutex);
+		availableLuaStates.push_back(state);
+	}
+};
 
 /**
  *\brief The Main function is responsible for command line processing, loading data and starting worker threads.
@@ -313,11 +326,21 @@ int main(const int argc, const char* argv[]) {
 				return pbfStream.second;
 			},
 			[&]() {
-				thread_local std::pair<std::string, std::shared_ptr<OsmLuaProcessing>> osmLuaProcessing;
-				if (osmLuaProcessing.first != inputFile) {
-					osmLuaProcessing = std::make_pair(inputFile, std::make_shared<OsmLuaProcessing>(osmStore, config, layers, options.luaFile, shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries, false));
+				thread_local LuaStateLease lease;
+				if (!lease.state) {
+					{
+						std::lock_guard<std::mutex> lock(luaStatesMutex);
+						if (!availableLuaStates.empty()) {
+							lease.state = availableLuaStates.back();
+							availableLuaStates.pop_back();
+						}
+					}
+					if (lease.state)
+						lease.state->attachToThread();
+					else
+						lease.state = std::make_shared<OsmLuaProcessing>(osmStore, config, layers, options.luaFile, shpMemTiles, osmMemTiles, attributeStore, options.osm.materializeGeometries, false);
 				}
-				return osmLuaProcessing.second;
+				return lease.state;
 			},
 			*nodeStore,
 			*wayStore
@@ -328,6 +351,7 @@ int main(const int argc, const char* argv[]) {
 	osmMemTiles.reportSize();
 	attributeStore.reportSize();
 	osmLuaProcessing.dataStore.clear(); // no longer needed
+	availableLuaStates.clear(); // calls exit_function
 
 	// ----	Initialise SharedData
 
@@ -340,16 +364,28 @@ int main(const int argc, const char* argv[]) {
 	// ----	Initialise mbtiles/pmtiles if required
 	
 	if (sharedData.outputMode == OptionsParser::OutputMode::MBTiles) {
-		sharedData.mbtiles.openForWriting(sharedData.outputFile);
+		// A new .mbtiles has each tile written once, so it's quicker to index
+		// it at the end than as we go
+		sharedData.mbtiles.openForWriting(sharedData.outputFile, !sharedData.mergeSqlite, options.deduplicate);
 		sharedData.writeMBTilesProjectData();
 	} else if (sharedData.outputMode == OptionsParser::OutputMode::PMTiles) {
-		sharedData.pmtiles.open(sharedData.outputFile);
+		sharedData.pmtiles.open(sharedData.outputFile, options.clustered);
 	}
 
 	// ----	Write out data
 
 	// Launch the pool with threadNum threads
 	boost::asio::thread_pool pool(options.threadNum);
+	sharedData.threadNum = options.threadNum;
+
+	// Expensive tiles' layer groups are built on their own pool, so that they
+	// don't wait behind the batches queued on the main one. Its threads only
+	// have work while such a tile is being written, which is mostly at z0..z5.
+	std::unique_ptr<boost::asio::thread_pool> layerPool;
+	if (options.threadNum > 1) {
+		layerPool.reset(new boost::asio::thread_pool(options.threadNum - 1));
+		sharedData.layerPool = layerPool.get();
+	}
 
 	// Mutex is hold when IO is performed
 	std::mutex io_mutex;
@@ -357,23 +393,33 @@ int main(const int argc, const char* argv[]) {
 	// Loop through tiles
 	std::atomic<uint64_t> tilesWritten(0), lastTilesWritten(0);
 
-	for (auto source : sources) {
-		source->finalize(options.threadNum);
+	// Sort every source's index at once, as one task per z6 tile
+	{
+		std::vector<std::future<void>> finalizeTasks;
+		for (auto source : sources) {
+			source->finalize(options.threadNum, pool, finalizeTasks);
+		}
+		for (size_t i = 0; i < finalizeTasks.size(); i++) {
+			finalizeTasks[i].get();
+			if (i % 50 == 0 || i + 1 == finalizeTasks.size())
+				std::cout << "\rFinalizing z6 tiles: " << (i + 1) << "/" << finalizeTasks.size() << std::flush;
+		}
+		std::cout << std::endl;
 	}
 	// tiles by zoom level
 
-	// The clipping bbox check is expensive - as an optimization, compute the set of
-	// z6 tiles that are wholly covered by the clipping box. Membership in this
-	// set is quick to test.
-	PreciseTileCoordinatesSet coveredZ6Tiles(6);
+	// The clipping bbox check is expensive - as an optimization, compute the sets of
+	// z6 tiles that are wholly covered by the clipping box, and that are wholly
+	// outside it. Only tiles in neither set need to be checked.
+	PreciseTileCoordinatesSet coveredZ6Tiles(6), outsideZ6Tiles(6);
 	if (hasClippingBox) {
 		for (int x = 0; x < 1 << 6; x++) {
 			for (int y = 0; y < 1 << 6; y++) {
-				if (boost::geometry::within(
-							TileBbox(TileCoordinates(x, y), 6, false, false).getTileBox(),
-							clippingBox
-						))
+				const Box z6Box = TileBbox(TileCoordinates(x, y), 6, false, false).getTileBox();
+				if (boost::geometry::within(z6Box, clippingBox))
 					coveredZ6Tiles.set(x, y);
+				else if (!boost::geometry::intersects(z6Box, clippingBox))
+					outsideZ6Tiles.set(x, y);
 			}
 		}
 	}
@@ -383,8 +429,10 @@ int main(const int argc, const char* argv[]) {
 		std::cout << "Using dense index for .pmtiles" << std::endl;
 		sharedData.pmtiles.isSparse = false;
 	}
+	sharedData.pmtiles.compressionLevel = sharedData.config.compressLevel(sharedData.config.endZoom);
+	sharedData.pmtiles.zstd = sharedData.config.zstd;
+	sharedData.pmtiles.threadNum = options.threadNum;
 
-	std::deque<std::pair<unsigned int, TileCoordinates>> tileCoordinates;
 	std::vector<std::shared_ptr<TileCoordinatesSet>> zoomResults;
 	zoomResults.reserve(sharedData.config.endZoom + 1);
 
@@ -412,80 +460,97 @@ int main(const int argc, const char* argv[]) {
 		zoomResults.emplace_back(std::make_shared<LossyTileCoordinatesSet>(zoom, *zoomResults[14]));
 	}
 
-	std::cout << ", filtering tiles:" << std::flush;
-	for (uint zoom=sharedData.config.startZoom; zoom <= sharedData.config.endZoom; zoom++) {
-		std::cout << " z" << std::to_string(zoom) << std::flush;
+	// Only tiles in z6 tiles on the edge of the clipping box need to be checked
+	// against it individually. If a tile is outside the box, so are its children.
+	auto isInClippingBox = [&](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		if (!hasClippingBox)
+			return true;
+
+		if (zoom >= 6) {
+			TileCoordinate z6x = x / (1 << (zoom - 6));
+			TileCoordinate z6y = y / (1 << (zoom - 6));
+			if (outsideZ6Tiles.test(z6x, z6y))
+				return false;
+			if (coveredZ6Tiles.test(z6x, z6y))
+				return true;
+		}
+
+		return boost::geometry::intersects(TileBbox(TileCoordinates(x, y), zoom, false, false).getTileBox(), clippingBox);
+	};
+
+	// Estimate the z0..z6 tiles' costs from the index, so that the most expensive
+	// tiles are started first and batches are evenly sized.
+	auto estimateTileCost = [&](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		size_t cost = 0;
+		for (auto source : sources)
+			cost += source->estimateTileCost(zoom, TileCoordinates(x, y));
+		return cost;
+	};
+
+	// Tiles are produced as they're written: z0..z5, then clustered depth-first
+	// by z6 tile
+	TileEnumerator tileEnumerator(zoomResults, sharedData.config.startZoom, sharedData.config.endZoom, isInClippingBox, estimateTileCost);
+
+	size_t totalTiles = 0;
+	{
+		std::cout << ", filtering tiles:" << std::flush;
 #ifdef CLOCK_MONOTONIC
 		timespec start, end;
 		clock_gettime(CLOCK_MONOTONIC, &start);
 #endif
-
-		const auto& zoomResult = zoomResults[zoom];
-		int numTiles = 0;
-		for (int x = 0; x < 1 << zoom; x++) {
-			for (int y = 0; y < 1 << zoom; y++) {
-				if (!zoomResult->test(x, y))
-					continue;
-			
-				if (hasClippingBox) {
-					bool isInAWhollyCoveredZ6Tile = false;
-					if (zoom >= 6) {
-						TileCoordinate z6x = x / (1 << (zoom - 6));
-						TileCoordinate z6y = y / (1 << (zoom - 6));
-						isInAWhollyCoveredZ6Tile = coveredZ6Tiles.test(z6x, z6y);
-					}
-
-					if(!isInAWhollyCoveredZ6Tile && !boost::geometry::intersects(TileBbox(TileCoordinates(x, y), zoom, false, false).getTileBox(), clippingBox)) 
-						continue;
-				}
-
-				tileCoordinates.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
-				numTiles++;
-			}
+		const std::vector<size_t> counts = tileEnumerator.count();
+		for (uint zoom=sharedData.config.startZoom; zoom <= sharedData.config.endZoom; zoom++) {
+			std::cout << " z" << std::to_string(zoom) << " (" << counts[zoom] << ")";
+			totalTiles += counts[zoom];
 		}
-
-		std::cout << " (" << numTiles;
 #ifdef CLOCK_MONOTONIC
 		clock_gettime(CLOCK_MONOTONIC, &end);
 		uint64_t tileNs = 1e9 * (end.tv_sec - start.tv_sec) + end.tv_nsec - start.tv_nsec;
-		std::cout << ", " << (uint32_t)(tileNs / 1e6) << "ms";
-
+		std::cout << ": " << (uint32_t)(tileNs / 1e6) << "ms";
 #endif
-		std::cout << ")" << std::flush;
 	}
-	zoomResults.clear();
 
 	std::cout << std::endl;
 
-	// Cluster tiles: breadth-first for z0..z5, depth-first for z6
-	sortTileCoordinates(config.baseZoom, options.threadNum, tileCoordinates);
-
-	std::size_t batchSize = 0;
-	for(std::size_t startIndex = 0; startIndex < tileCoordinates.size(); startIndex += batchSize) {
-		// Compute how many tiles should be assigned to this batch --
-		// higher-zoom tiles are cheaper to compute, lower-zoom tiles more expensive.
-		batchSize = 0;
-		size_t weight = 0;
-		while (weight < 1000 && startIndex + batchSize < tileCoordinates.size()) {
-			const auto& zoom = tileCoordinates[startIndex + batchSize].first;
-			if (zoom > 12)
-				weight++;
-			else if (zoom > 11)
-				weight += 10;
-			else if (zoom > 10)
-				weight += 100;
-			else
-				weight += 1000;
-
-			batchSize++;
+	// Rendered tiles are compressed and written on their own threads, so
+	// that workers don't wait on compression or the output's locks.
+	// Compressing a tile is much cheaper than rendering it, so it gets a
+	// quarter as many threads.
+	sharedData.writer.reset(new TileWriter(
+		std::max(1u, options.threadNum / 4),
+		options.threadNum * 16,
+		[&sharedData](RenderedTile& tile) { sharedData.compressTile(tile); },
+		[&sharedData](RenderedTile& tile) { sharedData.writeTile(tile); }
+	));
+
+	// Files are written on a pool of I/O threads, as each one means several
+	// syscalls that would otherwise hold up the writer thread
+	if (options.outputMode == OptionsParser::OutputMode::File)
+		sharedData.directoryWriter.reset(new DirectoryWriter(sharedData.outputFile, options.threadNum, options.threadNum * 64));
+
+	// Only make batches as the pool is ready for them, so that we never hold
+	// more than a few batches' worth of tiles. The pool's threads share one
+	// queue, so whichever thread is free takes the next batch; as batches are
+	// all about the same estimated cost, no thread is left with a long tail.
+	std::mutex batchMutex;
+	std::condition_variable batchFinished;
+	size_t batchesQueued = 0;
+	const size_t maxBatchesQueued = options.threadNum * 4;
+
+	std::vector<ZoomedTileCoordinates> nextBatch;
+	std::vector<size_t> nextWeights;
+	while (tileEnumerator.next(nextBatch, nextWeights)) {
+		{
+			std::unique_lock<std::mutex> lock(batchMutex);
+			batchFinished.wait(lock, [&]() { return batchesQueued < maxBatchesQueued; });
+			batchesQueued++;
 		}
 
-		boost::asio::post(pool, [=, &tileCoordinates, &pool, &sharedData, &sources, &attributeStore, &io_mutex, &tilesWritten, &lastTilesWritten]() {
+		boost::asio::post(pool, [=, batch = std::move(nextBatch), weights = std::move(nextWeights), &pool, &sharedData, &sources, &attributeStore, &io_mutex, &tilesWritten, &lastTilesWritten, &batchMutex, &batchFinished, &batchesQueued]() {
 			std::vector<std::string> tileTimings;
-			std::size_t endIndex = std::min(tileCoordinates.size(), startIndex + batchSize);
-			for(std::size_t i = startIndex; i < endIndex; ++i) {
-				unsigned int zoom = tileCoordinates[i].first;
-				TileCoordinates coords = tileCoordinates[i].second;
+			for (size_t i = 0; i < batch.size(); i++) {
+				unsigned int zoom = batch[i].first;
+				TileCoordinates coords = batch[i].second;
 
 #ifdef CLOCK_MONOTONIC
 				timespec start, end;
@@ -497,7 +562,7 @@ int main(const int argc, const char* argv[]) {
 				for (auto source : sources) {
 					data.emplace_back(source->getObjectsForTile(sortOrders, zoom, coords));
 				}
-				outputProc(sharedData, sources, attributeStore, data, coords, zoom);
+				outputProc(sharedData, sources, attributeStore, data, coords, zoom, weights[i]);
 
 #ifdef CLOCK_MONOTONIC
 				if (options.logTileTimings) {
@@ -516,42 +581,59 @@ int main(const int argc, const char* argv[]) {
 					std::cout << output << std::endl;
 			}
 
-			tilesWritten += (endIndex - startIndex); 
+			tilesWritten += batch.size(); 
 
 			if (io_mutex.try_lock()) {
 				uint64_t written = tilesWritten.load();
 
-				if (written >= lastTilesWritten + tileCoordinates.size() / 100 || ISATTY) {
+				if (written >= lastTilesWritten + totalTiles / 100 || ISATTY) {
 					lastTilesWritten = written;
 					// Show progress grouped by z6 (or lower)
-					size_t z = tileCoordinates[startIndex].first;
-					size_t x = tileCoordinates[startIndex].second.x;
-					size_t y = tileCoordinates[startIndex].second.y;
+					size_t z = batch.front().first;
+					size_t x = batch.front().second.x;
+					size_t y = batch.front().second.y;
 					if (z > CLUSTER_ZOOM) {
 						x = x / (1 << (z - CLUSTER_ZOOM));
 						y = y / (1 << (z - CLUSTER_ZOOM));
 						z = CLUSTER_ZOOM;
 					}
-					cout << "z" << z << "/" << x << "/" << y << ", writing tile " << written << " of " << tileCoordinates.size() << "               \r" << std::flush;
+					cout << "z" << z << "/" << x << "/" << y << ", writing tile " << written << " of " << totalTiles << "               \r" << std::flush;
 				}
 				io_mutex.unlock();
 			}
+
+			{
+				std::lock_guard<std::mutex> lock(batchMutex);
+				batchesQueued--;
+			}
+			batchFinished.notify_one();
 		});
 	}
-	// Wait for all tasks in the pool to complete.
+	// Wait for all tasks in the pool to complete, then for their tiles to be written.
+	// If that fails, return rather than throw, so that temporary files are
+	// cleaned up as the output is destroyed.
 	pool.join();
-
-	// ----	Close tileset
-
-	if (options.outputMode == OptionsParser::OutputMode::MBTiles) {
-		sharedData.writeMBTilesMetadata(jsonConfig);
-		sharedData.mbtiles.closeForWriting();
-	} else if (options.outputMode == OptionsParser::OutputMode::PMTiles) {
-		sharedData.writePMTilesBounds();
-		std::string metadata = sharedData.pmTilesMetadata(jsonConfig);
-		sharedData.pmtiles.close(metadata);
-	} else {
-		sharedData.writeFileMetadata(jsonConfig);
+	if (layerPool) layerPool->join();
+	try {
+		sharedData.writer->finish();
+		if (sharedData.directoryWriter) sharedData.directoryWriter->finish();
+		if (verbose) sharedData.writer->reportTimings();
+
+		// ----	Close tileset
+
+		if (options.outputMode == OptionsParser::OutputMode::MBTiles) {
+			sharedData.writeMBTilesMetadata(jsonConfig);
+			sharedData.mbtiles.closeForWriting();
+		} else if (options.outputMode == OptionsParser::OutputMode::PMTiles) {
+			sharedData.writePMTilesBounds();
+			std::string metadata = sharedData.pmTilesMetadata(jsonConfig);
+			sharedData.pmtiles.close(metadata);
+		} else {
+			sharedData.writeFileMetadata(jsonConfig);
+		}
+	} catch (std::exception& e) {
+		cerr << "Couldn't write tiles: " << e.what() << endl;
+		return -1;
 	}
 
 #ifndef _MSC_VER
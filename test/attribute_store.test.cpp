@@ -1,6 +1,7 @@
 #include <iostream>
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <thread>
 #include <vector>
 #include "external/minunit.h"
@@ -129,6 +130,109 @@ MU_TEST(test_attribute_store_capacity) {
 	mu_check(caughtException == true);
 }
 
+MU_TEST(test_attribute_pair_store_promotes_hot_pairs) {
+	AttributeStore store;
+	store.reset();
+	AttributePairStore pairs(4);
+
+	// One value is common and the other is seen only once. Nothing is hot
+	// until a sample says so, however much it looks like it might be.
+	protozero::data_view commonValue("Main Street"), rareValue("Side Street");
+	AttributePair common(1, PooledString(&commonValue), 0);
+	AttributePair rare(1, PooledString(&rareValue), 0);
+	AttributePair flag(4, true, 0);
+
+	const uint32_t coldIndex = pairs.addPair(rare);
+	mu_check(coldIndex >= (1 << 16));
+	mu_check(pairs.addPair(flag) >= (1 << 16));
+	for (int block = 0; block < 4; block++) {
+		for (int i = 0; i < 100; i++)
+			mu_check(pairs.addPair(common) >= (1 << 16));
+		pairs.blockDone();
+	}
+
+	// Promotion waits for the end of the phase, when no sets are being made
+	mu_check(pairs.addPair(common) >= (1 << 16));
+	mu_check(pairs.endPhase());
+
+	// The common pair now has a hot index; the rare one keeps its cold index
+	const uint32_t hotIndex = pairs.addPair(common);
+	mu_check(hotIndex < (1 << 16));
+	mu_check(pairs.getPair(hotIndex) == common);
+	mu_check(pairs.addPair(rare) == coldIndex);
+	mu_check(pairs.addPair(flag) >= (1 << 16));
+
+	// The next phase is sampled afresh. A pair common only in it is
+	// promoted when it ends, even if it had fewer blocks than the sample.
+	protozero::data_view wayValue("residential");
+	AttributePair way(2, PooledString(&wayValue), 0);
+	for (int i = 0; i < 100; i++)
+		pairs.addPair(way);
+	pairs.blockDone();
+	mu_check(pairs.addPair(way) >= (1 << 16));
+	mu_check(pairs.endPhase());
+	mu_check(pairs.addPair(way) < (1 << 16));
+	mu_check(pairs.addPair(common) == hotIndex);
+
+	// Once finalized, nothing more is promoted
+	protozero::data_view shapeValue("ocean");
+	AttributePair shape(3, PooledString(&shapeValue), 0);
+	for (int i = 0; i < 100; i++)
+		pairs.addPair(shape);
+	pairs.finalize();
+	mu_check(!pairs.endPhase());
+	mu_check(pairs.addPair(shape) >= (1 << 16));
+}
+
+MU_TEST(test_attribute_store_promoted_sets) {
+	AttributeStore store;
+	store.reset();
+
+	// A set made before its pair is promoted, and the same set made after,
+	// are stored once
+	protozero::data_view street("Main Street"), rare("Side Street");
+	std::vector<AttributeIndex> before;
+	for (int i = 0; i < 100; i++) {
+		AttributeSet set;
+		store.addAttribute(set, "name:xx", street, 0);
+		store.addAttribute(set, "oneway", true, 0);
+		before.push_back(store.add(set));
+	}
+	AttributeSet rareSet;
+	store.addAttribute(rareSet, "name:xx", rare, 0);
+	const AttributeIndex rareIndex = store.add(rareSet);
+	const size_t stored = store.size();
+	store.endPhase();
+
+	AttributeSet after;
+	store.addAttribute(after, "name:xx", street, 0);
+	store.addAttribute(after, "oneway", true, 0);
+	mu_check(after.getPair(0) < (1 << 16) && after.getPair(1) < (1 << 16));
+	mu_check(store.add(after) == before.front());
+
+	AttributeSet rareAfter;
+	store.addAttribute(rareAfter, "name:xx", rare, 0);
+	mu_check(store.add(rareAfter) == rareIndex);
+	mu_check(store.size() == stored);
+
+	// The same holds after a later phase promotes more pairs
+	protozero::data_view way("Residential Road");
+	for (int i = 0; i < 100; i++) {
+		AttributeSet set;
+		store.addAttribute(set, "highway:xx", way, 0);
+		store.add(set);
+	}
+	AttributeSet mixed;
+	store.addAttribute(mixed, "name:xx", rare, 0);
+	store.addAttribute(mixed, "highway:xx", way, 0);
+	const AttributeIndex mixedIndex = store.add(mixed);
+	store.endPhase();
+	AttributeSet mixedAfter;
+	store.addAttribute(mixedAfter, "highway:xx", way, 0);
+	store.addAttribute(mixedAfter, "name:xx", rare, 0);
+	mu_check(store.add(mixedAfter) == mixedIndex);
+}
+
 MU_TEST(test_attribute_key_store_threaded) {
 	AttributeKeyStore keys;
 	const int keyCount = 128;
@@ -160,11 +264,65 @@ MU_TEST(test_attribute_key_store_threaded) {
 	mu_check(failed.load(std::memory_order_acquire) == false);
 }
 
+// Benchmark a load like the Ways phase: many threads adding attribute sets
+// for roads, which share a few hot pairs (highway=residential, oneway=true)
+// and many cold ones (names). Prints timings; checks that every thread got
+// the same index for the same set.
+MU_TEST(test_attribute_store_ways_benchmark) {
+	AttributeStore store;
+	store.reset();
+	const unsigned int threadCount = std::max(2u, std::thread::hardware_concurrency());
+	const int waysPerThread = 100000;
+	const int names = 20000;
+	const std::vector<std::string> highways = { "residential", "service", "track", "footway", "primary", "secondary", "tertiary", "unclassified" };
+	std::vector<std::string> nameValues;
+	for (int i = 0; i < names; i++)
+		nameValues.push_back("Street number " + std::to_string(i));
+
+	std::atomic<bool> start(false);
+	std::vector<std::vector<AttributeIndex>> indexes(threadCount, std::vector<AttributeIndex>(names));
+	std::vector<std::thread> threads;
+	for (unsigned int thread = 0; thread < threadCount; thread++) {
+		threads.emplace_back([&, thread]() {
+			while (!start.load(std::memory_order_acquire)) {}
+			for (int i = 0; i < waysPerThread; i++) {
+				const int way = (i * 7919 + thread * 104729) % names;
+				AttributeSet attributes;
+				const std::string& highway = highways[way % highways.size()];
+				store.addAttribute(attributes, "highway", protozero::data_view(highway.data(), highway.size()), 0);
+				const std::string& name = nameValues[way];
+				store.addAttribute(attributes, "name", protozero::data_view(name.data(), name.size()), 12);
+				store.addAttribute(attributes, "oneway", way % 3 == 0, 0);
+				store.addAttribute(attributes, "maxspeed", 30 + 10 * (way % 5), 0);
+				indexes[thread][way] = store.add(attributes);
+			}
+		});
+	}
+
+	auto startTime = std::chrono::steady_clock::now();
+	start.store(true, std::memory_order_release);
+	for (std::thread& thread : threads)
+		thread.join();
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	std::cout << std::endl << "attribute store: " << threadCount << " threads added " << (threadCount * waysPerThread) << " ways' attributes in " << ms << " ms" << std::endl;
+
+	mu_check(store.size() == names);
+	bool consistent = true;
+	for (int way = 0; way < names; way++)
+		for (unsigned int thread = 1; thread < threadCount; thread++)
+			if (indexes[thread][way] != indexes[0][way]) consistent = false;
+	mu_check(consistent);
+	mu_check(store.getUnsafe(indexes[0][42]).size() == 4);
+}
+
 MU_TEST_SUITE(test_suite_attribute_store) {
 	MU_RUN_TEST(test_attribute_store);
 	MU_RUN_TEST(test_attribute_store_reuses);
 	MU_RUN_TEST(test_attribute_store_capacity);
+	MU_RUN_TEST(test_attribute_pair_store_promotes_hot_pairs);
+	MU_RUN_TEST(test_attribute_store_promoted_sets);
 	MU_RUN_TEST(test_attribute_key_store_threaded);
+	MU_RUN_TEST(test_attribute_store_ways_benchmark);
 }
 
 int main() {
@@ -0,0 +1,113 @@
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "external/minunit.h"
+#include "concurrent_index_map.h"
+
+typedef ConcurrentIndexMap<std::string, std::hash<std::string>> StringIndexMap;
+
+MU_TEST(test_concurrent_index_map) {
+	StringIndexMap strs;
+
+	mu_check(strs.size() == 0);
+	mu_check(!strs.full());
+	mu_check(strs.find("foo") == -1);
+	mu_check(strs.add("foo") == 0);
+	mu_check(!strs.full());
+	mu_check(strs.find("foo") == 0);
+	mu_check(strs.size() == 1);
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.size() == 1);
+	mu_check(strs.add("bar") == 1);
+	mu_check(strs.size() == 2);
+	mu_check(strs.add("aardvark") == 2);
+	mu_check(strs.size() == 3);
+	mu_check(strs.add("foo") == 0);
+	mu_check(strs.add("bar") == 1);
+	mu_check(strs.add("quux") == 3);
+	mu_check(strs.size() == 4);
+
+	mu_check(strs.at(0) == "foo");
+	mu_check(strs[0] == "foo");
+	mu_check(strs.at(3) == "quux");
+	mu_check(strs[3] == "quux");
+
+	// Iterates in insertion order
+	std::vector<std::string> rv;
+	for (std::string x : strs) {
+		rv.push_back(x);
+	}
+	mu_check(rv[0] == "foo");
+	mu_check(rv[1] == "bar");
+	mu_check(rv[2] == "aardvark");
+	mu_check(rv[3] == "quux");
+
+	// Grow through several tables and segments; references stay valid
+	const std::string& foo = strs[0];
+	for (int i = 0; i < 100000; i++)
+		mu_check(strs.add(std::to_string(i)) == i + 4);
+	mu_check(strs.size() == 100004);
+	mu_check(&strs[0] == &foo);
+	for (int i = 0; i < 100000; i += 997)
+		mu_check(strs.find(std::to_string(i)) == i + 4);
+
+	StringIndexMap boundedMap(1);
+	mu_check(!boundedMap.full());
+	mu_check(boundedMap.add("foo") == 0);
+	mu_check(boundedMap.add("foo") == 0);
+	mu_check(boundedMap.full());
+	mu_check(boundedMap.add("bar") == -1);
+	boundedMap.clear();
+	mu_check(!boundedMap.full());
+	mu_check(boundedMap.find("foo") == -1);
+	mu_check(boundedMap.add("bar") == 0);
+	mu_check(boundedMap.add("bar") == 0);
+	mu_check(boundedMap.full());
+}
+
+MU_TEST(test_concurrent_index_map_threaded) {
+	// Every thread adds the same values in a different order; each value must
+	// get a single index, and that index must find it again.
+	StringIndexMap strs;
+	const int valueCount = 50000;
+	const int threadCount = 8;
+	std::vector<std::vector<int32_t>> indexes(threadCount, std::vector<int32_t>(valueCount));
+	std::atomic<bool> start(false);
+	std::vector<std::thread> threads;
+
+	for (int thread = 0; thread < threadCount; thread++) {
+		threads.emplace_back([&, thread]() {
+			while (!start.load(std::memory_order_acquire)) {}
+			for (int i = 0; i < valueCount; i++) {
+				const int value = (i * 7919 + thread * 104729) % valueCount;
+				indexes[thread][value] = strs.add(std::to_string(value));
+			}
+		});
+	}
+
+	start.store(true, std::memory_order_release);
+	for (std::thread& thread : threads)
+		thread.join();
+
+	mu_check(strs.size() == valueCount);
+	bool consistent = true;
+	for (int value = 0; value < valueCount; value++) {
+		const int32_t index = indexes[0][value];
+		for (int thread = 1; thread < threadCount; thread++)
+			if (indexes[thread][value] != index) consistent = false;
+		if (strs[index] != std::to_string(value)) consistent = false;
+	}
+	mu_check(consistent);
+}
+
+MU_TEST_SUITE(test_suite_concurrent_index_map) {
+	MU_RUN_TEST(test_concurrent_index_map);
+	MU_RUN_TEST(test_concurrent_index_map_threaded);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_concurrent_index_map);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,184 @@
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include "external/minunit.h"
+#include "data_store.h"
+
+MU_TEST(test_data_store) {
+	DataStore store;
+	DataValue value;
+	mu_check(!store.get("missing", value));
+
+	store.set("name", DataValue("Bill"));
+	mu_check(store.get("name", value));
+	mu_check(value.type == DataValue::Type::String);
+	mu_check(value.string == "Bill");
+
+	DataValue number;
+	number.type = DataValue::Type::Number;
+	number.number = 1.5;
+	store.set("number", number);
+	mu_check(store.size() == 2);
+
+	store.endPhase();
+	mu_check(store.size() == 2);
+	mu_check(store.get("number", value));
+	mu_check(value.type == DataValue::Type::Number);
+	mu_check(value.number == 1.5);
+
+	// Pending values take precedence over committed ones
+	store.set("name", DataValue("Ben"));
+	mu_check(store.size() == 2);
+	mu_check(store.get("name", value));
+	mu_check(value.string == "Ben");
+	store.endPhase();
+	mu_check(store.get("name", value));
+	mu_check(value.string == "Ben");
+
+	auto table = std::make_shared<DataTable>();
+	table->keys.push_back(DataValue("a"));
+	table->values.push_back(number);
+	DataValue tableValue;
+	tableValue.type = DataValue::Type::Table;
+	tableValue.table = table;
+	store.set("table", tableValue);
+	mu_check(store.get("table", value));
+	mu_check(value.type == DataValue::Type::Table);
+	mu_check(value.table->keys.size() == 1);
+	mu_check(value.table->values[0].number == 1.5);
+
+	store.clear();
+	mu_check(store.size() == 0);
+	mu_check(!store.get("name", value));
+}
+
+MU_TEST(test_data_store_threads) {
+	DataStore store;
+	const unsigned int threadCount = 8, keysPerThread = 5000;
+
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&store, t]() {
+			for (unsigned int i = 0; i < keysPerThread; i++)
+				store.set(std::to_string(t) + ":" + std::to_string(i), DataValue(std::to_string(i)));
+		});
+	}
+	for (auto& thread : threads) thread.join();
+	mu_check(store.size() == threadCount * keysPerThread);
+
+	store.endPhase();
+	DataValue value;
+	mu_check(store.get("3:1234", value));
+	mu_check(value.string == "1234");
+}
+
+// Structured keys that only differ in a few characters, read and written
+// from many threads, must give the same results as a single map.
+MU_TEST(test_data_store_matches_map) {
+	const unsigned int threadCount = 8, keys = 20000;
+	auto keyFor = [](unsigned int i) { return "route_" + std::to_string(i) + "_name"; };
+
+	DataStore store;
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			for (unsigned int i = t; i < keys; i += threadCount) {
+				store.set(keyFor(i), DataValue(std::to_string(i)));
+				DataValue value;
+				store.get(keyFor((i * 7919) % keys), value);
+			}
+		});
+	}
+	for (auto& thread : threads) thread.join();
+
+	std::unordered_map<std::string, DataValue> map;
+	for (unsigned int i = 0; i < keys; i++)
+		map[keyFor(i)] = DataValue(std::to_string(i));
+
+	auto matches = [&]() {
+		if (store.size() != map.size()) return false;
+		for (const auto& entry : map) {
+			DataValue value;
+			if (!store.get(entry.first, value) || value.string != entry.second.string) return false;
+		}
+		DataValue value;
+		return !store.get(keyFor(keys), value);
+	};
+	mu_check(matches());
+	store.endPhase();
+	mu_check(matches());
+}
+
+// Compare reads and writes against a single map behind one mutex, which is
+// what SetData/GetData used before. Prints timings.
+template<typename Set, typename Get>
+double timeThreads(unsigned int threadCount, unsigned int keys, Set set, Get get) {
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (unsigned int t = 0; t < threadCount; t++) {
+		threads.emplace_back([&, t]() {
+			for (unsigned int i = 0; i < keys; i++) {
+				std::string key = "route_" + std::to_string((i * 7919 + t) % keys) + "_name";
+				if (i % 16 == 0) set(key);
+				else get(key);
+			}
+		});
+	}
+	for (auto& thread : threads) thread.join();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+MU_TEST(test_data_store_contention) {
+	const unsigned int threadCount = std::max(2u, std::thread::hardware_concurrency());
+	const unsigned int keys = 200000;
+
+	std::mutex mutex;
+	std::unordered_map<std::string, DataValue> map;
+	double locked = timeThreads(threadCount, keys,
+		[&](const std::string& key) { std::lock_guard<std::mutex> lock(mutex); map[key] = DataValue(key); },
+		[&](const std::string& key) {
+			DataValue value;
+			std::lock_guard<std::mutex> lock(mutex);
+			auto it = map.find(key);
+			if (it != map.end()) value = it->second;
+		});
+
+	DataStore store;
+	double sharded = timeThreads(threadCount, keys,
+		[&](const std::string& key) { store.set(key, DataValue(key)); },
+		[&](const std::string& key) { DataValue value; store.get(key, value); });
+
+	// After the phase ends, reads take no locks. The map is no longer
+	// written, so each read can be checked against it.
+	store.endPhase();
+	std::atomic<size_t> mismatches(0);
+	auto check = [&](const std::string& key) {
+		DataValue value;
+		const bool found = store.get(key, value);
+		if (found != (map.find(key) != map.end()) || (found && value.string != key)) mismatches++;
+	};
+	double committed = timeThreads(threadCount, keys, check, check);
+
+	std::cout << std::endl << "data store, " << threadCount << " threads: single mutex " << locked << " ms"
+		<< ", sharded " << sharded << " ms, sharded after endPhase " << committed << " ms" << std::endl;
+
+	// Both hold the same keys
+	mu_check(store.size() == map.size());
+	mu_check(mismatches == 0);
+}
+
+MU_TEST_SUITE(test_suite_data_store) {
+	MU_RUN_TEST(test_data_store);
+	MU_RUN_TEST(test_data_store_threads);
+	MU_RUN_TEST(test_data_store_matches_map);
+	MU_RUN_TEST(test_data_store_contention);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_data_store);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <boost/filesystem.hpp>
+#include "external/minunit.h"
+#include "directory_writer.h"
+
+std::string readFile(const std::string& filename) {
+	std::ifstream input(filename, std::ios::in | std::ios::binary);
+	std::stringstream buffer;
+	buffer << input.rdbuf();
+	return buffer.str();
+}
+
+MU_TEST(test_directory_writer) {
+	const std::string root = "test.directory_writer.tmp";
+	boost::filesystem::remove_all(root);
+
+	{
+		DirectoryWriter writer(root, 4, 8);
+
+		// Two writers push 300 tiles each, spread over a few zoom/x directories
+		std::vector<std::thread> writers;
+		for (unsigned int t = 0; t < 2; t++)
+			writers.emplace_back([&writer, t]() {
+				for (unsigned int i = 0; i < 300; i++)
+					writer.write(13 + t, TileCoordinates(i % 7, i), "tile " + std::to_string(t) + "/" + std::to_string(i));
+			});
+		for (auto& w : writers)
+			w.join();
+
+		writer.finish();
+	}
+
+	bool allWritten = true;
+	for (unsigned int t = 0; t < 2; t++)
+		for (unsigned int i = 0; i < 300; i++) {
+			std::stringstream filename;
+			filename << root << "/" << (13 + t) << "/" << (i % 7) << "/" << i << ".pbf";
+			if (readFile(filename.str()) != "tile " + std::to_string(t) + "/" + std::to_string(i)) allWritten = false;
+		}
+	mu_check(allWritten);
+
+	boost::filesystem::remove_all(root);
+}
+
+MU_TEST(test_directory_writer_errors) {
+	// The root is a file, so no directories can be made under it
+	const std::string root = "test.directory_writer.tmp";
+	boost::filesystem::remove_all(root);
+	std::ofstream(root) << "not a directory";
+
+	DirectoryWriter writer(root, 2, 4);
+	for (unsigned int i = 0; i < 20; i++)
+		writer.write(14, TileCoordinates(i, i), "tile");
+
+	bool threw = false;
+	try {
+		writer.finish();
+	} catch (std::exception&) {
+		threw = true;
+	}
+	mu_check(threw);
+
+	boost::filesystem::remove_all(root);
+}
+
+MU_TEST_SUITE(test_suite_directory_writer) {
+	MU_RUN_TEST(test_directory_writer);
+	MU_RUN_TEST(test_directory_writer_errors);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_directory_writer);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
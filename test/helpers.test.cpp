@@ -81,11 +81,67 @@ MU_TEST(test_compression_zlib) {
 	mu_check(unzipped == input);
 }
 
+MU_TEST(test_compression_levels) {
+	std::string input;
+	for (int i = 0; i < 1000; i++) input += std::to_string(i * i % 97) + " ";
+
+	// Switching between levels gives the same output as sticking to one
+	std::string fast = compress_string(input, 1, true), best = compress_string(input, 12, true);
+	for (int i = 0; i < 4; i++) {
+		mu_check(compress_string(input, 1, true) == fast);
+		mu_check(compress_string(input, 12, true) == best);
+	}
+	mu_check(best.size() <= fast.size());
+
+	bool threw = false;
+	try { compress_string(input, 13, true); } catch (std::runtime_error&) { threw = true; }
+	mu_check(threw);
+}
+
+#ifdef TM_ZSTD
+MU_TEST(test_compression_zstd) {
+	std::string input;
+	for (int i = 0; i < 1000; i++) input += std::to_string(i * i % 97) + " ";
+
+	for (int level : { -1, 1, 3, 19, 22 }) {
+		std::string compressed = compress_zstd(input, level);
+		std::string uncompressed;
+		decompress_zstd(uncompressed, compressed.data(), compressed.size());
+		mu_check(uncompressed == input);
+	}
+}
+#endif
+
+MU_TEST(test_content_hash) {
+	// MurmurHash3 x64 128-bit, seed 0, and CRC-32
+	mu_check(contentHash("") == ContentHash({ 0, 0, 0 }));
+	mu_check(contentHash("hello") == ContentHash({ 0xcbd8a7b341bd9b02ULL, 0x5b1e906a48ae1d19ULL, 0x3610a686 }));
+	mu_check(contentHash("hello").hex() == "5b1e906a48ae1d19cbd8a7b341bd9b023610a686");
+
+	// The two hashes are checked independently
+	ContentHash hash = contentHash("hello");
+	hash.crc ^= 1;
+	mu_check(hash != contentHash("hello"));
+
+	// Every length of tail, and more than one block
+	std::string data = "The quick brown fox jumps over the lazy dog";
+	bool distinct = true;
+	for (size_t i = 1; i <= data.size(); i++) {
+		if (contentHash(data.substr(0, i)) == contentHash(data.substr(0, i - 1))) distinct = false;
+		if (contentHash(data.substr(0, i)) != contentHash(std::string(data.substr(0, i)))) distinct = false;
+	}
+	mu_check(distinct);
+}
 
 MU_TEST_SUITE(test_suite_helpers) {
 	MU_RUN_TEST(test_get_chunks);
 	MU_RUN_TEST(test_compression_gzip);
 	MU_RUN_TEST(test_compression_zlib);
+	MU_RUN_TEST(test_compression_levels);
+#ifdef TM_ZSTD
+	MU_RUN_TEST(test_compression_zstd);
+#endif
+	MU_RUN_TEST(test_content_hash);
 }
 
 int main() {
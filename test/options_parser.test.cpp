@@ -69,6 +69,23 @@ MU_TEST(test_options_parser) {
 		mu_check(!opts.osm.shardStores);
 	}
 
+	// --dedup stores identical tiles once
+	{
+		std::vector<std::string> args = {"--output", "foo.mbtiles", "--input", "ontario.pbf", "--dedup"};
+		auto opts = parse(args);
+		mu_check(opts.outputMode == OutputMode::MBTiles);
+		mu_check(opts.deduplicate);
+		mu_check(!opts.mergeSqlite);
+	}
+
+	// --cluster writes .pmtiles in tile ID order
+	{
+		std::vector<std::string> args = {"--output", "foo.pmtiles", "--input", "ontario.pbf", "--cluster"};
+		auto opts = parse(args);
+		mu_check(opts.outputMode == OutputMode::PMTiles);
+		mu_check(opts.clustered);
+	}
+
 	// --store should optimize for reduced memory
 	{
 		std::vector<std::string> args = {"--output", "foo.mbtiles", "--input", "ontario.pbf", "--store", "/tmp/store"};
@@ -0,0 +1,199 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <map>
+#include "external/minunit.h"
+#include "pmtiles.h"
+
+MU_TEST(test_pmtiles_deduplication) {
+	std::string filename = "test.pmtiles.tmp";
+	PMTiles pmtiles;
+	pmtiles.open(filename, false);
+
+	// Every z8 tile is sea, apart from a diagonal of land that's unique per tile;
+	// the sea tile is big enough that only a content hash would dedupe it
+	std::string sea = compress_string(std::string(2000, 's'), Z_DEFAULT_COMPRESSION, true);
+	sea += std::string(500, '~');
+	size_t landTiles = 0, landBytes = 0;
+	for (int x = 0; x < 256; x++) {
+		for (int y = 0; y < 256; y++) {
+			if (x == y) {
+				std::string land = "land " + std::to_string(x);
+				pmtiles.saveTile(8, x, y, land, contentHash(land));
+				landTiles++;
+				landBytes += land.size();
+			} else {
+				pmtiles.saveTile(8, x, y, sea, contentHash(sea));
+			}
+		}
+	}
+
+	std::string metadata = "{}";
+	pmtiles.close(metadata);
+	std::remove(filename.c_str());
+
+	mu_check(pmtiles.header.addressed_tiles_count == 256 * 256);
+	mu_check(pmtiles.header.tile_contents_count == landTiles + 1);
+	mu_check(pmtiles.header.tile_data_bytes == sea.size() + landBytes);
+	// Runs of sea between the land tiles collapse into a few directory entries
+	mu_check(pmtiles.header.tile_entries_count < 256 * 256 / 10);
+}
+
+MU_TEST(test_pmtiles_clustered) {
+	// From both indexes
+	for (bool isSparse : { true, false }) {
+		std::string filename = "test.pmtiles.tmp";
+		PMTiles pmtiles;
+		pmtiles.isSparse = isSparse;
+		pmtiles.open(filename, true);
+
+		// Write z0-z7 from the highest zoom down, with every third tile the same
+		std::map<uint64_t, std::string> tiles;
+		for (int zoom = 7; zoom >= 0; zoom--) {
+			for (int x = 0; x < (1 << zoom); x++) {
+				for (int y = 0; y < (1 << zoom); y++) {
+					std::string tile = (x + y) % 3 == 0 ? "sea" : std::to_string(zoom) + "/" + std::to_string(x) + "/" + std::to_string(y);
+					pmtiles.saveTile(zoom, x, y, tile, contentHash(tile));
+					tiles[pmtiles::zxy_to_tileid(zoom, x, y)] = tile;
+				}
+			}
+		}
+
+		std::string metadata = "{}";
+		pmtiles.close(metadata);
+		mu_check(pmtiles.header.clustered);
+		mu_check(!std::ifstream(filename + ".7.tiles"));
+
+		std::ifstream input(filename, std::ios::in | std::ios::binary);
+		std::stringstream buffer;
+		buffer << input.rdbuf();
+		input.close();
+		std::remove(filename.c_str());
+		const std::string archive = buffer.str();
+
+		auto decompress = [](const std::string &compressed, uint8_t) {
+			std::string output;
+			decompress_string(output, compressed.data(), compressed.size(), true);
+			return output;
+		};
+		std::map<uint64_t, pmtiles::entry_zxy> entries;
+		for (auto &entry : pmtiles::entries_tms(decompress, archive.data()))
+			entries.emplace(pmtiles::zxy_to_tileid(entry.z, entry.x, entry.y), entry);
+		mu_check(entries.size() == tiles.size());
+
+		// Every tile reads back, and in tile ID order, each tile is either
+		// a repeat or the next one in the file
+		bool allFound = true, allMatch = true, clustered = true;
+		uint64_t next = pmtiles.header.tile_data_offset;
+		for (auto &it : tiles) {
+			auto entry = entries.find(it.first);
+			if (entry == entries.end()) { allFound = false; continue; }
+			const pmtiles::entry_zxy &tile = entry->second;
+			if (archive.substr(tile.offset, tile.length) != it.second) allMatch = false;
+			if (tile.offset == next) next += tile.length;
+			else if (tile.offset > next) clustered = false;
+		}
+		mu_check(allFound);
+		mu_check(allMatch);
+		mu_check(clustered);
+		mu_check(next == pmtiles.header.tile_data_offset + pmtiles.header.tile_data_bytes);
+	}
+}
+
+MU_TEST(test_pmtiles_clustered_abort) {
+	// The spill files go if the archive is never closed
+	std::string filename = "test.pmtiles.tmp";
+	{
+		PMTiles pmtiles;
+		pmtiles.open(filename, true);
+		std::string tile = "land";
+		pmtiles.saveTile(0, 0, 0, tile, contentHash(tile));
+		pmtiles.saveTile(7, 1, 1, tile + "7", contentHash(tile + "7"));
+		mu_check(static_cast<bool>(std::ifstream(filename + ".7.tiles")));
+	}
+	mu_check(!std::ifstream(filename + ".0.tiles"));
+	mu_check(!std::ifstream(filename + ".7.tiles"));
+	std::remove(filename.c_str());
+}
+
+// Writes z0-z8 with long runs of sea, and returns the archive
+std::string writeArchive(bool isSparse, unsigned int threadNum, uint64_t leafTileIds = LEAF_DIRECTORY_SIZE) {
+	std::string filename = "test.pmtiles.tmp";
+	PMTiles pmtiles;
+	pmtiles.isSparse = isSparse;
+	pmtiles.threadNum = threadNum;
+	pmtiles.leafTileIds = leafTileIds;
+	pmtiles.open(filename, false);
+	for (int zoom = 0; zoom <= 8; zoom++) {
+		for (int x = 0; x < (1 << zoom); x++) {
+			for (int y = 0; y < (1 << zoom); y++) {
+				if (zoom == 8 && x % 16 == 15) continue;
+				std::string tile = x % 5 == 0 ? std::to_string(zoom) + "/" + std::to_string(x) + "/" + std::to_string(y) : "sea";
+				pmtiles.saveTile(zoom, x, y, tile, contentHash(tile));
+			}
+		}
+	}
+	std::string metadata = "{}";
+	pmtiles.close(metadata);
+
+	std::ifstream input(filename, std::ios::in | std::ios::binary);
+	std::stringstream buffer;
+	buffer << input.rdbuf();
+	input.close();
+	std::remove(filename.c_str());
+	return buffer.str();
+}
+
+MU_TEST(test_pmtiles_directories) {
+	// Building the directories from the dense index on several threads
+	// gives the same archive as building them from the sparse one
+	const std::string sparse = writeArchive(true, 1);
+	mu_check(writeArchive(false, 1) == sparse);
+	mu_check(writeArchive(false, 3) == sparse);
+	mu_check(writeArchive(false, 16) == sparse);
+
+	std::string header_s{sparse.data(), 127};
+	auto header = pmtiles::deserialize_header(header_s);
+	mu_check(header.addressed_tiles_count == 21845 + 65536 - 4096);
+	mu_check(header.tile_entries_count >= ROOT_ONLY);
+	mu_check(header.leaf_dirs_bytes > 0);
+
+	// With small leaves, they're built over several windows, and runs of sea
+	// carry on over the joins between them
+	const std::string small = writeArchive(true, 1, 5000);
+	mu_check(writeArchive(false, 1, 5000) == small);
+	mu_check(writeArchive(false, 3, 5000) == small);
+	mu_check(writeArchive(false, 16, 5000) == small);
+
+	header_s = std::string(small.data(), 127);
+	header = pmtiles::deserialize_header(header_s);
+	mu_check(header.tile_entries_count == pmtiles::deserialize_header(std::string(sparse.data(), 127)).tile_entries_count);
+	auto decompress = [](const std::string &compressed, uint8_t) {
+		std::string output;
+		decompress_string(output, compressed.data(), compressed.size(), true);
+		return output;
+	};
+	size_t found = 0;
+	bool allMatch = true;
+	for (auto &entry : pmtiles::entries_tms(decompress, small.data())) {
+		found++;
+		const std::string expected = entry.x % 5 == 0 ? std::to_string(entry.z) + "/" + std::to_string(entry.x) + "/" + std::to_string(entry.y) : "sea";
+		if (small.substr(entry.offset, entry.length) != expected) allMatch = false;
+	}
+	mu_check(found == header.addressed_tiles_count);
+	mu_check(allMatch);
+}
+
+MU_TEST_SUITE(test_suite_pmtiles) {
+	MU_RUN_TEST(test_pmtiles_deduplication);
+	MU_RUN_TEST(test_pmtiles_clustered);
+	MU_RUN_TEST(test_pmtiles_clustered_abort);
+	MU_RUN_TEST(test_pmtiles_directories);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_pmtiles);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,125 @@
+#include <iostream>
+#include <cmath>
+#include <random>
+#include "external/minunit.h"
+#include "prepared_geometry.h"
+
+// A star-shaped polygon with a hole, plus a separate island
+MultiPolygon testMultiPolygon() {
+	MultiPolygon mp;
+	Polygon star;
+	const unsigned int spikes = 300;
+	for (unsigned int i = 0; i < spikes * 2; i++) {
+		double angle = -M_PI * i / spikes;
+		double r = (i % 2 == 0) ? 1.0 : 0.6;
+		star.outer().push_back(Point(10.0 + r * cos(angle), 50.0 + r * sin(angle)));
+	}
+	star.outer().push_back(star.outer().front());
+	star.inners().resize(1);
+	star.inners()[0] = { Point(9.9, 49.9), Point(10.1, 49.9), Point(10.1, 50.1), Point(9.9, 50.1), Point(9.9, 49.9) };
+	geom::correct(star);
+	mp.push_back(star);
+
+	Polygon island;
+	island.outer() = { Point(12.0, 50.0), Point(12.0, 50.5), Point(12.5, 50.5), Point(12.5, 50.0), Point(12.0, 50.0) };
+	geom::correct(island);
+	mp.push_back(island);
+	return mp;
+}
+
+// The rings of a multipolygon, as lines
+MultiLinestring boundaryOf(const MultiPolygon& mp) {
+	MultiLinestring boundary;
+	for (const auto& polygon : mp) {
+		boundary.emplace_back(polygon.outer().begin(), polygon.outer().end());
+		for (const auto& inner : polygon.inners())
+			boundary.emplace_back(inner.begin(), inner.end());
+	}
+	return boundary;
+}
+
+// prepared.coveredBy(g), falling back to boost where it isn't certain, as
+// ShpMemTiles::indexedCovers does
+template <typename GeometryT>
+bool resolvedCoveredBy(const PreparedMultiPolygon& prepared, const GeometryT& g, const MultiPolygon& mp, bool& certain) {
+	bool covered = prepared.coveredBy(g, certain);
+	return certain ? covered : geom::covered_by(g, mp);
+}
+
+MU_TEST(test_prepared_points) {
+	MultiPolygon mp = testMultiPolygon();
+	PreparedMultiPolygon prepared(mp, 15);
+
+	// The first pass fills the cell cache, the second is answered from it
+	for (int pass = 0; pass < 2; pass++) {
+		std::mt19937 rng(1);
+		std::uniform_real_distribution<double> lon(8.5, 13.0), latp(48.5, 51.5);
+		for (int i = 0; i < 20000; i++) {
+			Point p(lon(rng), latp(rng));
+			mu_check(prepared.intersects(p) == geom::intersects(p, mp));
+			bool certain;
+			mu_check(prepared.coveredBy(p, certain) == geom::covered_by(p, mp) && certain);
+		}
+	}
+
+	// Points on the boundary count as intersecting
+	mu_check(prepared.intersects(Point(12.0, 50.25)));
+	mu_check(prepared.intersects(mp[0].outer()[0]));
+	// Points in the hole don't
+	mu_check(!prepared.intersects(Point(10.0, 50.0)));
+}
+
+MU_TEST(test_prepared_lines_and_polygons) {
+	MultiPolygon mp = testMultiPolygon();
+	PreparedMultiPolygon prepared(mp, 15);
+
+	const MultiLinestring boundary = boundaryOf(mp);
+
+	// The first pass fills the cell cache, the second is answered from it
+	for (int pass = 0; pass < 2; pass++) {
+		std::mt19937 rng(2);
+		std::uniform_real_distribution<double> lon(8.5, 13.0), latp(48.5, 51.5), size(0.0001, 0.05);
+		for (int i = 0; i < 5000; i++) {
+			double x = lon(rng), y = latp(rng), w = size(rng), h = size(rng);
+
+			Linestring ls = { Point(x, y), Point(x + w, y + h), Point(x + w, y) };
+			mu_check(prepared.intersects(ls) == geom::intersects(ls, mp));
+			bool certain;
+			mu_check(resolvedCoveredBy(prepared, ls, mp, certain) == geom::covered_by(ls, mp));
+			// Only geometries that meet the boundary should need the fallback
+			mu_check(certain || geom::intersects(ls, boundary));
+
+			Polygon polygon;
+			polygon.outer() = { Point(x, y), Point(x, y + h), Point(x + w, y + h), Point(x + w, y), Point(x, y) };
+			mu_check(prepared.intersects(polygon) == geom::intersects(polygon, mp));
+			mu_check(resolvedCoveredBy(prepared, polygon, mp, certain) == geom::covered_by(polygon, mp));
+			mu_check(certain || geom::intersects(polygon, boundary));
+		}
+	}
+
+	// A polygon around the whole island intersects it, but isn't covered
+	Polygon around;
+	around.outer() = { Point(11.9, 49.9), Point(11.9, 50.6), Point(12.6, 50.6), Point(12.6, 49.9), Point(11.9, 49.9) };
+	geom::correct(around);
+	bool certain;
+	mu_check(prepared.intersects(around));
+	mu_check(!prepared.coveredBy(around, certain) && certain);
+
+	// A polygon inside the star, around the hole, isn't covered either
+	Polygon aroundHole;
+	aroundHole.outer() = { Point(9.8, 49.8), Point(9.8, 50.2), Point(10.2, 50.2), Point(10.2, 49.8), Point(9.8, 49.8) };
+	geom::correct(aroundHole);
+	mu_check(!prepared.coveredBy(aroundHole, certain) && certain);
+	mu_check(geom::covered_by(aroundHole, mp) == false);
+}
+
+MU_TEST_SUITE(test_suite_prepared_geometry) {
+	MU_RUN_TEST(test_prepared_points);
+	MU_RUN_TEST(test_prepared_lines_and_polygons);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_prepared_geometry);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -1,4 +1,5 @@
 #include <iostream>
+#include <set>
 #include "external/minunit.h"
 #include "tile_coordinates_set.h"
 
@@ -47,8 +48,61 @@ MU_TEST(test_tile_coordinates_set) {
 	}
 }
 
+MU_TEST(test_tile_coordinates_set_containers) {
+	// Enough tiles in one z6 tile to switch its container to a bitmap,
+	// plus a few scattered elsewhere
+	PreciseTileCoordinatesSet z14(14);
+	std::set<std::pair<TileCoordinate, TileCoordinate>> expected;
+	for (TileCoordinate x = 256; x < 512; x++) {
+		for (TileCoordinate y = 0; y < 256; y += 3) {
+			z14.set(x, y);
+			expected.insert(std::make_pair(x, y));
+		}
+	}
+	for (TileCoordinate i = 0; i < 100; i++) {
+		z14.set(16383 - i * 97, i * 163);
+		expected.insert(std::make_pair(16383 - i * 97, i * 163));
+	}
+
+	// Setting a tile twice, or one outside the zoom, changes nothing
+	z14.set(256, 0);
+	z14.set(16384, 0);
+	mu_check(z14.size() == expected.size());
+	mu_check(z14.test(256, 0));
+	mu_check(!z14.test(256, 1));
+	mu_check(!z14.test(16384, 0));
+	mu_check(z14.test(16383, 0));
+
+	std::set<std::pair<TileCoordinate, TileCoordinate>> seen;
+	z14.forEach([&](TileCoordinate x, TileCoordinate y) {
+		seen.insert(std::make_pair(x, y));
+	});
+	mu_check(seen == expected);
+
+	PreciseTileCoordinatesSet z3(3);
+	z3.set(7, 1);
+	z3.set(2, 5);
+	size_t visited = 0;
+	z3.forEach([&](TileCoordinate x, TileCoordinate y) {
+		mu_check((x == 7 && y == 1) || (x == 2 && y == 5));
+		visited++;
+	});
+	mu_check(visited == 2);
+
+	// Lossy sets visit every tile under each underlying tile
+	LossyTileCoordinatesSet z5(5, z3);
+	visited = 0;
+	z5.forEach([&](TileCoordinate x, TileCoordinate y) {
+		mu_check(z5.test(x, y));
+		visited++;
+	});
+	mu_check(visited == z5.size());
+	mu_check(visited == 32);
+}
+
 MU_TEST_SUITE(test_suite_tile_coordinates_set) {
 	MU_RUN_TEST(test_tile_coordinates_set);
+	MU_RUN_TEST(test_tile_coordinates_set_containers);
 }
 
 int main() {
@@ -0,0 +1,198 @@
+#include <iostream>
+#include <algorithm>
+#include <map>
+#include "external/minunit.h"
+#include "tile_enumerator.h"
+
+// The order tiles were written in when they were all collected and sorted
+// up front: breadth-first for z0..z5, then depth-first by z6 tile.
+bool sortedOrderLess(const ZoomedTileCoordinates& a, const ZoomedTileCoordinates& b) {
+	const unsigned int aZoom = a.first, bZoom = b.first;
+	const bool aLowZoom = aZoom < 6, bLowZoom = bZoom < 6;
+	if (aLowZoom != bLowZoom)
+		return aLowZoom;
+
+	if (aLowZoom) {
+		if (aZoom != bZoom) return aZoom < bZoom;
+		if (a.second.x != b.second.x) return a.second.x < b.second.x;
+		return a.second.y < b.second.y;
+	}
+
+	for (unsigned int z = 6; z <= std::max(aZoom, bZoom); z++) {
+		if (aZoom < z || bZoom < z)
+			return aZoom < bZoom;
+
+		const auto aXz = a.second.x >> (aZoom - z), aYz = a.second.y >> (aZoom - z);
+		const auto bXz = b.second.x >> (bZoom - z), bYz = b.second.y >> (bZoom - z);
+		if (aXz != bXz) return aXz < bXz;
+		if (aYz != bYz) return aYz < bYz;
+	}
+	return false;
+}
+
+MU_TEST(test_tile_enumerator) {
+	const unsigned int endZoom = 10;
+	std::vector<std::shared_ptr<TileCoordinatesSet>> zooms;
+	for (unsigned int zoom = 0; zoom <= endZoom; zoom++)
+		zooms.push_back(std::make_shared<PreciseTileCoordinatesSet>(zoom));
+
+	// Scatter some z10 tiles, setting their ancestors too
+	for (TileCoordinate i = 0; i < 500; i++) {
+		TileCoordinate x = (i * 7919) % 1024, y = (i * 104729 + i * i) % 1024;
+		for (int zoom = endZoom; zoom >= 0; zoom--) {
+			zooms[zoom]->set(x, y);
+			x /= 2;
+			y /= 2;
+		}
+	}
+
+	// Leave out the western half of the world from z3 up
+	auto filter = [](unsigned int zoom, TileCoordinate x, TileCoordinate y) {
+		return zoom < 3 || x >= (1u << (zoom - 1));
+	};
+
+	const unsigned int startZoom = 2;
+	std::vector<ZoomedTileCoordinates> expected;
+	for (unsigned int zoom = startZoom; zoom <= endZoom; zoom++)
+		zooms[zoom]->forEach([&](TileCoordinate x, TileCoordinate y) {
+			if (filter(zoom, x, y))
+				expected.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
+		});
+	std::sort(expected.begin(), expected.end(), sortedOrderLess);
+
+	TileEnumerator enumerator(zooms, startZoom, endZoom, filter);
+	const std::vector<size_t> counts = enumerator.count();
+	size_t total = 0;
+	for (unsigned int zoom = 0; zoom <= endZoom; zoom++) {
+		total += counts[zoom];
+		if (zoom < startZoom) mu_check(counts[zoom] == 0);
+	}
+	mu_check(total == expected.size());
+
+	std::vector<ZoomedTileCoordinates> actual, batch;
+	bool weighted = true;
+	while (enumerator.next(batch)) {
+		size_t weight = 0;
+		for (size_t i = 0; i < batch.size(); i++) {
+			// Only the last tile of a batch may take it to the limit
+			if (weight >= 1000) weighted = false;
+			weight += TileEnumerator::tileWeight(batch[i].first);
+		}
+		actual.insert(actual.end(), batch.begin(), batch.end());
+	}
+	mu_check(weighted);
+	mu_check(actual.size() == expected.size());
+	mu_check(actual == expected);
+	mu_check(!enumerator.next(batch));
+	mu_check(batch.empty());
+}
+
+MU_TEST(test_tile_enumerator_cost) {
+	const unsigned int endZoom = 9;
+	std::vector<std::shared_ptr<TileCoordinatesSet>> zooms;
+	for (unsigned int zoom = 0; zoom <= endZoom; zoom++)
+		zooms.push_back(std::make_shared<PreciseTileCoordinatesSet>(zoom));
+
+	for (TileCoordinate i = 0; i < 300; i++) {
+		TileCoordinate x = (i * 7919) % 512, y = (i * 104729 + i * i) % 512;
+		for (int zoom = endZoom; zoom >= 0; zoom--) {
+			zooms[zoom]->set(x, y);
+			x /= 2;
+			y /= 2;
+		}
+	}
+
+	auto filter = [](unsigned int, TileCoordinate, TileCoordinate) { return true; };
+
+	// Tiles in the east of the world are busier, and low zooms are busiest
+	auto cost = [](unsigned int zoom, TileCoordinate x, TileCoordinate) -> size_t {
+		return (x << (endZoom - zoom)) * 100 / (zoom + 1);
+	};
+
+	std::vector<ZoomedTileCoordinates> expected;
+	for (unsigned int zoom = 0; zoom <= endZoom; zoom++)
+		zooms[zoom]->forEach([&](TileCoordinate x, TileCoordinate y) {
+			expected.push_back(std::make_pair(zoom, TileCoordinates(x, y)));
+		});
+	std::sort(expected.begin(), expected.end(), sortedOrderLess);
+
+	// Only z0..z6 tiles are estimated, each once
+	std::vector<size_t> estimates(endZoom + 1);
+	auto estimate = [&](unsigned int zoom, TileCoordinate x, TileCoordinate y) -> size_t {
+		estimates[zoom]++;
+		return cost(zoom, x, y);
+	};
+
+	// A z6 tile's cost is shared between its descendants at each zoom
+	std::map<std::pair<unsigned int, TileCoordinates>, size_t> clusterTiles;
+	for (const auto& tile : expected)
+		if (tile.first >= 6)
+			clusterTiles[std::make_pair(tile.first, TileCoordinates(tile.second.x >> (tile.first - 6), tile.second.y >> (tile.first - 6)))]++;
+	auto weight = [&](const ZoomedTileCoordinates& tile) -> size_t {
+		if (tile.first < 6)
+			return TileEnumerator::TILE_COST + cost(tile.first, tile.second.x, tile.second.y);
+		const TileCoordinates z6(tile.second.x >> (tile.first - 6), tile.second.y >> (tile.first - 6));
+		return TileEnumerator::TILE_COST + cost(6, z6.x, z6.y) / clusterTiles[std::make_pair(tile.first, z6)];
+	};
+
+	TileEnumerator enumerator(zooms, 0, endZoom, filter, estimate);
+	std::vector<ZoomedTileCoordinates> actual, batch;
+	std::vector<size_t> weights;
+	bool weighted = true;
+	while (enumerator.next(batch, weights)) {
+		size_t total = 0;
+		if (weights.size() != batch.size()) weighted = false;
+		for (size_t i = 0; i < batch.size(); i++) {
+			if (total >= 10000) weighted = false;
+			total += weight(batch[i]);
+			if (i < weights.size() && weights[i] != weight(batch[i])) weighted = false;
+		}
+		actual.insert(actual.end(), batch.begin(), batch.end());
+	}
+	mu_check(weighted);
+	mu_check(actual.size() == expected.size());
+	bool estimatedLowZooms = true;
+	for (unsigned int zoom = 0; zoom <= endZoom; zoom++)
+		if (estimates[zoom] != (zoom <= 6 ? zooms[zoom]->size() : 0))
+			estimatedLowZooms = false;
+	mu_check(estimatedLowZooms);
+
+	// Low zooms come first, most expensive first; then z6 tiles, most
+	// expensive first, each followed by its descendants in the usual order
+	bool lowZoomsOrdered = true, z6TilesOrdered = true, clustered = true;
+	size_t lastCost = SIZE_MAX, lastZ6Cost = SIZE_MAX;
+	ZoomedTileCoordinates lastZ6;
+	for (size_t i = 0; i < actual.size(); i++) {
+		const unsigned int zoom = actual[i].first;
+		const TileCoordinates& tile = actual[i].second;
+		if (zoom < 6) {
+			if (i > 0 && actual[i - 1].first >= 6) lowZoomsOrdered = false;
+			if (cost(zoom, tile.x, tile.y) > lastCost) lowZoomsOrdered = false;
+			lastCost = cost(zoom, tile.x, tile.y);
+		} else if (zoom == 6) {
+			if (cost(zoom, tile.x, tile.y) > lastZ6Cost) z6TilesOrdered = false;
+			lastZ6Cost = cost(zoom, tile.x, tile.y);
+			lastZ6 = actual[i];
+		} else {
+			if ((tile.x >> (zoom - 6)) != lastZ6.second.x || (tile.y >> (zoom - 6)) != lastZ6.second.y) clustered = false;
+			if (!sortedOrderLess(actual[i - 1], actual[i])) clustered = false;
+		}
+	}
+	mu_check(lowZoomsOrdered);
+	mu_check(z6TilesOrdered);
+	mu_check(clustered);
+
+	std::sort(actual.begin(), actual.end(), sortedOrderLess);
+	mu_check(actual == expected);
+}
+
+MU_TEST_SUITE(test_suite_tile_enumerator) {
+	MU_RUN_TEST(test_tile_enumerator);
+	MU_RUN_TEST(test_tile_enumerator_cost);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_enumerator);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,143 @@
+#include <iostream>
+#include <random>
+#include "external/minunit.h"
+#include <future>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include "tile_data_base.h"
+
+template<typename OO> void sortOutputObjects(
+	const size_t threadNum,
+	boost::asio::thread_pool* pool,
+	Z6Objects<OO>& objects
+);
+
+// The order objects were sorted in before keys existed: by parent tile at
+// each zoom from z6 to the index zoom, x before y.
+bool clusterLess(unsigned int indexZoom, Z6Offset aX, Z6Offset aY, Z6Offset bX, Z6Offset bY) {
+	for (size_t z = CLUSTER_ZOOM; z <= indexZoom; z++) {
+		const auto aXz = aX / (1 << (indexZoom - z));
+		const auto bXz = bX / (1 << (indexZoom - z));
+		if (aXz != bXz)
+			return aXz < bXz;
+
+		const auto aYz = aY / (1 << (indexZoom - z));
+		const auto bYz = bY / (1 << (indexZoom - z));
+		if (aYz != bYz)
+			return aYz < bYz;
+	}
+	return false;
+}
+
+MU_TEST(test_z6_key) {
+	const unsigned int indexZoom = 14;
+	bool roundtrips = true, ordered = true;
+	for (unsigned int x = 0; x < 256; x++) {
+		for (unsigned int y = 0; y < 256; y++) {
+			const Z6Key key = z6Key(x, y);
+			if (z6KeyX(key) != x || z6KeyY(key) != y) roundtrips = false;
+
+			// Compare against a sample of other offsets
+			const Z6Offset otherX = (x * 37 + y) % 256, otherY = (y * 91 + x) % 256;
+			if ((key < z6Key(otherX, otherY)) != clusterLess(indexZoom, x, y, otherX, otherY))
+				ordered = false;
+		}
+	}
+	mu_check(roundtrips);
+	mu_check(ordered);
+}
+
+MU_TEST(test_sort_output_objects) {
+	const unsigned int indexZoom = 14;
+	Z6Objects<OutputObjectID> objects;
+	std::mt19937 rng(42);
+	for (uint64_t i = 0; i < 100000; i++) {
+		const Z6Offset x = rng() % 256, y = rng() % 256;
+		objects.push_back(z6Key(x, y), { OutputObject(POINT_, 0, i, 0, 0), (uint64_t)x << 8 | y });
+	}
+
+	boost::asio::thread_pool pool(4);
+	sortOutputObjects<OutputObjectID>(4, &pool, objects);
+	mu_check(objects.size() == 100000);
+
+	// Keys are sorted, ties keep the order they were added in, and each key
+	// still belongs to the same object
+	bool sorted = true, stable = true, paired = true;
+	for (size_t i = 0; i < objects.size(); i++) {
+		if (i > 0 && objects.keys[i - 1] > objects.keys[i]) sorted = false;
+		if (i > 0 && objects.keys[i - 1] == objects.keys[i] && objects.objects[i - 1].oo.objectID > objects.objects[i].oo.objectID) stable = false;
+		const uint64_t id = objects.objects[i].id;
+		if (objects.keys[i] != z6Key(id >> 8, id & 255)) paired = false;
+	}
+	mu_check(sorted);
+	mu_check(stable);
+	mu_check(paired);
+
+	// Each z10 tile's objects are the run of keys that starts at its first key
+	const unsigned int zoom = 10;
+	const size_t keySpan = size_t(1) << (2 * (indexZoom - zoom));
+	for (Z6Offset tileX = 0; tileX < 16; tileX += 5) {
+		for (Z6Offset tileY = 0; tileY < 16; tileY += 3) {
+			const Z6Key needle = z6Key(tileX << (indexZoom - zoom), tileY << (indexZoom - zoom));
+			size_t expected = 0;
+			for (size_t i = 0; i < objects.size(); i++) {
+				const uint64_t id = objects.objects[i].id;
+				if ((id >> 8) >> (indexZoom - zoom) == tileX && (id & 255) >> (indexZoom - zoom) == tileY)
+					expected++;
+			}
+
+			size_t found = 0;
+			for (size_t i = objects.lowerBound(needle); i < objects.size() && size_t(objects.keys[i] - needle) < keySpan; i++)
+				found++;
+			mu_check(found == expected);
+		}
+	}
+
+	mu_check(objects.lowerBound(0) == 0);
+
+	// Small inputs are sorted on one thread
+	Z6Objects<OutputObjectID> small;
+	for (uint64_t i = 0; i < 1000; i++)
+		small.push_back(z6Key(i % 7, i % 13), { OutputObject(POINT_, 0, i, 0, 0), i });
+	sortOutputObjects<OutputObjectID>(4, &pool, small);
+	bool smallSorted = true;
+	for (size_t i = 1; i < small.size(); i++)
+		if (small.keys[i - 1] > small.keys[i]) smallSorted = false;
+	mu_check(smallSorted);
+
+	Z6Objects<OutputObjectID> empty;
+	mu_check(empty.lowerBound(1234) == 0);
+
+	// Sorts running as tasks on the pool they take helpers from, as z6
+	// tiles are finalized, all finish even with every pool thread busy
+	boost::asio::thread_pool busyPool(2);
+	std::vector<Z6Objects<OutputObjectID>> clusters(4);
+	std::vector<std::future<void>> tasks;
+	for (auto& cluster : clusters) {
+		for (uint64_t i = 0; i < 80000; i++)
+			cluster.push_back(z6Key(rng() % 256, rng() % 256), { OutputObject(POINT_, 0, i, 0, 0), i });
+		auto task = std::make_shared<std::packaged_task<void()>>([&busyPool, &cluster]() {
+			sortOutputObjects<OutputObjectID>(4, &busyPool, cluster);
+		});
+		tasks.push_back(task->get_future());
+		boost::asio::post(busyPool, [task]() { (*task)(); });
+	}
+	bool clustersSorted = true;
+	for (size_t c = 0; c < clusters.size(); c++) {
+		tasks[c].get();
+		for (size_t i = 1; i < clusters[c].size(); i++)
+			if (clusters[c].keys[i - 1] > clusters[c].keys[i]) clustersSorted = false;
+	}
+	mu_check(clustersSorted);
+}
+
+MU_TEST_SUITE(test_suite_tile_sorting) {
+	MU_RUN_TEST(test_z6_key);
+	MU_RUN_TEST(test_sort_output_objects);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_sorting);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}
@@ -0,0 +1,103 @@
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#include "external/minunit.h"
+#include "tile_writer.h"
+
+MU_TEST(test_tile_writer) {
+	std::vector<std::string> written;
+	std::vector<uint64_t> sequences;
+	int64_t maxInFlight = 0;
+	std::atomic<size_t> pushed(0);
+
+	{
+		TileWriter writer(
+			3,
+			8,
+			[](RenderedTile& tile) { tile.output = tile.data + "!"; },
+			[&](RenderedTile& tile) {
+				written.push_back(tile.output);
+				sequences.push_back(tile.sequence);
+				// A renderer may not have counted its push yet
+				maxInFlight = std::max(maxInFlight, int64_t(pushed.load()) - int64_t(written.size()) + 1);
+			}
+		);
+
+		// Four renderers push 250 tiles each
+		std::vector<std::thread> renderers;
+		for (unsigned int t = 0; t < 4; t++)
+			renderers.emplace_back([&writer, &pushed, t]() {
+				for (unsigned int i = 0; i < 250; i++) {
+					writer.push(14, TileCoordinates(t, i), std::to_string(t * 1000 + i));
+					pushed++;
+				}
+			});
+		for (auto& renderer : renderers)
+			renderer.join();
+
+		writer.finish();
+	}
+
+	mu_check(written.size() == 1000);
+
+	// Tiles are written in the order they were pushed, each compressed once
+	bool ordered = true, compressed = true;
+	for (size_t i = 0; i < sequences.size(); i++) {
+		if (sequences[i] != i) ordered = false;
+		if (written[i].back() != '!' || written[i].find('!') != written[i].size() - 1) compressed = false;
+	}
+	mu_check(ordered);
+	mu_check(compressed);
+
+	// Renderers were held back so that only `capacity` tiles were in flight
+	mu_check(maxInFlight <= 8);
+}
+
+MU_TEST(test_tile_writer_errors) {
+	std::vector<TileCoordinate> written;
+	std::atomic<size_t> compressed(0);
+	TileWriter writer(
+		2,
+		4,
+		[&](RenderedTile& tile) {
+			compressed++;
+			if (tile.index.y == 5) throw std::runtime_error("bad tile");
+			tile.output = tile.data;
+		},
+		[&](RenderedTile& tile) {
+			if (tile.output.empty()) throw std::runtime_error("empty tile");
+			written.push_back(tile.index.y);
+		}
+	);
+	for (unsigned int i = 0; i < 100; i++)
+		writer.push(14, TileCoordinates(0, i), "tile");
+
+	bool threw = false;
+	try {
+		writer.finish();
+	} catch (std::runtime_error& e) {
+		threw = (std::string(e.what()) == "bad tile");
+	}
+	mu_check(threw);
+
+	// The tile that failed wasn't written, and neither were tiles pushed once
+	// the writer knew about it, beyond those already queued
+	bool skipped = true;
+	for (TileCoordinate y : written)
+		if (y == 5) skipped = false;
+	mu_check(skipped);
+	mu_check(written.size() >= 5);
+	mu_check(written.size() < 5 + 4);
+	mu_check(compressed < 6 + 4);
+}
+
+MU_TEST_SUITE(test_suite_tile_writer) {
+	MU_RUN_TEST(test_tile_writer);
+	MU_RUN_TEST(test_tile_writer_errors);
+}
+
+int main() {
+	MU_RUN_SUITE(test_suite_tile_writer);
+	MU_REPORT();
+	return MU_EXIT_CODE;
+}